@@ -0,0 +1,112 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Bump allocator over one anonymous mapping backed by 2 MiB pages, for the
+// big voxel and code buffers. With ARENA_HUGETLB the mapping first tries
+// MAP_HUGETLB, which needs pages reserved in /proc/sys/vm/nr_hugepages;
+// otherwise, or when none are free, it falls back to ordinary pages with
+// madvise(MADV_HUGEPAGE) so transparent huge pages can back it. Fewer,
+// larger pages cut the TLB misses of the sort's scattered writes.
+//
+// Pages are only faulted in when touched, so an arena can reserve a worst
+// case it may never use. Such callers pass ARENA_NORESERVE, so the kernel
+// does not charge the whole bound against the overcommit limit, and leave
+// ARENA_HUGETLB off, as hugetlb takes the whole size out of the reserved
+// pool up front. Arenas sized exactly keep normal accounting, so a request
+// the system cannot back fails here rather than at first touch.
+// Allocations never move or grow: size the arena from a counting pass or a
+// bound first. Everything is released at once by arena_destroy.
+
+#define ARENA_PAGE_BYTES ((size_t)2 << 20)
+
+// Flags for arena_init
+#define ARENA_HUGETLB 1
+#define ARENA_NORESERVE 2 // a worst-case bound, mostly left untouched
+
+typedef enum { ARENA_NORMAL, ARENA_THP, ARENA_HUGETLB_PAGES } arena_backing_t;
+
+typedef struct {
+    uint8_t *base;
+    size_t capacity;
+    size_t used;
+    arena_backing_t backing;
+} arena_t;
+
+static inline size_t arena_round(size_t bytes) {
+    return (bytes + ARENA_PAGE_BYTES - 1) / ARENA_PAGE_BYTES * ARENA_PAGE_BYTES;
+}
+
+// Maps room for capacity bytes. Returns 0, or -1 if not even an ordinary
+// mapping was possible.
+static inline int arena_init(arena_t *a, size_t capacity, int flags) {
+    *a = (arena_t){.capacity = arena_round(capacity > 0 ? capacity : 1)};
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (flags & ARENA_HUGETLB) {
+        p = mmap(NULL, a->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) a->backing = ARENA_HUGETLB_PAGES;
+    }
+#endif
+    if (p == MAP_FAILED) {
+        // Over-map by one huge page so the start can be aligned to one
+        size_t len = a->capacity + ARENA_PAGE_BYTES;
+        int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | (flags & ARENA_NORESERVE ? MAP_NORESERVE : 0);
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+        if (p == MAP_FAILED) {
+            return -1;
+        }
+        uintptr_t start = ((uintptr_t)p + ARENA_PAGE_BYTES - 1) & ~(uintptr_t)(ARENA_PAGE_BYTES - 1);
+        size_t head = start - (uintptr_t)p;
+        if (head > 0) munmap(p, head);
+        munmap((uint8_t *)start + a->capacity, ARENA_PAGE_BYTES - head);
+        p = (void *)start;
+#ifdef MADV_HUGEPAGE
+        if (madvise(p, a->capacity, MADV_HUGEPAGE) == 0) a->backing = ARENA_THP;
+#endif
+    }
+    a->base = (uint8_t *)p;
+    return 0;
+}
+
+// Carves bytes out of the arena, starting on a huge page boundary. Returns
+// NULL when the arena is full.
+static inline void *arena_alloc(arena_t *a, size_t bytes) {
+    size_t size = arena_round(bytes > 0 ? bytes : 1);
+    if (size > a->capacity - a->used) {
+        return NULL;
+    }
+    void *p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+// Capacity for a set of buffers allocated one after another
+static inline size_t arena_size(const size_t *sizes, int n) {
+    size_t total = 0;
+    for (int i = 0; i < n; ++i) total += arena_round(sizes[i] > 0 ? sizes[i] : 1);
+    return total;
+}
+
+static inline const char *arena_backing_name(const arena_t *a) {
+    switch (a->backing) {
+    case ARENA_HUGETLB_PAGES:
+        return "hugetlb 2 MiB pages";
+    case ARENA_THP:
+        return "transparent huge pages";
+    default:
+        return "4 KiB pages";
+    }
+}
+
+static inline void arena_destroy(arena_t *a) {
+    if (a->base) munmap(a->base, a->capacity);
+    a->base = NULL;
+    a->capacity = a->used = 0;
+}
+
+#endif // ARENA_H
@@ -0,0 +1,152 @@
+#!/usr/bin/env bash
+# Strong and weak scaling benchmark of the sequential, pthread and MPI
+# engines on synthetic volumes. Builds every program into a work directory,
+# generates the volumes with generate_volume, runs each engine at every
+# worker count, checks its output against the sequential engine's with
+# compare_results and prints the scaling tables.
+#
+# Strong scaling keeps one EDGE^3 volume and adds workers; speedup is
+# against the sequential engine. Weak scaling gives every worker a
+# WEAK_EDGE^3 block stacked along z; efficiency is the engine's own time
+# at the first worker count over its time at N workers.
+
+set -euo pipefail
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+WORK=bench
+WORKERS="1 2 4"
+EDGE=256
+WEAK_EDGE=128
+PATTERN=noise
+DENSITY=0.25
+REPEAT=3
+CC=${CC:-gcc}
+MPICC=${MPICC:-mpicc}
+CFLAGS=${CFLAGS:--O2}
+MPIRUN=${MPIRUN:-mpirun}
+MPIRUN_FLAGS=${MPIRUN_FLAGS:-}
+
+usage() {
+    cat <<EOF
+Usage: $0 [options]
+  -w "N ..."   thread and rank counts (default "$WORKERS")
+  -e EDGE      strong scaling volume edge (default $EDGE)
+  -s EDGE      weak scaling volume edge per worker (default $WEAK_EDGE)
+  -p PATTERN   noise, sphere, shells or slab (default $PATTERN)
+  -d DENSITY   fraction of active voxels (default $DENSITY)
+  -r N         runs per measurement, the best one counts (default $REPEAT)
+  -o DIR       work directory for binaries, volumes and outputs (default $WORK)
+Environment: CC, MPICC, CFLAGS, MPIRUN, MPIRUN_FLAGS (e.g. --oversubscribe)
+EOF
+}
+
+while getopts "w:e:s:p:d:r:o:h" opt; do
+    case $opt in
+    w) WORKERS=$OPTARG ;;
+    e) EDGE=$OPTARG ;;
+    s) WEAK_EDGE=$OPTARG ;;
+    p) PATTERN=$OPTARG ;;
+    d) DENSITY=$OPTARG ;;
+    r) REPEAT=$OPTARG ;;
+    o) WORK=$OPTARG ;;
+    *) usage; exit 1 ;;
+    esac
+done
+
+mkdir -p "$WORK"
+cd "$WORK"
+
+echo "Building in $WORK"
+$CC $CFLAGS -o generate_volume "$SRC/generate_volume.c" -lm
+$CC $CFLAGS -pthread -o sequential_program "$SRC/sequential_program.c"
+$CC $CFLAGS -pthread -o pthread_program "$SRC/pthread_program.c"
+$CC $CFLAGS -pthread -o compare_results "$SRC/compare_results.c"
+HAVE_MPI=0
+if command -v "$MPICC" >/dev/null && command -v "$MPIRUN" >/dev/null; then
+    $MPICC $CFLAGS -o mpi_program "$SRC/mpi_program.c"
+    HAVE_MPI=1
+else
+    echo "MPI not found, skipping the MPI engine"
+fi
+
+# generate NAME X Y Z: creates NAME.raw and NAME.mhd unless they exist
+generate() {
+    if [ ! -f "$1.mhd" ]; then
+        ./generate_volume --dims "$2" "$3" "$4" --pattern "$PATTERN" --density "$DENSITY" "$1.raw" >/dev/null
+    fi
+}
+
+# run ENGINE WORKERS HEADER: prints the best processing time of REPEAT runs
+# and checks the output against reference.txt
+run() {
+    local engine=$1 workers=$2 header=$3 best="" out time
+    local cmd
+    case $engine in
+    sequential) cmd=(./sequential_program --header "$header"); out=morton_codes_seq.txt ;;
+    pthread) cmd=(./pthread_program "$workers" --header "$header"); out=morton_codes_pthread.txt ;;
+    mpi) cmd=($MPIRUN $MPIRUN_FLAGS -np "$workers" ./mpi_program --header "$header"); out=morton_codes_mpi.txt ;;
+    esac
+    for _ in $(seq "$REPEAT"); do
+        time=$("${cmd[@]}" | grep 'Processing time' | awk '{print $(NF-1)}')
+        if [ -z "$time" ]; then
+            echo "Error: $engine with $workers workers failed on $header" >&2
+            exit 1
+        fi
+        best=$(awk -v a="$time" -v b="$best" 'BEGIN { print (b == "" || a < b) ? a : b }')
+    done
+    if [ "$engine" = sequential ]; then
+        cp "$out" reference.txt
+    elif ! ./compare_results reference.txt "$out" | grep -q 'Files are identical'; then
+        echo "Error: $engine with $workers workers does not match the sequential output on $header" >&2
+        exit 1
+    fi
+    echo "$best"
+}
+
+# row ENGINE WORKERS TIME BASELINE [BASE_WORKERS]: speedup and efficiency
+# against BASELINE. Weak scaling passes the worker count the baseline ran
+# with, and the speedup is scaled by the growth of the volume.
+row() {
+    awk -v e="$1" -v n="$2" -v t="$3" -v b="$4" -v bn="${5:-0}" 'BEGIN {
+        s = bn ? (n / bn) * b / t : b / t
+        eff = bn ? b / t : s / n
+        printf "%-12s %7d %10.4f %9.2f %11.2f\n", e, n, t, s, eff
+    }'
+}
+
+header() {
+    printf "%-12s %7s %10s %9s %11s\n" engine workers "time [s]" speedup efficiency
+}
+
+ENGINES="pthread"
+[ "$HAVE_MPI" = 1 ] && ENGINES="$ENGINES mpi"
+
+echo
+echo "Strong scaling: ${EDGE}^3 $PATTERN volume, density $DENSITY, best of $REPEAT"
+generate strong "$EDGE" "$EDGE" "$EDGE"
+header
+seq_time=$(run sequential 1 strong.mhd)
+row sequential 1 "$seq_time" "$seq_time"
+for engine in $ENGINES; do
+    for n in $WORKERS; do
+        t=$(run "$engine" "$n" strong.mhd)
+        row "$engine" "$n" "$t" "$seq_time"
+    done
+done
+
+echo
+echo "Weak scaling: ${WEAK_EDGE}^3 $PATTERN voxels per worker, density $DENSITY, best of $REPEAT"
+header
+declare -A base
+base_n=""
+for n in $WORKERS; do
+    generate "weak$n" "$WEAK_EDGE" "$WEAK_EDGE" $((WEAK_EDGE * n))
+    # The sequential run only provides the reference output here
+    run sequential 1 "weak$n.mhd" >/dev/null
+    base_n=${base_n:-$n}
+    for engine in $ENGINES; do
+        t=$(run "$engine" "$n" "weak$n.mhd")
+        base[$engine]=${base[$engine]:-$t}
+        row "$engine" "$n" "$t" "${base[$engine]}" "$base_n"
+    done
+done
@@ -0,0 +1,518 @@
+#ifndef CODE_FILE_H
+#define CODE_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "morton.h"
+#include "volume_config.h"
+
+// Output files for the sorted code stream, as text (one decimal code per
+// line), as fixed-width text (every code zero-padded to the width of the
+// largest key, so line i starts at byte i * (width + 1)) or in a compact
+// binary format:
+//
+//   header   64 bytes: magic "MORTONCB", version, significant key bits, the
+//            volume dimensions, threshold, code count, block count, index
+//            offset and the nominal codes per block
+//   blocks   each block stores its first code as a varint and every other
+//            code as the varint of its difference to the previous one
+//   index    one 24-byte entry per block: first code, file offset, code
+//            count and encoded length, so any block can be read on its own
+//
+// All integers are little endian. Blocks never span writers, so ranks can
+// write their blocks one after another and the index is concatenated.
+
+#define CODE_FILE_MAGIC "MORTONCB"
+#define CODE_FILE_VERSION 1
+#define CODE_FILE_HEADER_BYTES 64
+#define CODE_FILE_INDEX_ENTRY_BYTES 24
+#define CODE_BLOCK_CODES 4096
+#define CODE_WRITE_BUFFER ((size_t)1 << 20)
+// Longest varint of a 64-bit value, or a decimal code plus newline
+#define CODE_MAX_ENCODED 21
+
+typedef enum { CODE_FORMAT_TEXT, CODE_FORMAT_FIXED, CODE_FORMAT_BINARY } code_format_t;
+
+typedef struct {
+    uint32_t key_bits;
+    uint32_t x_size;
+    uint32_t y_size;
+    uint32_t z_size;
+    uint32_t threshold;
+    uint32_t block_codes;
+    uint64_t count;
+    uint64_t num_blocks;
+    uint64_t index_offset;
+} code_file_header_t;
+
+typedef struct {
+    uint64_t first;
+    uint64_t offset;
+    uint32_t count;
+    uint32_t bytes;
+} code_block_t;
+
+static inline int code_format_parse(const char *name, code_format_t *format) {
+    if (strcmp(name, "text") == 0) {
+        *format = CODE_FORMAT_TEXT;
+    } else if (strcmp(name, "fixed") == 0) {
+        *format = CODE_FORMAT_FIXED;
+    } else if (strcmp(name, "binary") == 0) {
+        *format = CODE_FORMAT_BINARY;
+    } else {
+        fprintf(stderr, "Error: Unknown output format %s (expected text, fixed or binary)\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static inline const char *code_format_extension(code_format_t format) {
+    return format == CODE_FORMAT_BINARY ? "bin" : "txt";
+}
+
+static inline code_file_header_t code_file_header(const volume_config_t *cfg, int key_bits) {
+    return (code_file_header_t){.key_bits = (uint32_t)key_bits,
+                                .x_size = cfg->x_size,
+                                .y_size = cfg->y_size,
+                                .z_size = cfg->z_size,
+                                .threshold = cfg->threshold,
+                                .block_codes = CODE_BLOCK_CODES};
+}
+
+static inline void code_put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void code_put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline uint32_t code_get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline uint64_t code_get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline size_t code_put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Digits of the largest key with key_bits significant bits
+static inline int code_fixed_width(int key_bits) {
+    uint64_t max = key_bits >= 64 ? UINT64_MAX : ((uint64_t)1 << key_bits) - 1;
+    int width = 1;
+    while (max >= 10) {
+        max /= 10;
+        width++;
+    }
+    return width;
+}
+
+static inline size_t code_decimal_digits(uint64_t v) {
+    size_t n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+static inline size_t code_varint_bytes(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// Writes v zero-padded to width digits followed by a newline
+static inline size_t code_put_fixed(char *p, uint64_t v, int width) {
+    for (int i = width - 1; i >= 0; --i) {
+        p[i] = (char)('0' + v % 10);
+        v /= 10;
+    }
+    p[width] = '\n';
+    return (size_t)width + 1;
+}
+
+// Writes v in decimal followed by a newline and returns the length
+static inline size_t code_put_decimal(char *p, uint64_t v) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (size_t i = 0; i < n; ++i) p[i] = digits[n - 1 - i];
+    p[n] = '\n';
+    return n + 1;
+}
+
+static inline int code_file_write_at(FILE *fp, uint64_t offset, const void *data, size_t len) {
+    if (fseeko(fp, (off_t)offset, SEEK_SET) != 0 || fwrite(data, 1, len, fp) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline void code_put_index_entry(uint8_t *p, const code_block_t *block) {
+    code_put_u64(p, block->first);
+    code_put_u64(p + 8, block->offset);
+    code_put_u32(p + 16, block->count);
+    code_put_u32(p + 20, block->bytes);
+}
+
+static inline void code_put_header(uint8_t *p, const code_file_header_t *hdr) {
+    memset(p, 0, CODE_FILE_HEADER_BYTES);
+    memcpy(p, CODE_FILE_MAGIC, 8);
+    code_put_u32(p + 8, CODE_FILE_VERSION);
+    code_put_u32(p + 12, hdr->key_bits);
+    code_put_u32(p + 16, hdr->x_size);
+    code_put_u32(p + 20, hdr->y_size);
+    code_put_u32(p + 24, hdr->z_size);
+    code_put_u32(p + 28, hdr->threshold);
+    code_put_u64(p + 32, hdr->count);
+    code_put_u64(p + 40, hdr->num_blocks);
+    code_put_u64(p + 48, hdr->index_offset);
+    code_put_u32(p + 56, hdr->block_codes);
+}
+
+// Writes the index at index_offset and the header, which records where the
+// index starts
+static inline int code_file_write_index(FILE *fp, code_file_header_t *hdr, const code_block_t *index,
+                                        size_t num_blocks, uint64_t index_offset) {
+    hdr->num_blocks = num_blocks;
+    hdr->index_offset = index_offset;
+
+    uint8_t entry[CODE_FILE_INDEX_ENTRY_BYTES];
+    if (fseeko(fp, (off_t)index_offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    for (size_t b = 0; b < num_blocks; ++b) {
+        code_put_index_entry(entry, &index[b]);
+        if (fwrite(entry, 1, sizeof(entry), fp) != sizeof(entry)) {
+            return -1;
+        }
+    }
+
+    uint8_t header[CODE_FILE_HEADER_BYTES];
+    code_put_header(header, hdr);
+    return code_file_write_at(fp, 0, header, sizeof(header));
+}
+
+// Bytes a fresh writer produces for codes[0..n) in the given format, not
+// counting the binary header. Lets parallel writers compute their file
+// offsets before they encode anything.
+static inline uint64_t code_encoded_size(code_format_t format, int key_bits, const morton_key_t *codes,
+                                         size_t n) {
+    uint64_t bytes = 0;
+    if (format == CODE_FORMAT_FIXED) {
+        return (uint64_t)n * (code_fixed_width(key_bits) + 1);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (format == CODE_FORMAT_TEXT) {
+            bytes += code_decimal_digits(codes[i]) + 1;
+        } else if (i % CODE_BLOCK_CODES == 0) {
+            bytes += code_varint_bytes(codes[i]);
+        } else {
+            bytes += code_varint_bytes((morton_key_t)(codes[i] - codes[i - 1]));
+        }
+    }
+    return bytes;
+}
+
+// Buffered writer for every format. Codes must arrive in ascending order
+// for the binary deltas to stay small. Without a file (code_writer_open_mem)
+// the writer only encodes into its buffer and the caller takes the bytes.
+typedef struct {
+    FILE *fp;
+    code_format_t format;
+    int width; // digits per code in the fixed-width format
+    uint8_t *buf;
+    size_t buf_cap;
+    size_t buf_len;
+    uint64_t offset; // file offset of buf[0]
+    uint64_t count;
+
+    morton_key_t prev;
+    code_block_t block;
+    code_block_t *index;
+    size_t num_blocks;
+    size_t cap_blocks;
+    int failed;
+} code_writer_t;
+
+// Opens path for writing at offset. Offset 0 creates or truncates the file
+// and, for the binary format, reserves the header; a non-zero offset
+// continues a file another writer started.
+static inline int code_writer_open(code_writer_t *w, const char *path, code_format_t format, int key_bits,
+                                   uint64_t offset) {
+    *w = (code_writer_t){
+        .format = format, .width = code_fixed_width(key_bits), .buf_cap = CODE_WRITE_BUFFER, .offset = offset};
+    w->fp = fopen(path, offset == 0 ? "wb" : "r+b");
+    w->buf = malloc(CODE_WRITE_BUFFER);
+    if (!w->fp || !w->buf || (offset > 0 && fseeko(w->fp, (off_t)offset, SEEK_SET) != 0)) {
+        if (w->fp) fclose(w->fp);
+        free(w->buf);
+        w->fp = NULL;
+        w->buf = NULL;
+        return -1;
+    }
+    if (format == CODE_FORMAT_BINARY && offset == 0) {
+        memset(w->buf, 0, CODE_FILE_HEADER_BYTES);
+        w->buf_len = CODE_FILE_HEADER_BYTES;
+    }
+    return 0;
+}
+
+// Encodes into a buffer of buf_cap bytes only; the first code lands at file
+// offset offset. The caller takes the bytes with code_writer_take before
+// the buffer fills, which holds at least buf_cap / CODE_MAX_ENCODED codes.
+static inline int code_writer_open_mem(code_writer_t *w, code_format_t format, int key_bits, uint64_t offset,
+                                       size_t buf_cap) {
+    *w = (code_writer_t){.format = format, .width = code_fixed_width(key_bits), .offset = offset};
+    w->buf_cap = buf_cap > CODE_MAX_ENCODED ? buf_cap : CODE_MAX_ENCODED;
+    w->buf = malloc(w->buf_cap);
+    return w->buf ? 0 : -1;
+}
+
+// Hands out the bytes encoded since the last take; they stay valid until
+// the next code_writer_put
+static inline const uint8_t *code_writer_take(code_writer_t *w, size_t *len) {
+    *len = w->buf_len;
+    w->offset += w->buf_len;
+    w->buf_len = 0;
+    return w->buf;
+}
+
+static inline void code_writer_flush(code_writer_t *w) {
+    // A memory writer cannot drain its buffer, so the bytes are lost
+    if (!w->fp || (w->buf_len > 0 && fwrite(w->buf, 1, w->buf_len, w->fp) != w->buf_len)) {
+        w->failed = 1;
+    }
+    w->offset += w->buf_len;
+    w->buf_len = 0;
+}
+
+static inline void code_writer_end_block(code_writer_t *w) {
+    if (w->block.count == 0) {
+        return;
+    }
+    if (w->num_blocks == w->cap_blocks) {
+        size_t cap = w->cap_blocks ? w->cap_blocks * 2 : 256;
+        code_block_t *index = realloc(w->index, cap * sizeof(code_block_t));
+        if (!index) {
+            w->failed = 1;
+            return;
+        }
+        w->index = index;
+        w->cap_blocks = cap;
+    }
+    w->block.bytes = (uint32_t)(w->offset + w->buf_len - w->block.offset);
+    w->index[w->num_blocks++] = w->block;
+    w->block.count = 0;
+}
+
+static inline void code_writer_put(code_writer_t *w, const morton_key_t *codes, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (w->buf_len + CODE_MAX_ENCODED > w->buf_cap) {
+            code_writer_flush(w);
+        }
+        morton_key_t code = codes[i];
+        if (w->format == CODE_FORMAT_TEXT) {
+            w->buf_len += code_put_decimal((char *)w->buf + w->buf_len, code);
+            continue;
+        }
+        if (w->format == CODE_FORMAT_FIXED) {
+            w->buf_len += code_put_fixed((char *)w->buf + w->buf_len, code, w->width);
+            continue;
+        }
+        if (w->block.count == 0) {
+            w->block.first = code;
+            w->block.offset = w->offset + w->buf_len;
+            w->buf_len += code_put_varint(w->buf + w->buf_len, code);
+        } else {
+            w->buf_len += code_put_varint(w->buf + w->buf_len, (morton_key_t)(code - w->prev));
+        }
+        w->prev = code;
+        if (++w->block.count == CODE_BLOCK_CODES) {
+            code_writer_end_block(w);
+        }
+    }
+    w->count += n;
+}
+
+// Closes the last block and flushes everything written so far; afterwards
+// w->offset is the end of this writer's data and w->index its blocks
+static inline int code_writer_end(code_writer_t *w) {
+    if (w->format == CODE_FORMAT_BINARY) {
+        code_writer_end_block(w);
+    }
+    if (w->fp) {
+        code_writer_flush(w);
+        if (fflush(w->fp) != 0) {
+            w->failed = 1;
+        }
+    }
+    return w->failed ? -1 : 0;
+}
+
+// Finishes the file. With a header the index is written after the data and
+// the header filled in; without one only the data is flushed.
+static inline int code_writer_close(code_writer_t *w, code_file_header_t *hdr) {
+    int rc = code_writer_end(w);
+    if (rc == 0 && hdr && w->format == CODE_FORMAT_BINARY) {
+        hdr->count = w->count;
+        rc = code_file_write_index(w->fp, hdr, w->index, w->num_blocks, w->offset);
+    }
+    if (w->fp && fclose(w->fp) != 0) rc = -1;
+    free(w->buf);
+    free(w->index);
+    w->fp = NULL;
+    w->buf = NULL;
+    w->index = NULL;
+    return rc;
+}
+
+// Random-access reader for the binary format
+typedef struct {
+    FILE *fp;
+    code_file_header_t hdr;
+    code_block_t *index;
+    uint8_t *scratch;
+    size_t scratch_cap;
+} code_reader_t;
+
+static inline int code_file_is_binary(const char *path) {
+    char magic[8];
+    FILE *fp = fopen(path, "rb");
+    int binary = fp && fread(magic, 1, 8, fp) == 8 && memcmp(magic, CODE_FILE_MAGIC, 8) == 0;
+    if (fp) fclose(fp);
+    return binary;
+}
+
+static inline int code_reader_open(code_reader_t *r, const char *path) {
+    *r = (code_reader_t){0};
+    uint8_t header[CODE_FILE_HEADER_BYTES];
+    r->fp = fopen(path, "rb");
+    if (!r->fp || fread(header, 1, sizeof(header), r->fp) != sizeof(header) ||
+        memcmp(header, CODE_FILE_MAGIC, 8) != 0 || code_get_u32(header + 8) != CODE_FILE_VERSION) {
+        fprintf(stderr, "Error: %s is not a binary code file\n", path);
+        if (r->fp) fclose(r->fp);
+        return -1;
+    }
+    r->hdr = (code_file_header_t){.key_bits = code_get_u32(header + 12),
+                                  .x_size = code_get_u32(header + 16),
+                                  .y_size = code_get_u32(header + 20),
+                                  .z_size = code_get_u32(header + 24),
+                                  .threshold = code_get_u32(header + 28),
+                                  .count = code_get_u64(header + 32),
+                                  .num_blocks = code_get_u64(header + 40),
+                                  .index_offset = code_get_u64(header + 48),
+                                  .block_codes = code_get_u32(header + 56)};
+    if (r->hdr.key_bits > MORTON_KEY_BITS) {
+        fprintf(stderr, "Error: %s holds %u-bit codes; rebuild with -DMORTON_KEY_BITS=64\n", path,
+                r->hdr.key_bits);
+        fclose(r->fp);
+        return -1;
+    }
+
+    uint8_t entry[CODE_FILE_INDEX_ENTRY_BYTES];
+    r->index = malloc((r->hdr.num_blocks > 0 ? r->hdr.num_blocks : 1) * sizeof(code_block_t));
+    if (!r->index || fseeko(r->fp, (off_t)r->hdr.index_offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Failed to read the block index of %s\n", path);
+        free(r->index);
+        fclose(r->fp);
+        return -1;
+    }
+    for (uint64_t b = 0; b < r->hdr.num_blocks; ++b) {
+        if (fread(entry, 1, sizeof(entry), r->fp) != sizeof(entry)) {
+            fprintf(stderr, "Error: Failed to read the block index of %s\n", path);
+            free(r->index);
+            fclose(r->fp);
+            return -1;
+        }
+        r->index[b] = (code_block_t){.first = code_get_u64(entry),
+                                     .offset = code_get_u64(entry + 8),
+                                     .count = code_get_u32(entry + 16),
+                                     .bytes = code_get_u32(entry + 20)};
+    }
+    return 0;
+}
+
+// Decodes one block of count codes from its bytes encoded bytes
+static inline int code_decode_block(const uint8_t *p, size_t bytes, uint32_t count, morton_key_t *out) {
+    const uint8_t *end = p + bytes;
+    morton_key_t code = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t v = 0;
+        int shift = 0;
+        do {
+            if (p == end || shift > 63) return -1;
+            v |= (uint64_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        code = i == 0 ? (morton_key_t)v : (morton_key_t)(code + v);
+        out[i] = code;
+    }
+    return 0;
+}
+
+// Decodes block b into out, which needs room for index[b].count codes
+static inline int code_reader_read_block(code_reader_t *r, uint64_t b, morton_key_t *out) {
+    const code_block_t *block = &r->index[b];
+    if (block->bytes > r->scratch_cap) {
+        uint8_t *scratch = realloc(r->scratch, block->bytes);
+        if (!scratch) return -1;
+        r->scratch = scratch;
+        r->scratch_cap = block->bytes;
+    }
+    if (fseeko(r->fp, (off_t)block->offset, SEEK_SET) != 0 ||
+        fread(r->scratch, 1, block->bytes, r->fp) != block->bytes) {
+        return -1;
+    }
+    return code_decode_block(r->scratch, block->bytes, block->count, out);
+}
+
+// Index of the block that would hold key: the last block whose first code
+// is not greater than key (0 if key precedes every block)
+static inline uint64_t code_reader_find_block(const code_reader_t *r, morton_key_t key) {
+    uint64_t lo = 0, hi = r->hdr.num_blocks;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->index[mid].first <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
+
+static inline void code_reader_close(code_reader_t *r) {
+    if (r->fp) fclose(r->fp);
+    free(r->index);
+    free(r->scratch);
+    r->fp = NULL;
+    r->index = NULL;
+    r->scratch = NULL;
+}
+
+#endif // CODE_FILE_H
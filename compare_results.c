@@ -1,83 +1,382 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define MAX_FILES 10
+// Files may hold codes of either key width, so compare them as 64-bit keys
+#define MORTON_KEY_BITS 64
+
+#include "code_file.h"
+#include "thread_pool.h"
+
+#define DEFAULT_MAX_DIFFS 10
+// Bytes of text one parse task handles
+#define PARSE_CHUNK_BYTES ((size_t)4 << 20)
+// Codes one compare task handles
+#define COMPARE_CHUNK_CODES ((size_t)1 << 20)
+
+// One input, memory-mapped and decoded into an array of codes
+typedef struct {
+    const char *path;
+    const uint8_t *map;
+    size_t map_len;
+    uint64_t *codes;
+    size_t count;
+} result_file_t;
+
+// Text is parsed in two passes over fixed-size chunks, like the pthread
+// engine's extraction: count the codes that start in every chunk, prefix
+// sum the counts, then parse each chunk straight into its slice
+typedef struct {
+    const char *text;
+    size_t len;
+    size_t *chunk_counts;
+    size_t *chunk_offsets;
+    uint64_t *codes;
+    size_t bad_offset; // first byte that is not part of a code, or len
+} parse_ctx_t;
+
+static inline int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Parses or, with out == NULL, only counts the codes that start in
+// [begin, end). A code that crosses end belongs to this chunk.
+size_t parse_range(parse_ctx_t *ctx, size_t begin, size_t end, uint64_t *out) {
+    const char *text = ctx->text;
+    size_t i = begin;
+    size_t n = 0;
+
+    // The tail of a code that started in the previous chunk
+    if (i > 0 && is_digit(text[i - 1])) {
+        while (i < ctx->len && is_digit(text[i])) i++;
+    }
+    while (i < end) {
+        char c = text[i];
+        if (c == '\n' || c == ' ' || c == '\r' || c == '\t') {
+            i++;
+            continue;
+        }
+        if (!is_digit(c)) {
+            if (out && i < ctx->bad_offset) ctx->bad_offset = i;
+            break;
+        }
+        uint64_t v = 0;
+        size_t start = i;
+        while (i < ctx->len && is_digit(text[i])) {
+            uint64_t digit = (uint64_t)(text[i] - '0');
+            if (v > (UINT64_MAX - digit) / 10) {
+                if (out && start < ctx->bad_offset) ctx->bad_offset = start;
+                return n;
+            }
+            v = v * 10 + digit;
+            i++;
+        }
+        if (out) out[n] = v;
+        n++;
+    }
+    return n;
+}
+
+void count_chunk_task(void *arg, size_t chunk, int worker) {
+    parse_ctx_t *ctx = (parse_ctx_t *)arg;
+    size_t begin = chunk * PARSE_CHUNK_BYTES;
+    size_t end = begin + PARSE_CHUNK_BYTES < ctx->len ? begin + PARSE_CHUNK_BYTES : ctx->len;
+    (void)worker;
+
+    ctx->chunk_counts[chunk] = parse_range(ctx, begin, end, NULL);
+}
+
+void parse_chunk_task(void *arg, size_t chunk, int worker) {
+    parse_ctx_t *ctx = (parse_ctx_t *)arg;
+    size_t begin = chunk * PARSE_CHUNK_BYTES;
+    size_t end = begin + PARSE_CHUNK_BYTES < ctx->len ? begin + PARSE_CHUNK_BYTES : ctx->len;
+    (void)worker;
+
+    parse_range(ctx, begin, end, ctx->codes + ctx->chunk_offsets[chunk]);
+}
+
+int load_text(thread_pool_t *pool, result_file_t *file) {
+    size_t num_chunks = (file->map_len + PARSE_CHUNK_BYTES - 1) / PARSE_CHUNK_BYTES;
+    parse_ctx_t ctx = {.text = (const char *)file->map,
+                       .len = file->map_len,
+                       .chunk_counts = malloc((num_chunks + 1) * sizeof(size_t)),
+                       .chunk_offsets = malloc((num_chunks + 1) * sizeof(size_t)),
+                       .bad_offset = file->map_len};
+    if (!ctx.chunk_counts || !ctx.chunk_offsets) {
+        free(ctx.chunk_counts);
+        free(ctx.chunk_offsets);
+        return -1;
+    }
+
+    pool_run(pool, num_chunks, count_chunk_task, &ctx);
+    size_t total = 0;
+    for (size_t c = 0; c < num_chunks; ++c) {
+        ctx.chunk_offsets[c] = total;
+        total += ctx.chunk_counts[c];
+    }
+    ctx.codes = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+    if (!ctx.codes) {
+        fprintf(stderr, "Error: Failed to allocate codes for %s\n", file->path);
+        free(ctx.chunk_counts);
+        free(ctx.chunk_offsets);
+        return -1;
+    }
+    pool_run(pool, num_chunks, parse_chunk_task, &ctx);
+    free(ctx.chunk_counts);
+    free(ctx.chunk_offsets);
+
+    if (ctx.bad_offset < file->map_len) {
+        fprintf(stderr, "Error: %s: unexpected data at byte %zu\n", file->path, ctx.bad_offset);
+        free(ctx.codes);
+        return -1;
+    }
+    file->codes = ctx.codes;
+    file->count = total;
+    return 0;
+}
+
+// Binary files decode one block per task into the block's place
+typedef struct {
+    const uint8_t *map;
+    const code_block_t *index;
+    const size_t *offsets;
+    uint64_t *codes;
+    int failed;
+} decode_ctx_t;
+
+void decode_block_task(void *arg, size_t block, int worker) {
+    decode_ctx_t *ctx = (decode_ctx_t *)arg;
+    const code_block_t *b = &ctx->index[block];
+    (void)worker;
+
+    if (code_decode_block(ctx->map + b->offset, b->bytes, b->count, ctx->codes + ctx->offsets[block]) != 0) {
+        ctx->failed = 1;
+    }
+}
+
+int load_binary(thread_pool_t *pool, result_file_t *file) {
+    code_reader_t reader;
+    if (code_reader_open(&reader, file->path) != 0) {
+        return -1;
+    }
+    size_t num_blocks = reader.hdr.num_blocks;
+    size_t *offsets = malloc((num_blocks + 1) * sizeof(size_t));
+    uint64_t *codes = malloc((reader.hdr.count > 0 ? reader.hdr.count : 1) * sizeof(uint64_t));
+    int rc = offsets && codes ? 0 : -1;
+
+    size_t total = 0;
+    for (size_t b = 0; rc == 0 && b < num_blocks; ++b) {
+        const code_block_t *block = &reader.index[b];
+        if (block->offset + block->bytes > file->map_len || total + block->count > reader.hdr.count) {
+            rc = -1;
+            break;
+        }
+        offsets[b] = total;
+        total += block->count;
+    }
+    if (rc == 0 && total != reader.hdr.count) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        decode_ctx_t ctx = {.map = file->map, .index = reader.index, .offsets = offsets, .codes = codes};
+        pool_run(pool, num_blocks, decode_block_task, &ctx);
+        rc = ctx.failed ? -1 : 0;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error: %s is damaged\n", file->path);
+        free(codes);
+    } else {
+        file->codes = codes;
+        file->count = total;
+    }
+    free(offsets);
+    code_reader_close(&reader);
+    return rc;
+}
+
+int load_file(thread_pool_t *pool, result_file_t *file) {
+    int fd = open(file->path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Failed to open file %s\n", file->path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    file->map_len = (size_t)st.st_size;
+    file->map = NULL;
+    if (file->map_len > 0) {
+        void *map = mmap(NULL, file->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Error: Failed to map file %s\n", file->path);
+            close(fd);
+            return -1;
+        }
+        madvise(map, file->map_len, MADV_WILLNEED);
+        file->map = map;
+    }
+    close(fd);
+
+    int binary = file->map_len >= 8 && memcmp(file->map, CODE_FILE_MAGIC, 8) == 0;
+    int rc = binary ? load_binary(pool, file) : load_text(pool, file);
+    if (file->map) {
+        munmap((void *)file->map, file->map_len);
+        file->map = NULL;
+    }
+    return rc;
+}
+
+// Every compare task counts the positions where some file differs from the
+// first one and keeps the first max_diffs of them; the tasks' lists are
+// concatenated in order afterwards
+typedef struct {
+    const result_file_t *files;
+    int num_files;
+    size_t count;
+    size_t max_diffs;
+    size_t *mismatches;
+    size_t *diff_counts;
+    size_t *diffs;
+} compare_ctx_t;
+
+void compare_chunk_task(void *arg, size_t chunk, int worker) {
+    compare_ctx_t *ctx = (compare_ctx_t *)arg;
+    size_t begin = chunk * COMPARE_CHUNK_CODES;
+    size_t end = begin + COMPARE_CHUNK_CODES < ctx->count ? begin + COMPARE_CHUNK_CODES : ctx->count;
+    const uint64_t *first = ctx->files[0].codes;
+    size_t mismatches = 0;
+    size_t *diffs = ctx->diffs + chunk * ctx->max_diffs;
+    (void)worker;
+
+    for (int f = 1; f < ctx->num_files; ++f) {
+        const uint64_t *other = ctx->files[f].codes;
+        for (size_t i = begin; i < end; ++i) {
+            if (other[i] != first[i]) {
+                mismatches++;
+                break;
+            }
+        }
+        if (mismatches) break;
+    }
+    if (mismatches == 0) {
+        ctx->mismatches[chunk] = 0;
+        ctx->diff_counts[chunk] = 0;
+        return;
+    }
+
+    // Slow path only for chunks with a difference
+    mismatches = 0;
+    for (size_t i = begin; i < end; ++i) {
+        for (int f = 1; f < ctx->num_files; ++f) {
+            if (ctx->files[f].codes[i] != first[i]) {
+                if (mismatches < ctx->max_diffs) diffs[mismatches] = i;
+                mismatches++;
+                break;
+            }
+        }
+    }
+    ctx->mismatches[chunk] = mismatches;
+    ctx->diff_counts[chunk] = mismatches < ctx->max_diffs ? mismatches : ctx->max_diffs;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] file1 file2 [file3 ...]\n", prog);
+    fprintf(stderr, "  --threads N        worker threads (default: online CPUs)\n");
+    fprintf(stderr, "  --max-diffs N      differing positions to print (default %d)\n", DEFAULT_MAX_DIFFS);
+    fprintf(stderr, "Files may be text (one code per line) or binary code files, in any mix.\n");
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s file1 file2 [file3 ...]\n", argv[0]);
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_diffs = DEFAULT_MAX_DIFFS;
+    const char **paths = malloc(argc * sizeof(char *));
+    int num_files = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-diffs") == 0 && i + 1 < argc) {
+            max_diffs = (size_t)strtoull(argv[++i], NULL, 10);
+        } else {
+            paths[num_files++] = argv[i];
+        }
+    }
+    if (num_threads > POOL_MAX_THREADS) {
+        num_threads = POOL_MAX_THREADS;
+    }
+    if (num_files < 2 || num_threads <= 0) {
+        print_usage(argv[0]);
+        free(paths);
         return 1;
     }
 
-    int num_files = argc - 1;
-    if (num_files > MAX_FILES) {
-        fprintf(stderr, "Error: Maximum number of files to compare is %d\n", MAX_FILES);
+    thread_pool_t *pool = pool_create((int)num_threads);
+    result_file_t *files = calloc(num_files, sizeof(result_file_t));
+    if (!pool || !files) {
+        fprintf(stderr, "Error: Failed to set up the comparison\n");
         return 1;
     }
-
-    FILE *fps[MAX_FILES];
+    double start_time = pool_now();
     for (int i = 0; i < num_files; i++) {
-        fps[i] = fopen(argv[i + 1], "r");
-        if (!fps[i]) {
-            fprintf(stderr, "Error: Failed to open file %s\n", argv[i + 1]);
-            // Close previously opened files
+        files[i].path = paths[i];
+        if (load_file(pool, &files[i]) != 0) {
             for (int j = 0; j < i; j++) {
-                fclose(fps[j]);
+                free(files[j].codes);
             }
             return 1;
         }
     }
 
-    unsigned int codes[MAX_FILES];
-    size_t line = 1;
     int identical = 1;
-    int eof_flags[MAX_FILES];
-    memset(eof_flags, 0, sizeof(eof_flags));
-
-    while (1) {
-        int num_eof = 0;
-        int read_success = 1;
-
-        // Attempt to read from each file
+    size_t count = files[0].count;
+    for (int i = 1; i < num_files; i++) {
+        if (files[i].count != files[0].count) {
+            identical = 0;
+        }
+        if (files[i].count < count) {
+            count = files[i].count;
+        }
+    }
+    if (!identical) {
+        printf("Files have different lengths:\n");
         for (int i = 0; i < num_files; i++) {
-            if (eof_flags[i]) {
-                num_eof++;
-                continue;
-            }
-            if (fscanf(fps[i], "%u", &codes[i]) != 1) {
-                eof_flags[i] = 1;
-                num_eof++;
-            }
+            printf("  %s: %zu codes\n", files[i].path, files[i].count);
         }
+        printf("Comparing the first %zu codes.\n", count);
+    }
 
-        if (num_eof == num_files) {
-            // All files have reached EOF
-            break;
-        } else if (num_eof > 0) {
-            // Some files have reached EOF before others
-            printf("Files have different lengths.\n");
-            identical = 0;
-            break;
-        }
+    size_t num_chunks = (count + COMPARE_CHUNK_CODES - 1) / COMPARE_CHUNK_CODES;
+    compare_ctx_t ctx = {.files = files,
+                         .num_files = num_files,
+                         .count = count,
+                         .max_diffs = max_diffs,
+                         .mismatches = calloc(num_chunks + 1, sizeof(size_t)),
+                         .diff_counts = calloc(num_chunks + 1, sizeof(size_t)),
+                         .diffs = malloc((num_chunks * max_diffs + 1) * sizeof(size_t))};
+    if (!ctx.mismatches || !ctx.diff_counts || !ctx.diffs) {
+        fprintf(stderr, "Error: Failed to allocate comparison buffers\n");
+        return 1;
+    }
+    pool_run(pool, num_chunks, compare_chunk_task, &ctx);
 
-        // Compare codes
-        for (int i = 1; i < num_files; i++) {
-            if (codes[i] != codes[0]) {
-                printf("Difference at line %zu:\n", line);
-                for (int j = 0; j < num_files; j++) {
-                    printf("  %s: %u\n", argv[j + 1], codes[j]);
-                }
-                identical = 0;
-                goto cleanup;
+    size_t total_mismatches = 0;
+    size_t printed = 0;
+    for (size_t c = 0; c < num_chunks; ++c) {
+        total_mismatches += ctx.mismatches[c];
+        for (size_t d = 0; d < ctx.diff_counts[c] && printed < max_diffs; ++d, ++printed) {
+            size_t pos = ctx.diffs[c * max_diffs + d];
+            printf("Difference at line %zu:\n", pos + 1);
+            for (int j = 0; j < num_files; j++) {
+                printf("  %s: %llu\n", files[j].path, (unsigned long long)files[j].codes[pos]);
             }
         }
-        line++;
     }
-
-cleanup:
-    for (int i = 0; i < num_files; i++) {
-        fclose(fps[i]);
+    if (total_mismatches > 0) {
+        identical = 0;
+        printf("Mismatching lines: %zu of %zu\n", total_mismatches, count);
     }
 
     if (identical) {
@@ -85,6 +384,17 @@ cleanup:
     } else {
         printf("Files are NOT identical.\n");
     }
+    printf("Comparison time: %f seconds\n", pool_now() - start_time);
+
+    for (int i = 0; i < num_files; i++) {
+        free(files[i].codes);
+    }
+    free(files);
+    free(paths);
+    free(ctx.mismatches);
+    free(ctx.diff_counts);
+    free(ctx.diffs);
+    pool_destroy(pool);
 
     return 0;
 }
@@ -92,10 +402,17 @@ cleanup:
 
 /*
 Kompilácia
-gcc -o sequential_program sequential_program.c
+gcc -pthread -o sequential_program sequential_program.c
 gcc -pthread -o pthread_program pthread_program.c
 mpicc -o mpi_program mpi_program.c
-gcc -o compare_results compare_results.c
+gcc -pthread -o compare_results compare_results.c
+gcc -o generate_volume generate_volume.c -lm
+gcc -o query_box query_box.c
+
+# 64-bitové Morton kódy pre objemy s osou väčšou ako 1024 voxelov
+gcc -pthread -DMORTON_KEY_BITS=64 -o sequential_program64 sequential_program.c
+gcc -pthread -DMORTON_KEY_BITS=64 -o pthread_program64 pthread_program.c
+mpicc -DMORTON_KEY_BITS=64 -o mpi_program64 mpi_program.c
 
 # Spustenie sekvenčného programu
 ./sequential_program
@@ -106,9 +423,73 @@ gcc -o compare_results compare_results.c
 # Spustenie MPI programu s 4 procesmi
 mpirun -np 4 ./mpi_program
 
+# Hybridný režim: jeden proces na uzol, 16 vlákien na proces (MPI_THREAD_FUNNELED)
+mpirun --map-by ppr:1:node --bind-to none -np 4 ./mpi_program --threads 16
+
+# Vlastný objem: rozmery a prah z príkazového riadku alebo z hlavičky .mhd/.nhdr
+./sequential_program --input scan.raw --dims 2048 2048 900 --threshold 40
+./pthread_program 4 --header scan.mhd
+
+# Syntetický objem (noise, sphere, shells, slab) s hlavičkou .mhd namiesto c8.raw
+./generate_volume --dims 512 512 512 --pattern shells --density 0.1 shells.raw
+./pthread_program 4 --header shells.mhd
+
+# Silné a slabé škálovanie všetkých programov vrátane kontroly výstupov (zostaví všetko do bench/)
+./benchmark.sh -w "1 2 4 8" -e 512 -s 256 -p noise
+MPIRUN_FLAGS=--oversubscribe ./benchmark.sh -w "1 2 4"
+
+# Sekvenčný program mimo pamäte: triedené behy sa ukladajú na disk, špička RSS ~ limit
+./sequential_program --memory-limit 256M --tmp-dir /scratch
+
+# Binárny výstup (hlavička, bloky delta + varint, index blokov) namiesto textu
+./pthread_program 4 --format binary
+mpirun -np 4 ./mpi_program --format binary
+
+# Text s pevnou šírkou (nuly na začiatku, riadok i začína na bajte i * (šírka + 1)); MPI zapisuje kolektívne
+mpirun -np 4 ./mpi_program --format fixed
+
+# Čas po fázach (load, scan, combine, sort, exchange, merge, write) ako JSON; - znamená stdout
+./pthread_program 4 --json stages.json
+mpirun -np 4 ./mpi_program --json -
+
+# Hardware počítadlá (cykly, inštrukcie, LLC/branch/dTLB misses) po fázach a vláknach; vyžaduje perf_event_paranoid <= 2
+./pthread_program 4 --perf --json stages.json
+
+# Veľké buffre ležia na 2 MiB stránkach: hugetlb, ak sú rezervované, inak transparent huge pages
+echo 1024 > /proc/sys/vm/nr_hugepages
+./pthread_program 4
+
+# NUMA: vlákna pripnuté na jadrá, každé číta a zapisuje svoje slaby na svojom uzle; vypíše rozloženie stránok po uzloch
+./pthread_program 16 --numa
+
+# Lineárny oktálový strom (plné skupiny 8 súrodencov sa zlúčia do rodiča), uzly po úrovniach v octree_*.bin
+./sequential_program --octree
+./pthread_program 8 --octree
+cmp octree_seq.bin octree_pthread.bin
+
+# Aktívne voxely v kvádri (rohy vrátane) zo zoradeného výstupu; binárny súbor sa číta len po potrebných blokoch
+./query_box morton_codes_pthread.bin 300 300 100 340 340 140 --output box.txt
+./query_box morton_codes_seq.txt 0 0 0 63 63 63 --count --repeat 1000
+
+# Viac prahov naraz: objem sa načíta a prejde raz, voxely sa delia do pásiem hodnôt; počty v threshold_counts_pthread.txt
+./pthread_program 8 --sweep 25,50,75,100,125,150,175,200,225,250
+
+# Časová séria snímok: znovu sa prejdú len z-slaby so zmeneným checksumom, zoradené kódy sa záplatujú;
+# rozdiel oproti predchádzajúcej snímke v morton_added_seq.* a morton_removed_seq.*, stav v frames.state
+./sequential_program --input frame_001.raw --frame-state frames.state
+./sequential_program --input frame_002.raw --frame-state frames.state
+
+# Súvislé komponenty (6-susednosť): pre každý kód menovka = najmenší kód jeho komponentu, veľkosti v component_sizes_*.txt
+./pthread_program 8 --components
+mpirun -np 4 ./mpi_program --components
+cmp component_labels_pthread.txt component_labels_mpi.txt
+
 # Porovnanie sekvenčného a pthread výsledku
 ./compare_results morton_codes_seq.txt morton_codes_pthread.txt
 
 # Porovnanie všetkých troch výsledkov
 ./compare_results morton_codes_seq.txt morton_codes_pthread.txt morton_codes_mpi.txt
+
+# Textové a binárne súbory možno miešať; vypíše počet rozdielov a prvých N pozícií
+./compare_results --max-diffs 20 --threads 8 morton_codes_seq.txt morton_codes_pthread.bin morton_codes_mpi.bin
 */
\ No newline at end of file
@@ -0,0 +1,313 @@
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "code_file.h"
+#include "morton.h"
+#include "thread_pool.h"
+
+// 6-connected components of the active voxels, straight from the sorted
+// codes. Every voxel looks up its +x, +y and +z neighbours: the neighbour's
+// code comes from a masked increment of one coordinate's bits. Most
+// neighbours lie within a few codes of the voxel in Morton order, so the
+// next COMPONENT_NEAR_CODES codes are checked first; the others are looked
+// up in a directory over the top bits of the key. The directory has
+// about as many buckets as there are codes and holds where each bucket's
+// codes start, so a lookup reads two entries and binary searches the
+// handful of codes between them. Neighbours that are both active are
+// joined in a concurrent union-find over code indices:
+//
+//   - a root is only ever linked under a smaller root, with a compare and
+//     swap that fails if another thread linked it first, so every parent
+//     index is at most its child's and the forest never has cycles;
+//   - finds point every node they pass at its grandparent with plain
+//     atomic stores, which is safe because an ancestor stays an ancestor.
+//
+// The root of a finished tree is its smallest index, so every component is
+// labeled with its smallest code, whatever the thread count or the engine.
+
+#define COMPONENT_CHUNK_CODES ((size_t)1 << 16)
+#define COMPONENT_NEAR_CODES 8
+#define COMPONENT_TOP_SIZES 5
+
+typedef struct {
+    size_t count;
+    morton_key_t *labels; // smallest code of every component, ascending
+    size_t *sizes;        // voxels of every component
+} component_set_t;
+
+typedef struct {
+    const morton_key_t *codes;
+    size_t n;
+    uint32_t size[3];
+    morton_key_t axis_mask[3];
+    int bucket_shift;
+    size_t num_buckets;
+    size_t *directory; // num_buckets + 1 code indices
+    size_t *parent;
+    size_t *sizes; // per root index
+    morton_key_t *labels;
+    size_t *chunk_roots; // roots per chunk, then the exclusive prefix sum
+    component_set_t *set;
+} components_ctx_t;
+
+static inline size_t uf_find(size_t *parent, size_t i) {
+    size_t p = __atomic_load_n(&parent[i], __ATOMIC_RELAXED);
+    while (p != i) {
+        size_t gp = __atomic_load_n(&parent[p], __ATOMIC_RELAXED);
+        if (gp != p) {
+            __atomic_store_n(&parent[i], gp, __ATOMIC_RELAXED);
+        }
+        i = p;
+        p = gp;
+    }
+    return i;
+}
+
+static inline void uf_unite(size_t *parent, size_t a, size_t b) {
+    for (;;) {
+        a = uf_find(parent, a);
+        b = uf_find(parent, b);
+        if (a == b) {
+            return;
+        }
+        if (a < b) {
+            size_t swap = a;
+            a = b;
+            b = swap;
+        }
+        // a is the larger root; it goes under b unless it stopped being a root
+        size_t expected = a;
+        if (__atomic_compare_exchange_n(&parent[a], &expected, b, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+// Index of key in codes, or SIZE_MAX
+static inline size_t components_find(const components_ctx_t *ctx, morton_key_t key) {
+    size_t bucket = (size_t)(key >> ctx->bucket_shift);
+    if (bucket >= ctx->num_buckets) {
+        return SIZE_MAX;
+    }
+    size_t lo = ctx->directory[bucket], hi = ctx->directory[bucket + 1];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ctx->codes[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < ctx->directory[bucket + 1] && ctx->codes[lo] == key ? lo : SIZE_MAX;
+}
+
+// Runs tasks on the pool, or one after another without one
+static inline void components_run(thread_pool_t *pool, size_t num_tasks, pool_task_fn fn, void *ctx) {
+    if (pool) {
+        pool_run(pool, num_tasks, fn, ctx);
+    } else {
+        for (size_t task = 0; task < num_tasks; ++task) fn(ctx, task, 0);
+    }
+}
+
+static inline void components_chunk(const components_ctx_t *ctx, size_t chunk, size_t *begin, size_t *end) {
+    *begin = chunk * COMPONENT_CHUNK_CODES;
+    *end = *begin + COMPONENT_CHUNK_CODES < ctx->n ? *begin + COMPONENT_CHUNK_CODES : ctx->n;
+}
+
+// Every code is its own root; the chunk also fills the directory entries
+// of the buckets from just after its previous code's up to its last code's
+static inline void components_init_task(void *arg, size_t chunk, int worker) {
+    components_ctx_t *ctx = (components_ctx_t *)arg;
+    size_t begin, end;
+    (void)worker;
+    components_chunk(ctx, chunk, &begin, &end);
+    size_t bucket = begin > 0 ? (size_t)(ctx->codes[begin - 1] >> ctx->bucket_shift) + 1 : 0;
+    for (size_t i = begin; i < end; ++i) {
+        ctx->parent[i] = i;
+        size_t last = (size_t)(ctx->codes[i] >> ctx->bucket_shift);
+        for (; bucket <= last; ++bucket) ctx->directory[bucket] = i;
+    }
+    if (end == ctx->n) {
+        for (; bucket <= ctx->num_buckets; ++bucket) ctx->directory[bucket] = end;
+    }
+}
+
+static inline void components_union_task(void *arg, size_t chunk, int worker) {
+    components_ctx_t *ctx = (components_ctx_t *)arg;
+    size_t begin, end;
+    (void)worker;
+    components_chunk(ctx, chunk, &begin, &end);
+    for (size_t i = begin; i < end; ++i) {
+        morton_key_t code = ctx->codes[i];
+        size_t near_end = ctx->n - i > COMPONENT_NEAR_CODES ? i + 1 + COMPONENT_NEAR_CODES : ctx->n;
+        uint32_t coord[3];
+        morton_decode(code, &coord[0], &coord[1], &coord[2]);
+        for (int axis = 0; axis < 3; ++axis) {
+            if (coord[axis] + 1 >= ctx->size[axis]) continue;
+            // Adding one to this axis' bits: the other bits are set so the
+            // carry runs through them, then put back
+            morton_key_t mask = ctx->axis_mask[axis];
+            morton_key_t next = (((code | ~mask) + ((morton_key_t)1 << axis)) & mask) | (code & ~mask);
+            size_t j = i + 1;
+            while (j < near_end && ctx->codes[j] < next) j++;
+            if (j == near_end) {
+                j = components_find(ctx, next);
+            } else if (ctx->codes[j] != next) {
+                j = SIZE_MAX;
+            }
+            if (j != SIZE_MAX) {
+                uf_unite(ctx->parent, i, j);
+            }
+        }
+    }
+}
+
+static inline void components_label_task(void *arg, size_t chunk, int worker) {
+    components_ctx_t *ctx = (components_ctx_t *)arg;
+    size_t begin, end, roots = 0;
+    (void)worker;
+    components_chunk(ctx, chunk, &begin, &end);
+    // Sizes are added per run of equal roots, so a large component does
+    // not have every thread hammering one counter
+    size_t run_root = SIZE_MAX, run_len = 0;
+    for (size_t i = begin; i < end; ++i) {
+        size_t root = uf_find(ctx->parent, i);
+        ctx->labels[i] = ctx->codes[root];
+        roots += root == i;
+        if (root != run_root) {
+            if (run_len > 0) __atomic_fetch_add(&ctx->sizes[run_root], run_len, __ATOMIC_RELAXED);
+            run_root = root;
+            run_len = 0;
+        }
+        run_len++;
+    }
+    if (run_len > 0) __atomic_fetch_add(&ctx->sizes[run_root], run_len, __ATOMIC_RELAXED);
+    ctx->chunk_roots[chunk] = roots;
+}
+
+static inline void components_collect_task(void *arg, size_t chunk, int worker) {
+    components_ctx_t *ctx = (components_ctx_t *)arg;
+    size_t begin, end, k = ctx->chunk_roots[chunk];
+    (void)worker;
+    components_chunk(ctx, chunk, &begin, &end);
+    for (size_t i = begin; i < end; ++i) {
+        if (ctx->parent[i] == i) {
+            ctx->set->labels[k] = ctx->codes[i];
+            ctx->set->sizes[k] = ctx->sizes[i];
+            k++;
+        }
+    }
+}
+
+// Labels codes[0..n), sorted and unique, of an x_size x y_size x z_size
+// volume: labels[i] becomes the smallest code of code i's component, and
+// set lists every component. Runs on the pool's threads, or on the calling
+// thread without a pool. Returns 0, or -1 if an allocation failed.
+static inline int components_label(thread_pool_t *pool, const morton_key_t *codes, size_t n, uint32_t x_size,
+                                   uint32_t y_size, uint32_t z_size, morton_key_t *labels, component_set_t *set) {
+    morton_key_t coord_bits = morton_expand((uint32_t)((1ull << MORTON_COORD_BITS) - 1));
+    int key_bits = morton_grid(x_size, y_size, z_size).key_bits;
+    components_ctx_t ctx = {.codes = codes,
+                            .n = n,
+                            .size = {x_size, y_size, z_size},
+                            .axis_mask = {coord_bits, coord_bits << 1, coord_bits << 2},
+                            .labels = labels,
+                            .set = set};
+    size_t num_chunks = (n + COMPONENT_CHUNK_CODES - 1) / COMPONENT_CHUNK_CODES;
+    *set = (component_set_t){0};
+    while (ctx.bucket_shift < key_bits && ((size_t)1 << (key_bits - ctx.bucket_shift - 1)) >= n) {
+        ctx.bucket_shift++;
+    }
+    ctx.num_buckets = (size_t)1 << (key_bits - ctx.bucket_shift);
+    ctx.directory = malloc((ctx.num_buckets + 1) * sizeof(size_t));
+    ctx.parent = malloc((n > 0 ? n : 1) * sizeof(size_t));
+    ctx.sizes = calloc(n > 0 ? n : 1, sizeof(size_t));
+    ctx.chunk_roots = malloc((num_chunks + 1) * sizeof(size_t));
+    if (!ctx.directory || !ctx.parent || !ctx.sizes || !ctx.chunk_roots) {
+        free(ctx.directory);
+        free(ctx.parent);
+        free(ctx.sizes);
+        free(ctx.chunk_roots);
+        return -1;
+    }
+
+    components_run(pool, num_chunks, components_init_task, &ctx);
+    components_run(pool, num_chunks, components_union_task, &ctx);
+    components_run(pool, num_chunks, components_label_task, &ctx);
+
+    size_t count = 0;
+    for (size_t c = 0; c < num_chunks; ++c) {
+        size_t roots = ctx.chunk_roots[c];
+        ctx.chunk_roots[c] = count;
+        count += roots;
+    }
+    set->count = count;
+    set->labels = malloc((count > 0 ? count : 1) * sizeof(morton_key_t));
+    set->sizes = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    int rc = 0;
+    if (!set->labels || !set->sizes) {
+        rc = -1;
+    } else {
+        components_run(pool, num_chunks, components_collect_task, &ctx);
+    }
+    free(ctx.directory);
+    free(ctx.parent);
+    free(ctx.sizes);
+    free(ctx.chunk_roots);
+    return rc;
+}
+
+static inline void components_free(component_set_t *set) {
+    free(set->labels);
+    free(set->sizes);
+    *set = (component_set_t){0};
+}
+
+static inline void components_print_summary(const component_set_t *set, size_t num_voxels, FILE *fp) {
+    size_t largest[COMPONENT_TOP_SIZES] = {0};
+    size_t largest_at[COMPONENT_TOP_SIZES] = {0};
+    size_t singletons = 0;
+    for (size_t k = 0; k < set->count; ++k) {
+        size_t size = set->sizes[k];
+        singletons += size == 1;
+        for (int t = 0; t < COMPONENT_TOP_SIZES; ++t) {
+            if (size > largest[t]) {
+                memmove(largest + t + 1, largest + t, (COMPONENT_TOP_SIZES - 1 - t) * sizeof(size_t));
+                memmove(largest_at + t + 1, largest_at + t, (COMPONENT_TOP_SIZES - 1 - t) * sizeof(size_t));
+                largest[t] = size;
+                largest_at[t] = k;
+                break;
+            }
+        }
+    }
+    fprintf(fp, "Connected components (6-connected): %zu, %zu single voxels, mean size %.1f\n", set->count,
+            singletons, set->count ? (double)num_voxels / set->count : 0.0);
+    fprintf(fp, "  Largest:");
+    for (int t = 0; t < COMPONENT_TOP_SIZES && largest[t] > 0; ++t) {
+        fprintf(fp, " %zu (%.1f%%, label %" PRImorton ")", largest[t], 100.0 * largest[t] / num_voxels,
+                set->labels[largest_at[t]]);
+    }
+    fprintf(fp, "\n");
+}
+
+// One line per component, by label: the label and the voxel count
+static inline int components_write_sizes(const char *path, const component_set_t *set) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return -1;
+    }
+    int ok = 1;
+    for (size_t k = 0; k < set->count && ok; ++k) {
+        ok = fprintf(fp, "%" PRImorton " %zu\n", set->labels[k], set->sizes[k]) > 0;
+    }
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+#endif // COMPONENTS_H
@@ -0,0 +1,221 @@
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "loser_tree.h"
+#include "morton.h"
+
+// External merge sort for more Morton keys than fit in memory. Sorted runs
+// are appended to one unlinked temporary file; the merge streams every run
+// back through a small buffer that the loser tree refills on demand. When
+// the buffers would get too small for the number of runs, groups of runs
+// are first merged into longer runs in the same file.
+
+// Smallest per-run read buffer the merge accepts before it adds a pass
+#define SPILL_MIN_BUFFER_KEYS 4096
+
+typedef struct {
+    off_t offset; // in bytes
+    size_t len;   // in keys
+} spill_run_t;
+
+typedef struct {
+    int fd;
+    off_t end;
+    spill_run_t *runs;
+    size_t num_runs;
+    size_t cap_runs;
+    size_t merge_rounds;
+} spill_file_t;
+
+typedef int (*spill_emit_fn)(void *ctx, const morton_key_t *keys, size_t n);
+
+// Creates the spill file in dir (or $TMPDIR, or /tmp) and unlinks it at
+// once, so it disappears with the process
+static inline int spill_open(spill_file_t *s, const char *dir) {
+    *s = (spill_file_t){.fd = -1};
+    if (!dir) dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/morton_spill_XXXXXX", dir);
+    s->fd = mkstemp(path);
+    if (s->fd < 0) {
+        fprintf(stderr, "Error: Failed to create spill file in %s\n", dir);
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+static inline void spill_close(spill_file_t *s) {
+    if (s->fd >= 0) close(s->fd);
+    free(s->runs);
+    s->fd = -1;
+    s->runs = NULL;
+}
+
+static inline int spill_write(spill_file_t *s, const morton_key_t *keys, size_t n) {
+    const char *p = (const char *)keys;
+    size_t bytes = n * sizeof(morton_key_t);
+    while (bytes > 0) {
+        ssize_t put = pwrite(s->fd, p, bytes, s->end);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) {
+            fprintf(stderr, "Error: Failed to write spill file\n");
+            return -1;
+        }
+        p += put;
+        bytes -= (size_t)put;
+        s->end += put;
+    }
+    return 0;
+}
+
+static inline int spill_push_run(spill_file_t *s, off_t offset, size_t len) {
+    if (s->num_runs == s->cap_runs) {
+        size_t cap = s->cap_runs ? s->cap_runs * 2 : 16;
+        spill_run_t *runs = realloc(s->runs, cap * sizeof(spill_run_t));
+        if (!runs) {
+            return -1;
+        }
+        s->runs = runs;
+        s->cap_runs = cap;
+    }
+    s->runs[s->num_runs++] = (spill_run_t){.offset = offset, .len = len};
+    return 0;
+}
+
+// Appends keys[0..n), already sorted, as one run
+static inline int spill_write_run(spill_file_t *s, const morton_key_t *keys, size_t n) {
+    off_t offset = s->end;
+    if (spill_write(s, keys, n) != 0) {
+        return -1;
+    }
+    return spill_push_run(s, offset, n);
+}
+
+// Streams one run back into its merge buffer
+typedef struct {
+    int fd;
+    off_t pos;
+    size_t remaining;
+    morton_key_t *buf;
+    size_t cap;
+    int failed;
+} spill_reader_t;
+
+static inline int spill_refill(void *arg, const morton_key_t **block, size_t *len) {
+    spill_reader_t *r = (spill_reader_t *)arg;
+    if (r->remaining == 0) {
+        return 0;
+    }
+    size_t n = r->remaining < r->cap ? r->remaining : r->cap;
+    size_t bytes = n * sizeof(morton_key_t);
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t got = pread(r->fd, (char *)r->buf + done, bytes - done, r->pos + (off_t)done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            r->failed = 1;
+            return 0;
+        }
+        done += (size_t)got;
+    }
+    r->pos += (off_t)bytes;
+    r->remaining -= n;
+    *block = r->buf;
+    *len = n;
+    return 1;
+}
+
+// Merges runs[first..first+count) and hands the output to emit in pieces.
+// work holds work_keys keys and is split into count input buffers and one
+// output buffer.
+static inline int spill_merge_range(spill_file_t *s, size_t first, size_t count, morton_key_t *work,
+                                    size_t work_keys, spill_emit_fn emit, void *ctx) {
+    size_t per_buf = work_keys / (count + 1);
+    spill_reader_t *readers = malloc(count * sizeof(spill_reader_t));
+    lt_run_t *sources = malloc(count * sizeof(lt_run_t));
+    if (!readers || !sources || per_buf == 0) {
+        free(readers);
+        free(sources);
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const spill_run_t *run = &s->runs[first + i];
+        readers[i] = (spill_reader_t){
+            .fd = s->fd, .pos = run->offset, .remaining = run->len, .buf = work + i * per_buf, .cap = per_buf};
+        sources[i] = (lt_run_t){.block = NULL, .pos = 0, .len = 0, .refill = spill_refill, .ctx = &readers[i]};
+    }
+
+    int rc = 0;
+    loser_tree_t lt;
+    if (lt_init(&lt, sources, (int)count) != 0) {
+        rc = -1;
+    } else {
+        morton_key_t *out = work + count * per_buf;
+        size_t n;
+        do {
+            n = lt_merge(&lt, out, per_buf);
+            if (n > 0 && emit(ctx, out, n) != 0) {
+                rc = -1;
+                break;
+            }
+        } while (n == per_buf);
+        lt_free(&lt);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (readers[i].failed) {
+            fprintf(stderr, "Error: Failed to read spill file\n");
+            rc = -1;
+        }
+    }
+    free(readers);
+    free(sources);
+    return rc;
+}
+
+static inline int spill_append_emit(void *ctx, const morton_key_t *keys, size_t n) {
+    return spill_write((spill_file_t *)ctx, keys, n);
+}
+
+// Merges every run in the file into emit, using work[0..work_keys) as the
+// only buffer memory
+static inline int spill_merge(spill_file_t *s, morton_key_t *work, size_t work_keys, spill_emit_fn emit,
+                              void *ctx) {
+    size_t max_fan_in = work_keys / SPILL_MIN_BUFFER_KEYS;
+    if (max_fan_in > 0) max_fan_in--;
+    if (max_fan_in < 2) {
+        fprintf(stderr, "Error: Not enough memory to merge spilled runs\n");
+        return -1;
+    }
+
+    // Intermediate passes: fold the oldest runs into one longer run
+    while (s->num_runs > max_fan_in) {
+        off_t offset = s->end;
+        size_t len = 0;
+        for (size_t i = 0; i < max_fan_in; ++i) {
+            len += s->runs[i].len;
+        }
+        if (spill_merge_range(s, 0, max_fan_in, work, work_keys, spill_append_emit, s) != 0) {
+            return -1;
+        }
+        memmove(s->runs, s->runs + max_fan_in, (s->num_runs - max_fan_in) * sizeof(spill_run_t));
+        s->num_runs -= max_fan_in;
+        if (spill_push_run(s, offset, len) != 0) {
+            return -1;
+        }
+        s->merge_rounds++;
+    }
+    s->merge_rounds++;
+    return spill_merge_range(s, 0, s->num_runs, work, work_keys, emit, ctx);
+}
+
+#endif // EXTERNAL_SORT_H
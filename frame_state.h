@@ -0,0 +1,224 @@
+#ifndef FRAME_STATE_H
+#define FRAME_STATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "code_file.h"
+#include "morton.h"
+#include "volume_config.h"
+
+// State carried from one frame of a time series to the next: a checksum of
+// every z-slab and the frame's sorted codes. The next frame rescans only the
+// slabs whose checksum changed and patches the sorted codes instead of
+// sorting everything again. File layout, little endian:
+//
+//   header     64 bytes: magic "MORTONFS", version, significant key bits,
+//              the volume dimensions, threshold and code count
+//   checksums  one 64-bit checksum per z-slab
+//   codes      the sorted codes, 4 bytes each when keys fit 32 bits, else 8
+
+#define FRAME_STATE_MAGIC "MORTONFS"
+#define FRAME_STATE_VERSION 1
+#define FRAME_STATE_HEADER_BYTES 64
+#define FRAME_CHECKSUM_MULTIPLIER 0x9e3779b97f4a7c15ull
+
+typedef struct {
+    uint64_t *checksums; // z_size entries
+    morton_key_t *codes;
+    size_t count;
+} frame_state_t;
+
+// 64-bit checksum of one slab. Each step is a bijection of the running
+// value for a fixed word, so changing a single word always changes it.
+static inline uint64_t frame_checksum(const uint8_t *data, size_t len) {
+    uint64_t h = FRAME_CHECKSUM_MULTIPLIER ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * FRAME_CHECKSUM_MULTIPLIER;
+        h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    for (size_t k = 0; i < len; ++i, k += 8) tail |= (uint64_t)data[i] << k;
+    h = (h ^ tail) * FRAME_CHECKSUM_MULTIPLIER;
+    return h ^ (h >> 32);
+}
+
+static inline void frame_state_free(frame_state_t *st) {
+    free(st->checksums);
+    free(st->codes);
+    *st = (frame_state_t){0};
+}
+
+// Loads the previous frame's state for a volume of cfg's dimensions and
+// threshold. Returns 1 when it was loaded, 0 when there is none, it belongs
+// to another volume layout or its codes are not a sorted set of voxels of
+// this volume (the frame is then rebuilt in full), or -1 on a read error.
+static inline int frame_state_load(const char *path, const volume_config_t *cfg, int key_bits, frame_state_t *st) {
+    *st = (frame_state_t){0};
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return 0;
+    }
+    uint8_t header[FRAME_STATE_HEADER_BYTES];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, FRAME_STATE_MAGIC, 8) != 0 ||
+        code_get_u32(header + 8) != FRAME_STATE_VERSION) {
+        fprintf(stderr, "Error: %s is not a frame state file\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (code_get_u32(header + 12) != (uint32_t)key_bits || code_get_u32(header + 16) != cfg->x_size ||
+        code_get_u32(header + 20) != cfg->y_size || code_get_u32(header + 24) != cfg->z_size ||
+        code_get_u32(header + 28) != cfg->threshold) {
+        fprintf(stderr, "Warning: %s was saved for another volume or threshold; rebuilding the frame\n", path);
+        fclose(fp);
+        return 0;
+    }
+    uint64_t count = code_get_u64(header + 32);
+    if (count > volume_total_voxels(cfg)) {
+        fprintf(stderr, "Warning: %s holds more codes than the volume has voxels; rebuilding the frame\n", path);
+        fclose(fp);
+        return 0;
+    }
+    size_t key_bytes = key_bits <= 32 ? 4 : 8;
+    size_t buf_len = CODE_WRITE_BUFFER / key_bytes * key_bytes;
+    st->checksums = malloc(cfg->z_size * sizeof(uint64_t));
+    st->codes = malloc((count > 0 ? count : 1) * sizeof(morton_key_t));
+    uint8_t *buf = malloc(buf_len);
+    int ok = st->checksums && st->codes && buf;
+    for (uint32_t z = 0; z < cfg->z_size && ok; ++z) {
+        uint8_t word[8];
+        ok = fread(word, 1, sizeof(word), fp) == sizeof(word);
+        st->checksums[z] = code_get_u64(word);
+    }
+    for (size_t i = 0; i < count && ok;) {
+        size_t len = (count - i) * key_bytes < buf_len ? (count - i) * key_bytes : buf_len;
+        ok = fread(buf, 1, len, fp) == len;
+        size_t n = len / key_bytes;
+        if (key_bytes == 4) {
+            for (size_t k = 0; k < n; ++k) st->codes[i + k] = (morton_key_t)code_get_u32(buf + 4 * k);
+        } else {
+            for (size_t k = 0; k < n; ++k) st->codes[i + k] = (morton_key_t)code_get_u64(buf + 8 * k);
+        }
+        i += n;
+    }
+    free(buf);
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to read %s\n", path);
+        frame_state_free(st);
+        return -1;
+    }
+
+    // The patch indexes slabs by the codes' z and fills a buffer of one
+    // code per voxel, so only strictly increasing codes inside the volume
+    // are taken
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t x, y, z;
+        morton_decode(st->codes[i], &x, &y, &z);
+        if (x >= cfg->x_size || y >= cfg->y_size || z >= cfg->z_size || (i > 0 && st->codes[i] <= st->codes[i - 1])) {
+            fprintf(stderr, "Warning: %s is damaged at code %zu; rebuilding the frame\n", path, i);
+            frame_state_free(st);
+            return 0;
+        }
+    }
+    st->count = count;
+    return 1;
+}
+
+// Saves the state through a temporary file renamed over path, so an
+// interrupted run leaves the previous state intact
+static inline int frame_state_save(const char *path, const volume_config_t *cfg, int key_bits,
+                                   const uint64_t *checksums, const morton_key_t *codes, size_t count) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return -1;
+    }
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        return -1;
+    }
+    uint8_t header[FRAME_STATE_HEADER_BYTES] = {0};
+    memcpy(header, FRAME_STATE_MAGIC, 8);
+    code_put_u32(header + 8, FRAME_STATE_VERSION);
+    code_put_u32(header + 12, (uint32_t)key_bits);
+    code_put_u32(header + 16, cfg->x_size);
+    code_put_u32(header + 20, cfg->y_size);
+    code_put_u32(header + 24, cfg->z_size);
+    code_put_u32(header + 28, cfg->threshold);
+    code_put_u64(header + 32, count);
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+    size_t key_bytes = key_bits <= 32 ? 4 : 8;
+    uint8_t *buf = malloc(CODE_WRITE_BUFFER);
+    size_t used = 0;
+    if (!buf) ok = 0;
+    for (uint32_t z = 0; z < cfg->z_size && ok; ++z) {
+        code_put_u64(buf + used, checksums[z]);
+        used += 8;
+        if (used + 8 > CODE_WRITE_BUFFER) {
+            ok = fwrite(buf, 1, used, fp) == used;
+            used = 0;
+        }
+    }
+    for (size_t i = 0; i < count && ok; ++i) {
+        if (key_bytes == 4) {
+            code_put_u32(buf + used, (uint32_t)codes[i]);
+        } else {
+            code_put_u64(buf + used, (uint64_t)codes[i]);
+        }
+        used += key_bytes;
+        if (used + key_bytes > CODE_WRITE_BUFFER) {
+            ok = fwrite(buf, 1, used, fp) == used;
+            used = 0;
+        }
+    }
+    if (ok && used > 0) {
+        ok = fwrite(buf, 1, used, fp) == used;
+    }
+    free(buf);
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Patches the previous frame's sorted codes with the sorted codes of the
+// rescanned slabs. Codes of unchanged slabs carry over; in a changed slab
+// (dirty[z] set) a code is kept if the rescan found it again and removed
+// otherwise, and rescanned codes the previous frame lacked are added. out,
+// added and removed all come out sorted; out needs room for num_prev +
+// num_fresh codes, added for num_fresh and removed for num_prev.
+static inline void frame_patch(const morton_key_t *prev, size_t num_prev, const morton_key_t *fresh, size_t num_fresh,
+                               const uint8_t *dirty, morton_key_t *out, size_t *num_out, morton_key_t *added,
+                               size_t *num_added, morton_key_t *removed, size_t *num_removed) {
+    size_t j = 0, o = 0, a = 0, r = 0;
+    for (size_t i = 0; i < num_prev; ++i) {
+        morton_key_t code = prev[i];
+        while (j < num_fresh && fresh[j] < code) {
+            out[o++] = added[a++] = fresh[j++];
+        }
+        if (!dirty[morton_compact(code >> 2)]) {
+            out[o++] = code;
+        } else if (j < num_fresh && fresh[j] == code) {
+            out[o++] = code;
+            j++;
+        } else {
+            removed[r++] = code;
+        }
+    }
+    while (j < num_fresh) {
+        out[o++] = added[a++] = fresh[j++];
+    }
+    *num_out = o;
+    *num_added = a;
+    *num_removed = r;
+}
+
+#endif // FRAME_STATE_H
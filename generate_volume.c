@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "volume_config.h"
+
+// Synthetic 8-bit volumes for testing and benchmarking the engines without
+// c8.raw. Active voxels get values above the threshold and everything else
+// gets noise at or below it, so the scan sees realistic unpredictable
+// values. Next to the .raw file a .mhd header is written, which every
+// engine reads with --header.
+
+#define DEFAULT_EDGE 256
+#define DEFAULT_DENSITY 0.25
+#define DEFAULT_SEED 1
+#define NUM_SHELLS 8
+
+typedef enum {
+    PATTERN_NOISE,  // every voxel active with probability density
+    PATTERN_SPHERE, // one solid ball in the middle
+    PATTERN_SHELLS, // concentric thin spherical shells
+    PATTERN_SLAB    // one fully active band of z-slabs
+} pattern_t;
+
+static const char *const pattern_names[] = {"noise", "sphere", "shells", "slab"};
+
+typedef struct {
+    uint64_t state;
+} rng_t;
+
+// splitmix64: fast, and good enough for test data
+uint64_t rng_next(rng_t *rng) {
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Radii of the sphere and shell patterns, in voxels from the centre
+typedef struct {
+    double cx, cy, cz;
+    double radius;     // sphere
+    double shell_step; // distance between shell centres
+    double shell_half; // half the shell thickness
+    uint32_t slab_begin, slab_end;
+} pattern_geometry_t;
+
+pattern_geometry_t pattern_geometry(pattern_t pattern, double density, uint32_t x, uint32_t y, uint32_t z) {
+    pattern_geometry_t g = {.cx = (x - 1) / 2.0, .cy = (y - 1) / 2.0, .cz = (z - 1) / 2.0};
+    double volume = (double)x * y * z;
+    double r_max = 0.5 * (x < y ? (x < z ? x : z) : (y < z ? y : z));
+
+    if (pattern == PATTERN_SPHERE) {
+        // Clipped by the box when the density asks for more than fits
+        g.radius = cbrt(density * volume * 3.0 / (4.0 * M_PI));
+    } else if (pattern == PATTERN_SHELLS) {
+        g.shell_step = r_max / NUM_SHELLS;
+        double area = 0.0;
+        for (int k = 0; k < NUM_SHELLS; ++k) {
+            double r = (k + 0.5) * g.shell_step;
+            area += 4.0 * M_PI * r * r;
+        }
+        double thickness = density * volume / area;
+        if (thickness > g.shell_step) thickness = g.shell_step;
+        g.shell_half = thickness / 2.0;
+    } else if (pattern == PATTERN_SLAB) {
+        uint32_t band = (uint32_t)(density * z + 0.5);
+        if (band == 0) band = 1;
+        if (band > z) band = z;
+        g.slab_begin = (z - band) / 2;
+        g.slab_end = g.slab_begin + band;
+    }
+    return g;
+}
+
+int voxel_active(pattern_t pattern, const pattern_geometry_t *g, double density, uint32_t i, uint32_t j,
+                 uint32_t k, rng_t *rng) {
+    double dx = i - g->cx, dy = j - g->cy, dz = k - g->cz;
+    switch (pattern) {
+    case PATTERN_NOISE:
+        return (double)(rng_next(rng) >> 11) * 0x1.0p-53 < density;
+    case PATTERN_SPHERE:
+        return dx * dx + dy * dy + dz * dz <= g->radius * g->radius;
+    case PATTERN_SHELLS: {
+        double r = sqrt(dx * dx + dy * dy + dz * dz);
+        double centre = (floor(r / g->shell_step) + 0.5) * g->shell_step;
+        return r < NUM_SHELLS * g->shell_step && fabs(r - centre) <= g->shell_half;
+    }
+    case PATTERN_SLAB:
+        return k >= g->slab_begin && k < g->slab_end;
+    }
+    return 0;
+}
+
+// Writes the raw volume one z-slab at a time and returns the number of
+// active voxels, or -1 on a write error
+long long write_volume(FILE *fp, pattern_t pattern, double density, uint32_t x, uint32_t y, uint32_t z,
+                       uint8_t threshold, uint64_t seed) {
+    pattern_geometry_t g = pattern_geometry(pattern, density, x, y, z);
+    rng_t rng = {.state = seed};
+    size_t slab_voxels = (size_t)x * y;
+    uint8_t *slab = malloc(slab_voxels);
+    if (!slab) {
+        fprintf(stderr, "Error: Failed to allocate slab buffer\n");
+        return -1;
+    }
+
+    long long active = 0;
+    unsigned above = 255u - threshold;  // values threshold+1 .. 255
+    unsigned below = threshold + 1u;    // values 0 .. threshold
+    for (uint32_t k = 0; k < z; ++k) {
+        size_t idx = 0;
+        for (uint32_t j = 0; j < y; ++j) {
+            for (uint32_t i = 0; i < x; ++i, ++idx) {
+                uint64_t r = rng_next(&rng);
+                if (voxel_active(pattern, &g, density, i, j, k, &rng)) {
+                    slab[idx] = (uint8_t)(threshold + 1 + r % above);
+                    active++;
+                } else {
+                    slab[idx] = (uint8_t)(r % below);
+                }
+            }
+        }
+        if (fwrite(slab, 1, slab_voxels, fp) != slab_voxels) {
+            free(slab);
+            return -1;
+        }
+    }
+    free(slab);
+    return active;
+}
+
+int write_header(const char *header_path, const char *raw_path, uint32_t x, uint32_t y, uint32_t z,
+                 uint8_t threshold) {
+    FILE *fp = fopen(header_path, "w");
+    if (!fp) {
+        return -1;
+    }
+    // The header lives next to the data, so refer to it by its file name
+    const char *slash = strrchr(raw_path, '/');
+    const char *raw_name = slash ? slash + 1 : raw_path;
+    fprintf(fp, "ObjectType = Image\n");
+    fprintf(fp, "NDims = 3\n");
+    fprintf(fp, "DimSize = %u %u %u\n", x, y, z);
+    fprintf(fp, "ElementType = MET_UCHAR\n");
+    fprintf(fp, "Threshold = %u\n", threshold);
+    fprintf(fp, "ElementDataFile = %s\n", raw_name);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s [options] OUTPUT.raw\n", prog);
+    printf("  --dims X Y Z       volume dimensions (default %d %d %d)\n", DEFAULT_EDGE, DEFAULT_EDGE, DEFAULT_EDGE);
+    printf("  --pattern P        noise, sphere, shells or slab (default noise)\n");
+    printf("  --density D        fraction of active voxels, 0..1 (default %.2f)\n", DEFAULT_DENSITY);
+    printf("  --threshold T      voxels above T are active (default %d)\n", VOLUME_DEFAULT_THRESHOLD);
+    printf("  --seed S           random seed (default %d)\n", DEFAULT_SEED);
+    printf("Writes OUTPUT.raw and an OUTPUT.mhd header for --header.\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t x = DEFAULT_EDGE, y = DEFAULT_EDGE, z = DEFAULT_EDGE;
+    uint32_t threshold = VOLUME_DEFAULT_THRESHOLD;
+    pattern_t pattern = PATTERN_NOISE;
+    double density = DEFAULT_DENSITY;
+    uint64_t seed = DEFAULT_SEED;
+    const char *raw_path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--dims") == 0 && i + 3 < argc) {
+            if (volume_parse_u32(argv[i + 1], UINT32_MAX, &x) != 0 ||
+                volume_parse_u32(argv[i + 2], UINT32_MAX, &y) != 0 ||
+                volume_parse_u32(argv[i + 3], UINT32_MAX, &z) != 0 || !x || !y || !z) {
+                fprintf(stderr, "Error: Invalid dimensions\n");
+                return 1;
+            }
+            i += 3;
+        } else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            int found = 0;
+            for (int p = 0; p < (int)(sizeof(pattern_names) / sizeof(pattern_names[0])); ++p) {
+                if (strcmp(name, pattern_names[p]) == 0) {
+                    pattern = (pattern_t)p;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "Error: Unknown pattern %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--density") == 0 && i + 1 < argc) {
+            char *end;
+            density = strtod(argv[++i], &end);
+            if (end == argv[i] || *end != '\0' || !(density >= 0.0 && density <= 1.0)) {
+                fprintf(stderr, "Error: Density must be between 0 and 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            if (volume_parse_u32(argv[++i], UINT8_MAX - 1, &threshold) != 0) {
+                fprintf(stderr, "Error: Threshold must be between 0 and %d\n", UINT8_MAX - 1);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && !raw_path) {
+            raw_path = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!raw_path) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // OUTPUT.raw -> OUTPUT.mhd, anything else gets .mhd appended
+    char header_path[VOLUME_PATH_MAX];
+    size_t len = strlen(raw_path);
+    if (len > 4 && strcmp(raw_path + len - 4, ".raw") == 0) {
+        snprintf(header_path, sizeof(header_path), "%.*s.mhd", (int)(len - 4), raw_path);
+    } else {
+        snprintf(header_path, sizeof(header_path), "%s.mhd", raw_path);
+    }
+
+    FILE *fp = fopen(raw_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to open %s for writing\n", raw_path);
+        return 1;
+    }
+    long long active = write_volume(fp, pattern, density, x, y, z, (uint8_t)threshold, seed);
+    if (fclose(fp) != 0 || active < 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", raw_path);
+        return 1;
+    }
+    if (write_header(header_path, raw_path, x, y, z, (uint8_t)threshold) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", header_path);
+        return 1;
+    }
+
+    size_t total = (size_t)x * y * z;
+    printf("Generated %s: %ux%ux%u, pattern %s, threshold %u\n", raw_path, x, y, z, pattern_names[pattern],
+           threshold);
+    printf("Active voxels: %lld of %zu (%.2f%%)\n", active, total, total ? 100.0 * active / total : 0.0);
+    printf("Header written to %s\n", header_path);
+    return 0;
+}
@@ -0,0 +1,333 @@
+#ifndef LOSER_TREE_H
+#define LOSER_TREE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "morton.h"
+#include "thread_pool.h"
+
+// Tournament (loser) tree for merging k sorted runs in O(n log k). Internal
+// node i holds the run that lost the match played there; node 0 holds the
+// overall winner. Taking the winner replays only the matches on its path to
+// the root.
+//
+// Runs are consumed block by block: a run exposes its current block as a
+// pointer and length, and when the block is used up the optional refill
+// callback supplies the next one (for example from a file). In-memory runs
+// are a single block without a refill callback.
+
+typedef int (*lt_refill_fn)(void *ctx, const morton_key_t **block, size_t *len);
+
+typedef struct {
+    const morton_key_t *block;
+    size_t pos;
+    size_t len;
+    lt_refill_fn refill;
+    void *ctx;
+} lt_run_t;
+
+typedef struct {
+    int k;
+    int *tree;
+    lt_run_t *runs;
+} loser_tree_t;
+
+static inline int lt_exhausted(lt_run_t *run) {
+    while (run->pos == run->len) {
+        if (!run->refill || !run->refill(run->ctx, &run->block, &run->len)) {
+            run->len = run->pos = 0;
+            run->refill = NULL;
+            return 1;
+        }
+        run->pos = 0;
+    }
+    return 0;
+}
+
+// Does run a win against run b? Exhausted runs always lose and equal keys
+// go to the lower run index, which keeps the merge stable.
+static inline int lt_beats(loser_tree_t *lt, int a, int b) {
+    lt_run_t *ra = &lt->runs[a];
+    lt_run_t *rb = &lt->runs[b];
+    if (ra->pos == ra->len) return 0;
+    if (rb->pos == rb->len) return 1;
+    morton_key_t ka = ra->block[ra->pos];
+    morton_key_t kb = rb->block[rb->pos];
+    return ka < kb || (ka == kb && a < b);
+}
+
+// Sets up the tree over runs[0..k). The runs array must outlive the tree.
+static inline int lt_init(loser_tree_t *lt, lt_run_t *runs, int k) {
+    lt->k = k;
+    lt->runs = runs;
+    lt->tree = malloc((k > 0 ? k : 1) * sizeof(int));
+    if (!lt->tree) {
+        return -1;
+    }
+    for (int i = 0; i < k; ++i) {
+        lt->tree[i] = -1;
+        lt_exhausted(&runs[i]);
+    }
+    if (k == 0) {
+        lt->tree[0] = -1;
+        return 0;
+    }
+
+    for (int i = 0; i < k; ++i) {
+        int winner = i;
+        int node = (i + k) / 2;
+        while (node > 0) {
+            if (lt->tree[node] == -1) {
+                lt->tree[node] = winner;
+                winner = -1;
+                break;
+            }
+            if (lt_beats(lt, lt->tree[node], winner)) {
+                int swap = lt->tree[node];
+                lt->tree[node] = winner;
+                winner = swap;
+            }
+            node /= 2;
+        }
+        if (winner != -1) {
+            lt->tree[0] = winner;
+        }
+    }
+    return 0;
+}
+
+// Writes up to max_out merged keys to out and returns how many it wrote;
+// fewer than max_out means every run is exhausted.
+static inline size_t lt_merge(loser_tree_t *lt, morton_key_t *out, size_t max_out) {
+    size_t n = 0;
+    int k = lt->k;
+    if (k == 0) {
+        return 0;
+    }
+    while (n < max_out) {
+        int winner = lt->tree[0];
+        lt_run_t *run = &lt->runs[winner];
+        if (run->pos == run->len) {
+            break;
+        }
+
+        out[n++] = run->block[run->pos++];
+        lt_exhausted(run);
+
+        int node = (winner + k) / 2;
+        while (node > 0) {
+            if (lt_beats(lt, lt->tree[node], winner)) {
+                int swap = lt->tree[node];
+                lt->tree[node] = winner;
+                winner = swap;
+            }
+            node /= 2;
+        }
+        lt->tree[0] = winner;
+    }
+    return n;
+}
+
+static inline void lt_free(loser_tree_t *lt) {
+    free(lt->tree);
+    lt->tree = NULL;
+}
+
+// Merges the in-memory sorted runs runs[i][0..lens[i]) into out, which
+// needs room for the sum of lens.
+static inline int lt_merge_arrays(const morton_key_t *const *runs, const size_t *lens, int k,
+                                  morton_key_t *out) {
+    lt_run_t *sources = malloc((k > 0 ? k : 1) * sizeof(lt_run_t));
+    if (!sources) {
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < k; ++i) {
+        sources[i] = (lt_run_t){.block = runs[i], .pos = 0, .len = lens[i]};
+        total += lens[i];
+    }
+
+    loser_tree_t lt;
+    if (lt_init(&lt, sources, k) != 0) {
+        free(sources);
+        return -1;
+    }
+    lt_merge(&lt, out, total);
+    lt_free(&lt);
+    free(sources);
+    return 0;
+}
+
+// lt_merge_arrays carrying one payload key per key: payloads[i][j] lands in
+// out_payload at the position runs[i][j] takes in out
+static inline int lt_merge_arrays_payload(const morton_key_t *const *runs, const morton_key_t *const *payloads,
+                                          const size_t *lens, int k, morton_key_t *out, morton_key_t *out_payload) {
+    lt_run_t *sources = malloc((k > 0 ? k : 1) * sizeof(lt_run_t));
+    if (!sources) {
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < k; ++i) {
+        sources[i] = (lt_run_t){.block = runs[i], .pos = 0, .len = lens[i]};
+        total += lens[i];
+    }
+
+    loser_tree_t lt;
+    if (lt_init(&lt, sources, k) != 0) {
+        free(sources);
+        return -1;
+    }
+    // In-memory runs are never refilled, so a run's position indexes its
+    // payload too
+    for (size_t n = 0; n < total; ++n) {
+        int winner = lt.tree[0];
+        out_payload[n] = payloads[winner][sources[winner].pos];
+        lt_merge(&lt, out + n, 1);
+    }
+    lt_free(&lt);
+    free(sources);
+    return 0;
+}
+
+// Parallel merge: the key space is cut at splitters sampled from the runs,
+// and each key range is merged by its own pool task into its precomputed
+// place in out. bounds is a (num_parts + 1) x k matrix of run positions.
+// With payloads, every part carries its payload keys along the same way.
+#define LT_SAMPLES_PER_RUN 16
+
+typedef struct {
+    const morton_key_t *const *runs;
+    const morton_key_t *const *payloads; // NULL without payloads
+    int k;
+    const size_t *bounds;
+    const size_t *out_offsets;
+    morton_key_t *out;
+    morton_key_t *out_payload;
+    int failed;
+} lt_parallel_ctx_t;
+
+static inline size_t lt_lower_bound(const morton_key_t *run, size_t n, morton_key_t key) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (run[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline void lt_merge_part_task(void *arg, size_t part, int worker) {
+    lt_parallel_ctx_t *ctx = (lt_parallel_ctx_t *)arg;
+    const size_t *lo = ctx->bounds + part * ctx->k;
+    const size_t *hi = lo + ctx->k;
+    const morton_key_t **sub_runs = malloc((ctx->k > 0 ? ctx->k : 1) * 2 * sizeof(morton_key_t *));
+    size_t *sub_lens = malloc((ctx->k > 0 ? ctx->k : 1) * sizeof(size_t));
+    (void)worker;
+
+    if (!sub_runs || !sub_lens) {
+        ctx->failed = 1;
+    } else {
+        const morton_key_t **sub_payloads = sub_runs + ctx->k;
+        size_t offset = ctx->out_offsets[part];
+        for (int r = 0; r < ctx->k; ++r) {
+            sub_runs[r] = ctx->runs[r] + lo[r];
+            sub_lens[r] = hi[r] - lo[r];
+            if (ctx->payloads) sub_payloads[r] = ctx->payloads[r] + lo[r];
+        }
+        int rc = ctx->payloads ? lt_merge_arrays_payload(sub_runs, sub_payloads, sub_lens, ctx->k, ctx->out + offset,
+                                                         ctx->out_payload + offset)
+                               : lt_merge_arrays(sub_runs, sub_lens, ctx->k, ctx->out + offset);
+        if (rc != 0) {
+            ctx->failed = 1;
+        }
+    }
+    free(sub_runs);
+    free(sub_lens);
+}
+
+static inline int lt_compare_keys(const void *a, const void *b) {
+    morton_key_t x = *(const morton_key_t *)a;
+    morton_key_t y = *(const morton_key_t *)b;
+    return (x > y) - (x < y);
+}
+
+static inline int lt_merge_parallel(thread_pool_t *pool, const morton_key_t *const *runs,
+                                    const morton_key_t *const *payloads, const size_t *lens, int k, morton_key_t *out,
+                                    morton_key_t *out_payload) {
+    size_t num_parts = pool->num_threads > 1 ? (size_t)pool->num_threads * 4 : 1;
+    if (num_parts == 1 || k <= 1) {
+        return payloads ? lt_merge_arrays_payload(runs, payloads, lens, k, out, out_payload)
+                        : lt_merge_arrays(runs, lens, k, out);
+    }
+
+    // Splitters from regular samples of every run
+    size_t num_samples = 0;
+    morton_key_t *samples = malloc((size_t)k * LT_SAMPLES_PER_RUN * sizeof(morton_key_t));
+    size_t *bounds = malloc((num_parts + 1) * k * sizeof(size_t));
+    size_t *out_offsets = malloc(num_parts * sizeof(size_t));
+    if (!samples || !bounds || !out_offsets) {
+        free(samples);
+        free(bounds);
+        free(out_offsets);
+        return -1;
+    }
+    for (int r = 0; r < k; ++r) {
+        for (size_t j = 0; lens[r] > 0 && j < LT_SAMPLES_PER_RUN; ++j) {
+            samples[num_samples++] = runs[r][j * lens[r] / LT_SAMPLES_PER_RUN];
+        }
+    }
+    qsort(samples, num_samples, sizeof(morton_key_t), lt_compare_keys);
+
+    // Part p covers keys in [splitter p-1, splitter p)
+    for (size_t p = 0; p <= num_parts; ++p) {
+        size_t *row = bounds + p * k;
+        size_t offset = 0;
+        for (int r = 0; r < k; ++r) {
+            if (p == 0) {
+                row[r] = 0;
+            } else if (p == num_parts || num_samples == 0) {
+                row[r] = lens[r];
+            } else {
+                row[r] = lt_lower_bound(runs[r], lens[r], samples[p * num_samples / num_parts]);
+            }
+            offset += row[r];
+        }
+        if (p < num_parts) {
+            out_offsets[p] = offset;
+        }
+    }
+
+    lt_parallel_ctx_t ctx = {.runs = runs,
+                             .payloads = payloads,
+                             .k = k,
+                             .bounds = bounds,
+                             .out_offsets = out_offsets,
+                             .out = out,
+                             .out_payload = out_payload,
+                             .failed = 0};
+    pool_run(pool, num_parts, lt_merge_part_task, &ctx);
+
+    free(samples);
+    free(bounds);
+    free(out_offsets);
+    return ctx.failed ? -1 : 0;
+}
+
+static inline int lt_merge_arrays_parallel(thread_pool_t *pool, const morton_key_t *const *runs,
+                                           const size_t *lens, int k, morton_key_t *out) {
+    return lt_merge_parallel(pool, runs, NULL, lens, k, out, NULL);
+}
+
+// lt_merge_arrays_payload over the pool, cut into key ranges the same way
+static inline int lt_merge_arrays_payload_parallel(thread_pool_t *pool, const morton_key_t *const *runs,
+                                                   const morton_key_t *const *payloads, const size_t *lens, int k,
+                                                   morton_key_t *out, morton_key_t *out_payload) {
+    return lt_merge_parallel(pool, runs, payloads, lens, k, out, out_payload);
+}
+
+#endif // LOSER_TREE_H
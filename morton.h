@@ -0,0 +1,638 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <immintrin.h>
+
+// Key width is fixed per build. The default 32-bit keys hold 10 bits per
+// axis (volumes up to 1024^3); build with -DMORTON_KEY_BITS=64 for 21 bits
+// per axis. The SIMD encode kernels exist only for 32-bit keys.
+#ifndef MORTON_KEY_BITS
+#define MORTON_KEY_BITS 32
+#endif
+
+#if MORTON_KEY_BITS == 64
+typedef uint64_t morton_key_t;
+#define MORTON_COORD_BITS 21
+#define MORTON_KEY_MAX UINT64_MAX
+#define PRImorton PRIu64
+#elif MORTON_KEY_BITS == 32
+typedef uint32_t morton_key_t;
+#define MORTON_COORD_BITS 10
+#define MORTON_KEY_MAX UINT32_MAX
+#define PRImorton PRIu32
+#else
+#error "MORTON_KEY_BITS must be 32 or 64"
+#endif
+
+// Function to interleave bits for Morton code
+static inline uint32_t expand_bits(uint32_t x) {
+    x &= 0x3FF; // Ensure x is 10 bits
+    x = (x | (x << 16)) & 0x30000FF;
+    x = (x | (x << 8))  & 0x300F00F;
+    x = (x | (x << 4))  & 0x30C30C3;
+    x = (x | (x << 2))  & 0x9249249;
+    return x;
+}
+
+// Inverse of expand_bits: gathers every third bit back into 10 bits
+static inline uint32_t compact_bits(uint32_t x) {
+    x &= 0x9249249;
+    x = (x | (x >> 2))  & 0x30C30C3;
+    x = (x | (x >> 4))  & 0x300F00F;
+    x = (x | (x >> 8))  & 0x30000FF;
+    x = (x | (x >> 16)) & 0x3FF;
+    return x;
+}
+
+// 21-bit variants of expand_bits and compact_bits for 64-bit keys
+static inline uint64_t expand_bits64(uint64_t x) {
+    x &= 0x1FFFFF;
+    x = (x | (x << 32)) & 0x1F00000000FFFFull;
+    x = (x | (x << 16)) & 0x1F0000FF0000FFull;
+    x = (x | (x << 8))  & 0x100F00F00F00F00Full;
+    x = (x | (x << 4))  & 0x10C30C30C30C30C3ull;
+    x = (x | (x << 2))  & 0x1249249249249249ull;
+    return x;
+}
+
+static inline uint64_t compact_bits64(uint64_t x) {
+    x &= 0x1249249249249249ull;
+    x = (x | (x >> 2))  & 0x10C30C30C30C30C3ull;
+    x = (x | (x >> 4))  & 0x100F00F00F00F00Full;
+    x = (x | (x >> 8))  & 0x1F0000FF0000FFull;
+    x = (x | (x >> 16)) & 0x1F00000000FFFFull;
+    x = (x | (x >> 32)) & 0x1FFFFF;
+    return x;
+}
+
+#if MORTON_KEY_BITS == 64
+#define morton_expand expand_bits64
+#define morton_compact compact_bits64
+#else
+#define morton_expand expand_bits
+#define morton_compact compact_bits
+#endif
+
+// Function to compute Morton code from x, y, z
+static inline morton_key_t morton_encode(uint32_t x, uint32_t y, uint32_t z) {
+    return morton_expand(x) | (morton_expand(y) << 1) | (morton_expand(z) << 2);
+}
+
+static inline void morton_decode(morton_key_t code, uint32_t *x, uint32_t *y, uint32_t *z) {
+    *x = (uint32_t)morton_compact(code);
+    *y = (uint32_t)morton_compact(code >> 1);
+    *z = (uint32_t)morton_compact(code >> 2);
+}
+
+// Volume layout used by the scan kernels. The vector kernels derive x, y, z
+// from the flat index with shifts, so they need power-of-two X and Y sizes;
+// other layouts go through the scalar kernel.
+typedef struct {
+    uint32_t x_size;
+    uint32_t y_size;
+    uint32_t z_size;
+    uint32_t x_shift;
+    uint32_t y_shift;
+    int pow2;
+    int key_bits; // significant bits of the largest key in the volume
+} morton_grid_t;
+
+static inline morton_grid_t morton_grid(uint32_t x_size, uint32_t y_size, uint32_t z_size) {
+    morton_grid_t grid = {x_size, y_size, z_size, 0, 0, 0, 0};
+    uint32_t z_shift = 0;
+    while ((1u << grid.x_shift) < x_size) grid.x_shift++;
+    while ((1u << grid.y_shift) < y_size) grid.y_shift++;
+    while ((1u << z_shift) < z_size) z_shift++;
+    grid.pow2 = (1u << grid.x_shift) == x_size && (1u << grid.y_shift) == y_size;
+
+    uint32_t coord_bits = grid.x_shift;
+    if (grid.y_shift > coord_bits) coord_bits = grid.y_shift;
+    if (z_shift > coord_bits) coord_bits = z_shift;
+    grid.key_bits = 3 * (coord_bits > 0 ? coord_bits : 1);
+    return grid;
+}
+
+// Whether every coordinate of the volume fits this build's key width
+static inline int morton_grid_fits(const morton_grid_t *grid) {
+    uint32_t limit = 1u << MORTON_COORD_BITS;
+    return grid->x_size <= limit && grid->y_size <= limit && grid->z_size <= limit;
+}
+
+// A scan kernel writes the Morton code of every voxel in data[0..n) whose
+// value is above threshold to out, in index order, and returns how many it
+// wrote. data[0] is voxel base_idx of the volume. out needs room for as many
+// codes as there are active voxels; nothing is written past that.
+typedef size_t (*morton_scan_fn)(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                 size_t base_idx, uint8_t threshold, morton_key_t *out);
+typedef size_t (*morton_count_fn)(const uint8_t *data, size_t n, uint8_t threshold);
+
+typedef struct {
+    const char *name;
+    morton_scan_fn scan;
+    morton_count_fn count;
+    int (*supported)(void);
+} morton_kernel_t;
+
+static inline size_t morton_scan_scalar(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                        size_t base_idx, uint8_t threshold, morton_key_t *out) {
+    size_t code_count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (data[i] > threshold) {
+            size_t idx = base_idx + i;
+            uint32_t x = idx % grid->x_size;
+            idx /= grid->x_size;
+            uint32_t y = idx % grid->y_size;
+            uint32_t z = idx / grid->y_size;
+            out[code_count++] = morton_encode(x, y, z);
+        }
+    }
+    return code_count;
+}
+
+static inline size_t morton_count_scalar(const uint8_t *data, size_t n, uint8_t threshold) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        count += data[i] > threshold;
+    }
+    return count;
+}
+
+// Every vector kernel works on 64-voxel groups: compare, build a 64-bit mask,
+// write the set flat indices to out, and once per MORTON_SCAN_BATCH groups
+// turn the freshly written indices into Morton codes in place while they are
+// still in L1. Tails shorter than a group go through the scalar kernel.
+#define MORTON_SCAN_BATCH 64
+
+// Appends the flat index of every set bit of mask to out
+static inline size_t morton_mask_to_indices(uint64_t mask, uint32_t base, uint32_t *out) {
+    size_t k = 0;
+    while (mask) {
+        out[k++] = base + (uint32_t)__builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return k;
+}
+
+static inline int morton_vector_ok(const morton_grid_t *grid, size_t base_idx, size_t n) {
+    return grid->pow2 && base_idx + n <= UINT32_MAX;
+}
+
+/* ---- SSE4.2 ---- */
+
+#if MORTON_KEY_BITS == 32
+__attribute__((target("sse4.2")))
+static inline __m128i morton_expand_sse(__m128i v) {
+    v = _mm_and_si128(v, _mm_set1_epi32(0x3FF));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 16)), _mm_set1_epi32(0x30000FF));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 8)),  _mm_set1_epi32(0x300F00F));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 4)),  _mm_set1_epi32(0x30C30C3));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 2)),  _mm_set1_epi32(0x9249249));
+    return v;
+}
+
+__attribute__((target("sse4.2")))
+static inline void morton_encode_indices_sse(const morton_grid_t *grid, uint32_t *codes, size_t n) {
+    __m128i xs = _mm_cvtsi32_si128(grid->x_shift);
+    __m128i zs = _mm_cvtsi32_si128(grid->x_shift + grid->y_shift);
+    __m128i xmask = _mm_set1_epi32(grid->x_size - 1);
+    __m128i ymask = _mm_set1_epi32(grid->y_size - 1);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i idx = _mm_loadu_si128((const __m128i *)(codes + i));
+        __m128i x = _mm_and_si128(idx, xmask);
+        __m128i y = _mm_and_si128(_mm_srl_epi32(idx, xs), ymask);
+        __m128i z = _mm_srl_epi32(idx, zs);
+        __m128i code = _mm_or_si128(morton_expand_sse(x),
+                       _mm_or_si128(_mm_slli_epi32(morton_expand_sse(y), 1),
+                                    _mm_slli_epi32(morton_expand_sse(z), 2)));
+        _mm_storeu_si128((__m128i *)(codes + i), code);
+    }
+    for (; i < n; ++i) {
+        uint32_t idx = codes[i];
+        codes[i] = morton_encode(idx & (grid->x_size - 1), (idx >> grid->x_shift) & (grid->y_size - 1),
+                                 idx >> (grid->x_shift + grid->y_shift));
+    }
+}
+
+#endif
+
+__attribute__((target("sse4.2")))
+static inline uint64_t morton_mask64_sse(const uint8_t *p, __m128i bias, __m128i t) {
+    uint64_t mask = 0;
+    for (int j = 0; j < 4; ++j) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + 16 * j)), bias);
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, t)) << (16 * j);
+    }
+    return mask;
+}
+
+#if MORTON_KEY_BITS == 32
+__attribute__((target("sse4.2,popcnt")))
+static inline size_t morton_scan_sse42(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                       size_t base_idx, uint8_t threshold, uint32_t *out) {
+    if (!morton_vector_ok(grid, base_idx, n)) {
+        return morton_scan_scalar(grid, data, n, base_idx, threshold, out);
+    }
+    // Unsigned compare through signed compare with the sign bit flipped
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i t = _mm_set1_epi8((char)(threshold ^ 0x80));
+    size_t code_count = 0, encoded = 0, i = 0;
+    while (i + 64 <= n) {
+        for (int g = 0; g < MORTON_SCAN_BATCH && i + 64 <= n; ++g, i += 64) {
+            uint64_t mask = morton_mask64_sse(data + i, bias, t);
+            code_count += morton_mask_to_indices(mask, (uint32_t)(base_idx + i), out + code_count);
+        }
+        morton_encode_indices_sse(grid, out + encoded, code_count - encoded);
+        encoded = code_count;
+    }
+    return code_count + morton_scan_scalar(grid, data + i, n - i, base_idx + i, threshold, out + code_count);
+}
+
+#endif
+
+__attribute__((target("sse4.2,popcnt")))
+static inline size_t morton_count_sse42(const uint8_t *data, size_t n, uint8_t threshold) {
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i t = _mm_set1_epi8((char)(threshold ^ 0x80));
+    size_t count = 0, i = 0;
+    for (; i + 64 <= n; i += 64) {
+        count += __builtin_popcountll(morton_mask64_sse(data + i, bias, t));
+    }
+    return count + morton_count_scalar(data + i, n - i, threshold);
+}
+
+/* ---- AVX2 ---- */
+
+#if MORTON_KEY_BITS == 32
+__attribute__((target("avx2")))
+static inline __m256i morton_expand_avx2(__m256i v) {
+    v = _mm256_and_si256(v, _mm256_set1_epi32(0x3FF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 16)), _mm256_set1_epi32(0x30000FF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 8)),  _mm256_set1_epi32(0x300F00F));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 4)),  _mm256_set1_epi32(0x30C30C3));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 2)),  _mm256_set1_epi32(0x9249249));
+    return v;
+}
+
+__attribute__((target("avx2")))
+static inline void morton_encode_indices_avx2(const morton_grid_t *grid, uint32_t *codes, size_t n) {
+    __m128i xs = _mm_cvtsi32_si128(grid->x_shift);
+    __m128i zs = _mm_cvtsi32_si128(grid->x_shift + grid->y_shift);
+    __m256i xmask = _mm256_set1_epi32(grid->x_size - 1);
+    __m256i ymask = _mm256_set1_epi32(grid->y_size - 1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)(codes + i));
+        __m256i x = _mm256_and_si256(idx, xmask);
+        __m256i y = _mm256_and_si256(_mm256_srl_epi32(idx, xs), ymask);
+        __m256i z = _mm256_srl_epi32(idx, zs);
+        __m256i code = _mm256_or_si256(morton_expand_avx2(x),
+                       _mm256_or_si256(_mm256_slli_epi32(morton_expand_avx2(y), 1),
+                                       _mm256_slli_epi32(morton_expand_avx2(z), 2)));
+        _mm256_storeu_si256((__m256i *)(codes + i), code);
+    }
+    morton_encode_indices_sse(grid, codes + i, n - i);
+}
+
+#endif
+
+__attribute__((target("avx2")))
+static inline uint64_t morton_mask64_avx2(const uint8_t *p, __m256i bias, __m256i t) {
+    __m256i lo = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)p), bias);
+    __m256i hi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 32)), bias);
+    uint32_t mlo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(lo, t));
+    uint32_t mhi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(hi, t));
+    return (uint64_t)mlo | ((uint64_t)mhi << 32);
+}
+
+#if MORTON_KEY_BITS == 32
+__attribute__((target("avx2,bmi,popcnt")))
+static inline size_t morton_scan_avx2(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                      size_t base_idx, uint8_t threshold, uint32_t *out) {
+    if (!morton_vector_ok(grid, base_idx, n)) {
+        return morton_scan_scalar(grid, data, n, base_idx, threshold, out);
+    }
+    __m256i bias = _mm256_set1_epi8((char)0x80);
+    __m256i t = _mm256_set1_epi8((char)(threshold ^ 0x80));
+    size_t code_count = 0, encoded = 0, i = 0;
+    while (i + 64 <= n) {
+        for (int g = 0; g < MORTON_SCAN_BATCH && i + 64 <= n; ++g, i += 64) {
+            uint64_t mask = morton_mask64_avx2(data + i, bias, t);
+            code_count += morton_mask_to_indices(mask, (uint32_t)(base_idx + i), out + code_count);
+        }
+        morton_encode_indices_avx2(grid, out + encoded, code_count - encoded);
+        encoded = code_count;
+    }
+    return code_count + morton_scan_scalar(grid, data + i, n - i, base_idx + i, threshold, out + code_count);
+}
+
+#endif
+
+__attribute__((target("avx2,popcnt")))
+static inline size_t morton_count_avx2(const uint8_t *data, size_t n, uint8_t threshold) {
+    __m256i bias = _mm256_set1_epi8((char)0x80);
+    __m256i t = _mm256_set1_epi8((char)(threshold ^ 0x80));
+    size_t count = 0, i = 0;
+    for (; i + 64 <= n; i += 64) {
+        count += __builtin_popcountll(morton_mask64_avx2(data + i, bias, t));
+    }
+    return count + morton_count_scalar(data + i, n - i, threshold);
+}
+
+/* ---- AVX-512 (F + BW) ---- */
+
+#if MORTON_KEY_BITS == 32
+__attribute__((target("avx512f")))
+static inline __m512i morton_expand_avx512(__m512i v) {
+    v = _mm512_and_si512(v, _mm512_set1_epi32(0x3FF));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 16)), _mm512_set1_epi32(0x30000FF));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 8)),  _mm512_set1_epi32(0x300F00F));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 4)),  _mm512_set1_epi32(0x30C30C3));
+    v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 2)),  _mm512_set1_epi32(0x9249249));
+    return v;
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i morton_encode_avx512(__m512i idx, __m128i xs, __m128i zs, __m512i xmask, __m512i ymask) {
+    __m512i x = _mm512_and_si512(idx, xmask);
+    __m512i y = _mm512_and_si512(_mm512_srl_epi32(idx, xs), ymask);
+    __m512i z = _mm512_srl_epi32(idx, zs);
+    return _mm512_or_si512(morton_expand_avx512(x),
+           _mm512_or_si512(_mm512_slli_epi32(morton_expand_avx512(y), 1),
+                           _mm512_slli_epi32(morton_expand_avx512(z), 2)));
+}
+
+// With AVX-512 the set lanes are compressed straight out of the mask, so
+// indices never round-trip through memory before being encoded.
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static inline size_t morton_scan_avx512(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                        size_t base_idx, uint8_t threshold, uint32_t *out) {
+    if (!morton_vector_ok(grid, base_idx, n)) {
+        return morton_scan_scalar(grid, data, n, base_idx, threshold, out);
+    }
+    __m512i t = _mm512_set1_epi8((char)threshold);
+    __m128i xs = _mm_cvtsi32_si128(grid->x_shift);
+    __m128i zs = _mm_cvtsi32_si128(grid->x_shift + grid->y_shift);
+    __m512i xmask = _mm512_set1_epi32(grid->x_size - 1);
+    __m512i ymask = _mm512_set1_epi32(grid->y_size - 1);
+    __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t code_count = 0, i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t mask = _mm512_cmpgt_epu8_mask(_mm512_loadu_si512((const void *)(data + i)), t);
+        if (!mask) continue;
+        for (int j = 0; j < 4; ++j) {
+            __mmask16 m = (__mmask16)(mask >> (16 * j));
+            if (!m) continue;
+            __m512i idx = _mm512_add_epi32(_mm512_set1_epi32((uint32_t)(base_idx + i + 16 * j)), iota);
+            __m512i code = morton_encode_avx512(idx, xs, zs, xmask, ymask);
+            // Compress in-register, then store only the packed prefix:
+            // compressstoreu to memory is microcoded on some cores
+            int pop = __builtin_popcount(m);
+            _mm512_mask_storeu_epi32(out + code_count, (__mmask16)((1u << pop) - 1),
+                                     _mm512_maskz_compress_epi32(m, code));
+            code_count += pop;
+        }
+    }
+    return code_count + morton_scan_scalar(grid, data + i, n - i, base_idx + i, threshold, out + code_count);
+}
+
+#endif
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static inline size_t morton_count_avx512(const uint8_t *data, size_t n, uint8_t threshold) {
+    __m512i t = _mm512_set1_epi8((char)threshold);
+    size_t count = 0, i = 0;
+    for (; i + 64 <= n; i += 64) {
+        count += __builtin_popcountll(_mm512_cmpgt_epu8_mask(_mm512_loadu_si512((const void *)(data + i)), t));
+    }
+    return count + morton_count_scalar(data + i, n - i, threshold);
+}
+
+/* ---- Row traversal ---- */
+
+// Division-free traversal: the flat index is split into x, y, z once per
+// call, then the range is walked row by row. The y/z part of the key is
+// interleaved once per row and only the x part is looked up per voxel,
+// either from a 1024-entry table or with BMI2 pdep.
+typedef size_t (*morton_row_fn)(const uint8_t *row, uint32_t x0, size_t len, morton_key_t yz_bits,
+                                uint8_t threshold, morton_key_t *out);
+
+static morton_key_t morton_x_lut[1024];
+
+static inline void morton_init_tables(void) {
+    for (uint32_t x = 0; x < 1024; ++x) {
+        morton_x_lut[x] = expand_bits(x);
+    }
+}
+
+// Expanded x from the 10-bit table; 64-bit keys combine up to three lookups
+static inline morton_key_t morton_lut_x(uint32_t x) {
+#if MORTON_KEY_BITS == 64
+    return morton_x_lut[x & 0x3FF] | (morton_x_lut[(x >> 10) & 0x3FF] << 30) | (morton_x_lut[x >> 20] << 60);
+#else
+    return morton_x_lut[x];
+#endif
+}
+
+static inline size_t morton_walk_rows(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                      size_t base_idx, uint8_t threshold, morton_key_t *out,
+                                      morton_row_fn row_fn) {
+    uint32_t x = base_idx % grid->x_size;
+    size_t row = base_idx / grid->x_size;
+    uint32_t y = row % grid->y_size;
+    uint32_t z = row / grid->y_size;
+    size_t code_count = 0, i = 0;
+    while (i < n) {
+        size_t len = grid->x_size - x;
+        if (len > n - i) len = n - i;
+        morton_key_t yz_bits = (morton_expand(y) << 1) | (morton_expand(z) << 2);
+        code_count += row_fn(data + i, x, len, yz_bits, threshold, out + code_count);
+        i += len;
+        x = 0;
+        if (++y == grid->y_size) {
+            y = 0;
+            ++z;
+        }
+    }
+    return code_count;
+}
+
+static inline size_t morton_row_lut(const uint8_t *row, uint32_t x0, size_t len, morton_key_t yz_bits,
+                                    uint8_t threshold, morton_key_t *out) {
+    size_t code_count = 0;
+    for (size_t k = 0; k < len; ++k) {
+        if (row[k] > threshold) {
+            out[code_count++] = yz_bits | morton_lut_x(x0 + (uint32_t)k);
+        }
+    }
+    return code_count;
+}
+
+#if MORTON_KEY_BITS == 64
+#define MORTON_X_PDEP_MASK 0x1249249249249249ull
+#define morton_pdep_x(x) _pdep_u64((x), MORTON_X_PDEP_MASK)
+#else
+#define MORTON_X_PDEP_MASK 0x09249249u
+#define morton_pdep_x(x) _pdep_u32((x), MORTON_X_PDEP_MASK)
+#endif
+
+__attribute__((target("avx2,bmi,bmi2")))
+static inline size_t morton_row_pdep(const uint8_t *row, uint32_t x0, size_t len, morton_key_t yz_bits,
+                                     uint8_t threshold, morton_key_t *out) {
+    __m256i bias = _mm256_set1_epi8((char)0x80);
+    __m256i t = _mm256_set1_epi8((char)(threshold ^ 0x80));
+    size_t code_count = 0, k = 0;
+    for (; k + 64 <= len; k += 64) {
+        uint64_t mask = morton_mask64_avx2(row + k, bias, t);
+        while (mask) {
+            uint32_t x = x0 + (uint32_t)(k + __builtin_ctzll(mask));
+            out[code_count++] = yz_bits | morton_pdep_x(x);
+            mask &= mask - 1;
+        }
+    }
+    for (; k < len; ++k) {
+        if (row[k] > threshold) {
+            out[code_count++] = yz_bits | morton_pdep_x(x0 + (uint32_t)k);
+        }
+    }
+    return code_count;
+}
+
+static inline size_t morton_scan_rows_lut(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                          size_t base_idx, uint8_t threshold, morton_key_t *out) {
+    return morton_walk_rows(grid, data, n, base_idx, threshold, out, morton_row_lut);
+}
+
+static inline size_t morton_scan_rows_pdep(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                           size_t base_idx, uint8_t threshold, morton_key_t *out) {
+    return morton_walk_rows(grid, data, n, base_idx, threshold, out, morton_row_pdep);
+}
+
+/* ---- Runtime dispatch ---- */
+
+static inline int morton_cpu_avx512(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt");
+}
+
+static inline int morton_cpu_avx2(void) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("popcnt");
+}
+
+static inline int morton_cpu_pdep(void) {
+    // pdep is microcoded (hundreds of cycles) before Zen 3
+    if (__builtin_cpu_is("znver1") || __builtin_cpu_is("znver2")) return 0;
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+}
+
+static inline int morton_cpu_sse42(void) {
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+}
+
+static inline int morton_cpu_any(void) {
+    return 1;
+}
+
+static const morton_kernel_t morton_kernels[] = {
+#if MORTON_KEY_BITS == 32
+    {"avx512", morton_scan_avx512, morton_count_avx512, morton_cpu_avx512},
+#endif
+    {"rows-pdep", morton_scan_rows_pdep, morton_count_avx2, morton_cpu_pdep},
+#if MORTON_KEY_BITS == 32
+    {"avx2", morton_scan_avx2, morton_count_avx2, morton_cpu_avx2},
+    {"sse4.2", morton_scan_sse42, morton_count_sse42, morton_cpu_sse42},
+#endif
+    {"rows-lut", morton_scan_rows_lut, morton_count_scalar, morton_cpu_any},
+    {"scalar", morton_scan_scalar, morton_count_scalar, morton_cpu_any},
+};
+
+static inline int morton_kernel_supported(const morton_kernel_t *kernel) {
+    return kernel->supported();
+}
+
+// Picks the first kernel in morton_kernels[] (ordered fastest first) that the
+// CPU supports. MORTON_KERNEL=<name> in the environment forces a specific one,
+// e.g. for benchmarking; a name this build lacks or the CPU cannot run is
+// reported and the fastest supported kernel is used instead.
+static inline const morton_kernel_t *morton_select_kernel(void) {
+    size_t num_kernels = sizeof(morton_kernels) / sizeof(morton_kernels[0]);
+    const char *forced = getenv("MORTON_KERNEL");
+
+    __builtin_cpu_init();
+    morton_init_tables();
+    if (forced) {
+        for (size_t i = 0; i < num_kernels; ++i) {
+            if (strcmp(forced, morton_kernels[i].name) != 0) continue;
+            if (morton_kernel_supported(&morton_kernels[i])) {
+                return &morton_kernels[i];
+            }
+            fprintf(stderr, "Warning: MORTON_KERNEL=%s is not supported by this CPU\n", forced);
+            forced = NULL;
+            break;
+        }
+        if (forced) {
+            fprintf(stderr, "Warning: MORTON_KERNEL=%s is not a kernel of this %d-bit build (available:", forced,
+                    MORTON_KEY_BITS);
+            for (size_t i = 0; i < num_kernels; ++i) fprintf(stderr, " %s", morton_kernels[i].name);
+            fprintf(stderr, ")\n");
+        }
+    }
+    for (size_t i = 0; i < num_kernels; ++i) {
+        if (morton_kernel_supported(&morton_kernels[i])) {
+            return &morton_kernels[i];
+        }
+    }
+    return &morton_kernels[num_kernels - 1];
+}
+
+/* ---- Microbenchmark ---- */
+
+static inline double morton_bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs every supported kernel over the same voxel range and prints the
+// throughput of each against the reference divide-and-morton_encode path.
+static inline int morton_benchmark(const morton_grid_t *grid, const uint8_t *data, size_t n,
+                                   size_t base_idx, uint8_t threshold, int repeats) {
+    size_t num_kernels = sizeof(morton_kernels) / sizeof(morton_kernels[0]);
+    double reference = 0.0;
+
+    morton_key_t *out = malloc(morton_count_scalar(data, n, threshold) * sizeof(morton_key_t) + 1);
+    if (!out) {
+        return -1;
+    }
+    __builtin_cpu_init();
+    morton_init_tables();
+    printf("Encode benchmark over %zu voxels, %d repeats:\n", n, repeats);
+    for (size_t k = num_kernels; k-- > 0;) {
+        const morton_kernel_t *kernel = &morton_kernels[k];
+        if (!morton_kernel_supported(kernel)) continue;
+
+        size_t code_count = 0;
+        double best = 0.0;
+        for (int r = 0; r < repeats; ++r) {
+            double t0 = morton_bench_now();
+            code_count = kernel->scan(grid, data, n, base_idx, threshold, out);
+            double elapsed = morton_bench_now() - t0;
+            if (r == 0 || elapsed < best) best = elapsed;
+        }
+        if (kernel->scan == morton_scan_scalar) reference = best;
+
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < code_count; ++i) checksum = checksum * 31 + out[i];
+        printf("  %-10s %9.3f ms  %8.1f Mvox/s  speedup %5.2fx  codes %zu  checksum %016" PRIx64 "\n", kernel->name,
+               best * 1e3, n / best * 1e-6, reference > 0 ? reference / best : 1.0, code_count, checksum);
+    }
+    free(out);
+    return 0;
+}
+
+#endif // MORTON_H
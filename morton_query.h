@@ -0,0 +1,326 @@
+#ifndef MORTON_QUERY_H
+#define MORTON_QUERY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "code_file.h"
+#include "morton.h"
+
+// Box queries over a sorted code stream, in memory or in a binary code file.
+//
+// The codes are cut into blocks and the first code of every block goes into
+// a search tree in Eytzinger (breadth-first) order, so the top levels of
+// every search share a few cache lines. In memory a block is
+// MORTON_QUERY_SAMPLE codes; a binary file already has a block index, and
+// only the blocks a query reaches are read and decoded.
+//
+// A box is not one Morton interval but many. The query walks it from its
+// lowest code: it finds the block holding the current code, reports codes
+// while they are inside the box and, at the first code outside, jumps to
+// BIGMIN, the next code inside the box. Before a block is read, LITMAX, the
+// last code of the box below the next block's first code, tells whether the
+// block can hold anything at all; if not, it is skipped unread.
+
+#define MORTON_QUERY_SAMPLE 64
+
+// Inclusive corner coordinates
+typedef struct {
+    uint32_t x0, y0, z0;
+    uint32_t x1, y1, z1;
+} morton_box_t;
+
+typedef struct {
+    size_t matches;
+    size_t searches;       // tree searches, one per jump
+    size_t blocks_read;    // blocks scanned (decoded for a file)
+    size_t blocks_skipped; // blocks ruled out by LITMAX
+} morton_query_stats_t;
+
+typedef struct {
+    const morton_key_t *codes; // in-memory codes, or NULL for a file
+    code_reader_t *reader;
+    size_t count;
+    size_t num_blocks;
+    morton_key_t *block_first;
+    size_t *block_start; // index of each block's first code, num_blocks + 1 entries
+    morton_key_t *eytz;  // block_first in Eytzinger order, 1-based
+    size_t *eytz_block;
+    morton_key_t *decoded; // the file block last decoded
+    size_t decoded_block;
+} morton_index_t;
+
+static inline int morton_in_box(morton_key_t code, const morton_box_t *box) {
+    uint32_t x, y, z;
+    morton_decode(code, &x, &y, &z);
+    return x >= box->x0 && x <= box->x1 && y >= box->y0 && y <= box->y1 && z >= box->z0 && z <= box->z1;
+}
+
+// Bits of one axis in a key (axis 0 is x, the lowest bit of each triple)
+#if MORTON_KEY_BITS == 64
+#define MORTON_X_BITS ((morton_key_t)0x9249249249249249ull)
+#else
+#define MORTON_X_BITS ((morton_key_t)0x49249249u)
+#endif
+
+static inline morton_key_t morton_axis_mask(int axis) {
+    return (morton_key_t)(MORTON_X_BITS << axis);
+}
+
+// Halve a box along the axis of bit: load_low gives the zmax of the lower
+// half (bit cleared, the axis's lower bits set), load_high the zmin of the
+// upper half (bit set, the axis's lower bits cleared)
+static inline morton_key_t morton_load_low(morton_key_t v, int bit) {
+    morton_key_t below = morton_axis_mask(bit % 3) & (((morton_key_t)1 << bit) - 1);
+    return (v & ~((morton_key_t)1 << bit)) | below;
+}
+
+static inline morton_key_t morton_load_high(morton_key_t v, int bit) {
+    morton_key_t below = morton_axis_mask(bit % 3) & (((morton_key_t)1 << bit) - 1);
+    return (v | ((morton_key_t)1 << bit)) & ~below;
+}
+
+// BIGMIN after Tropf and Herzog: the smallest code of the box spanned by
+// zmin and zmax that is not below z. Walks the bits from the top, halving
+// the box along the axis of each bit where zmin and zmax differ. Returns 0
+// and sets *out, or -1 if every code of the box is below z.
+static inline int morton_bigmin(morton_key_t z, morton_key_t zmin, morton_key_t zmax, int key_bits,
+                                morton_key_t *out) {
+    int found = 0;
+    morton_key_t bigmin = 0;
+    for (int bit = key_bits - 1; bit >= 0; --bit) {
+        int zb = (int)(z >> bit & 1), lo = (int)(zmin >> bit & 1), hi = (int)(zmax >> bit & 1);
+        if (lo == hi) {
+            if (zb == lo) continue;
+            // z is below the box (return its lowest code) or above it
+            if (zb < lo) {
+                *out = zmin;
+                return 0;
+            }
+            *out = bigmin;
+            return found ? 0 : -1;
+        }
+        if (zb == 0) {
+            // z is in the lower half; the upper half is the fallback
+            bigmin = morton_load_high(zmin, bit);
+            found = 1;
+            zmax = morton_load_low(zmax, bit);
+        } else {
+            zmin = morton_load_high(zmin, bit);
+        }
+    }
+    *out = z; // z is inside the box
+    return 0;
+}
+
+// LITMAX, the mirror of BIGMIN: the largest code of the box not above z.
+// Returns 0 and sets *out, or -1 if every code of the box is above z.
+static inline int morton_litmax(morton_key_t z, morton_key_t zmin, morton_key_t zmax, int key_bits,
+                                morton_key_t *out) {
+    int found = 0;
+    morton_key_t litmax = 0;
+    for (int bit = key_bits - 1; bit >= 0; --bit) {
+        int zb = (int)(z >> bit & 1), lo = (int)(zmin >> bit & 1), hi = (int)(zmax >> bit & 1);
+        if (lo == hi) {
+            if (zb == lo) continue;
+            if (zb > hi) {
+                *out = zmax;
+                return 0;
+            }
+            *out = litmax;
+            return found ? 0 : -1;
+        }
+        if (zb == 1) {
+            // z is in the upper half; the lower half is the fallback
+            litmax = morton_load_low(zmax, bit);
+            found = 1;
+            zmin = morton_load_high(zmin, bit);
+        } else {
+            zmax = morton_load_low(zmax, bit);
+        }
+    }
+    *out = z;
+    return 0;
+}
+
+// Lays the sorted block_first out breadth-first: eytz[k] has children
+// 2k and 2k + 1
+static inline size_t morton_eytz_fill(morton_index_t *idx, size_t k, size_t i) {
+    if (k <= idx->num_blocks) {
+        i = morton_eytz_fill(idx, 2 * k, i);
+        idx->eytz[k] = idx->block_first[i];
+        idx->eytz_block[k] = i++;
+        i = morton_eytz_fill(idx, 2 * k + 1, i);
+    }
+    return i;
+}
+
+static inline int morton_index_build(morton_index_t *idx) {
+    idx->eytz = malloc((idx->num_blocks + 1) * sizeof(morton_key_t));
+    idx->eytz_block = malloc((idx->num_blocks + 1) * sizeof(size_t));
+    if (!idx->eytz || !idx->eytz_block) {
+        return -1;
+    }
+    morton_eytz_fill(idx, 1, 0);
+    idx->decoded_block = SIZE_MAX;
+    return 0;
+}
+
+// Index over codes[0..n), which must stay alive and sorted
+static inline int morton_index_init_codes(morton_index_t *idx, const morton_key_t *codes, size_t n) {
+    *idx = (morton_index_t){.codes = codes, .count = n};
+    idx->num_blocks = (n + MORTON_QUERY_SAMPLE - 1) / MORTON_QUERY_SAMPLE;
+    idx->block_first = malloc((idx->num_blocks + 1) * sizeof(morton_key_t));
+    idx->block_start = malloc((idx->num_blocks + 1) * sizeof(size_t));
+    if (!idx->block_first || !idx->block_start) {
+        return -1;
+    }
+    for (size_t b = 0; b < idx->num_blocks; ++b) {
+        idx->block_first[b] = codes[b * MORTON_QUERY_SAMPLE];
+        idx->block_start[b] = b * MORTON_QUERY_SAMPLE;
+    }
+    idx->block_start[idx->num_blocks] = n;
+    return morton_index_build(idx);
+}
+
+// Index over an open binary code file, from its block index
+static inline int morton_index_init_reader(morton_index_t *idx, code_reader_t *reader) {
+    *idx = (morton_index_t){.reader = reader, .count = reader->hdr.count, .num_blocks = reader->hdr.num_blocks};
+    idx->block_first = malloc((idx->num_blocks + 1) * sizeof(morton_key_t));
+    idx->block_start = malloc((idx->num_blocks + 1) * sizeof(size_t));
+    idx->decoded = malloc((reader->hdr.block_codes > 0 ? reader->hdr.block_codes : 1) * sizeof(morton_key_t));
+    if (!idx->block_first || !idx->block_start || !idx->decoded) {
+        return -1;
+    }
+    size_t start = 0;
+    for (size_t b = 0; b < idx->num_blocks; ++b) {
+        idx->block_first[b] = (morton_key_t)reader->index[b].first;
+        idx->block_start[b] = start;
+        start += reader->index[b].count;
+    }
+    idx->block_start[idx->num_blocks] = start;
+    return morton_index_build(idx);
+}
+
+static inline void morton_index_free(morton_index_t *idx) {
+    free(idx->block_first);
+    free(idx->block_start);
+    free(idx->eytz);
+    free(idx->eytz_block);
+    free(idx->decoded);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// The last block whose first code is not above key (0 if key precedes all)
+static inline size_t morton_index_find_block(const morton_index_t *idx, morton_key_t key) {
+    size_t k = 1;
+    while (k <= idx->num_blocks) {
+        __builtin_prefetch(idx->eytz + 16 * k);
+        k = 2 * k + (idx->eytz[k] <= key);
+    }
+    // Undo the final right turns: k is then the first block above key
+    k >>= __builtin_ffsll(~(unsigned long long)k);
+    if (k == 0) {
+        return idx->num_blocks - 1;
+    }
+    return idx->eytz_block[k] > 0 ? idx->eytz_block[k] - 1 : 0;
+}
+
+// The codes of block b, decoding it first for a file; NULL on a read error
+static inline const morton_key_t *morton_index_block(morton_index_t *idx, size_t b) {
+    if (idx->codes) {
+        return idx->codes + idx->block_start[b];
+    }
+    if (idx->decoded_block != b) {
+        if (code_reader_read_block(idx->reader, b, idx->decoded) != 0) {
+            return NULL;
+        }
+        idx->decoded_block = b;
+    }
+    return idx->decoded;
+}
+
+typedef int (*morton_visit_fn)(void *ctx, morton_key_t code);
+
+// Calls visit for every code inside box, in increasing order, until it
+// returns nonzero. key_bits covers every code. Returns 0, or -1 on a read
+// error.
+static inline int morton_query_box(morton_index_t *idx, const morton_box_t *box, int key_bits, morton_visit_fn visit,
+                                   void *ctx, morton_query_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (idx->count == 0) {
+        return 0;
+    }
+    morton_key_t zmin = morton_encode(box->x0, box->y0, box->z0);
+    morton_key_t zmax = morton_encode(box->x1, box->y1, box->z1);
+    morton_key_t cur = zmin;
+
+    for (;;) {
+        size_t b = morton_index_find_block(idx, cur);
+        stats->searches++;
+
+        // Skip the block unread if the box has no code between cur and
+        // the next block's first code
+        if (b + 1 < idx->num_blocks) {
+            morton_key_t next = idx->block_first[b + 1], last;
+            if (morton_litmax(next - 1, zmin, zmax, key_bits, &last) != 0 || last < cur) {
+                stats->blocks_skipped++;
+                if (next > zmax || morton_bigmin(next, zmin, zmax, key_bits, &cur) != 0) {
+                    return 0;
+                }
+                continue;
+            }
+        }
+
+        const morton_key_t *codes = morton_index_block(idx, b);
+        if (!codes) {
+            return -1;
+        }
+        stats->blocks_read++;
+        size_t n = idx->block_start[b + 1] - idx->block_start[b];
+        size_t i = 0, hi = n;
+        while (i < hi) {
+            size_t mid = i + (hi - i) / 2;
+            if (codes[mid] < cur) {
+                i = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        // Report codes until one falls outside the box, then jump to
+        // BIGMIN; a new search is needed only once that leaves the block
+        int jumped = 0;
+        while (i < n && !jumped) {
+            morton_key_t code = codes[i];
+            if (code > zmax) {
+                return 0;
+            }
+            if (morton_in_box(code, box)) {
+                stats->matches++;
+                if (visit && visit(ctx, code) != 0) {
+                    return 0;
+                }
+                ++i;
+                continue;
+            }
+            if (morton_bigmin(code, zmin, zmax, key_bits, &cur) != 0) {
+                return 0;
+            }
+            if (b + 1 < idx->num_blocks && cur >= idx->block_first[b + 1]) {
+                jumped = 1;
+            }
+            while (i < n && codes[i] < cur) ++i;
+        }
+        if (!jumped) {
+            if (b + 1 >= idx->num_blocks) {
+                return 0;
+            }
+            cur = idx->block_first[b + 1];
+        }
+    }
+}
+
+#endif // MORTON_QUERY_H
@@ -0,0 +1,127 @@
+#ifndef MPI_LARGE_H
+#define MPI_LARGE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+// MPI counts and displacements are int, which caps a single call at 2^31
+// elements. These helpers take size_t counts and split the transfer into
+// pieces of at most MPI_LARGE_CHUNK_BYTES, so a rank can own more than
+// INT_MAX voxels or codes.
+
+#ifndef MPI_LARGE_CHUNK_BYTES
+#define MPI_LARGE_CHUNK_BYTES ((size_t)1 << 30)
+#endif
+
+// Tag used by the point-to-point exchange in mpi_alltoallv_large
+#define MPI_LARGE_TAG 0x4c41
+
+#if SIZE_MAX == UINT64_MAX
+#define MPI_SIZE_T MPI_UINT64_T
+#else
+#define MPI_SIZE_T MPI_UINT32_T
+#endif
+
+// Reads bytes bytes at a 64-bit file offset. Returns 0 on success and -1 on
+// an I/O error or a short read.
+static inline int mpi_read_at_large(MPI_File fh, MPI_Offset offset, void *buf, size_t bytes) {
+    size_t done = 0;
+    while (done < bytes) {
+        size_t chunk = bytes - done < MPI_LARGE_CHUNK_BYTES ? bytes - done : MPI_LARGE_CHUNK_BYTES;
+        MPI_Status status;
+        int got = 0;
+        if (MPI_File_read_at(fh, offset + (MPI_Offset)done, (char *)buf + done, (int)chunk, MPI_BYTE, &status) !=
+            MPI_SUCCESS) {
+            return -1;
+        }
+        MPI_Get_count(&status, MPI_BYTE, &got);
+        if (got <= 0) {
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+// Collective write of bytes bytes at a 64-bit file offset. The ranks agree
+// on the number of pieces, and a rank with less to write joins the later
+// rounds with empty writes, as every rank must call MPI_File_write_at_all
+// equally often. Returns 0 on success and -1 on an I/O error.
+static inline int mpi_write_at_all_large(MPI_File fh, MPI_Offset offset, const void *buf, size_t bytes,
+                                         MPI_Comm comm) {
+    uint64_t rounds = (bytes + MPI_LARGE_CHUNK_BYTES - 1) / MPI_LARGE_CHUNK_BYTES;
+    uint64_t max_rounds = 0;
+    MPI_Allreduce(&rounds, &max_rounds, 1, MPI_UINT64_T, MPI_MAX, comm);
+
+    int rc = 0;
+    for (uint64_t r = 0; r < max_rounds; ++r) {
+        size_t done = (size_t)r * MPI_LARGE_CHUNK_BYTES;
+        size_t chunk = done < bytes ? (bytes - done < MPI_LARGE_CHUNK_BYTES ? bytes - done : MPI_LARGE_CHUNK_BYTES) : 0;
+        MPI_Status status;
+        if (MPI_File_write_at_all(fh, offset + (MPI_Offset)done, chunk ? (const char *)buf + done : NULL, (int)chunk,
+                                  MPI_BYTE, &status) != MPI_SUCCESS) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+// Drop-in for MPI_Alltoallv with size_t counts and displacements (in
+// elements of type). Every block travels as one or more point-to-point
+// messages of at most MPI_LARGE_CHUNK_BYTES; messages between one pair of
+// ranks arrive in the order they were sent, so the pieces need no sequence
+// numbers. The rank's own block is copied directly.
+static inline int mpi_alltoallv_large(const void *sendbuf, const size_t *send_counts, const size_t *send_displs,
+                                      void *recvbuf, const size_t *recv_counts, const size_t *recv_displs,
+                                      MPI_Datatype type, MPI_Comm comm) {
+    int rank, size, type_size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Type_size(type, &type_size);
+    size_t chunk_elems = MPI_LARGE_CHUNK_BYTES / (size_t)type_size;
+    if (chunk_elems == 0) chunk_elems = 1;
+
+    size_t num_requests = 0;
+    for (int i = 0; i < size; ++i) {
+        if (i == rank) continue;
+        num_requests += (send_counts[i] + chunk_elems - 1) / chunk_elems;
+        num_requests += (recv_counts[i] + chunk_elems - 1) / chunk_elems;
+    }
+    MPI_Request *requests = malloc((num_requests > 0 ? num_requests : 1) * sizeof(MPI_Request));
+    if (!requests) {
+        return -1;
+    }
+
+    // Post all receives before any send; walk the peers starting after
+    // this rank so that not every rank targets rank 0 first
+    size_t r = 0;
+    for (int k = 1; k < size; ++k) {
+        int peer = (rank + size - k) % size;
+        char *base = (char *)recvbuf + recv_displs[peer] * (size_t)type_size;
+        for (size_t done = 0; done < recv_counts[peer]; done += chunk_elems) {
+            size_t n = recv_counts[peer] - done < chunk_elems ? recv_counts[peer] - done : chunk_elems;
+            MPI_Irecv(base + done * (size_t)type_size, (int)n, type, peer, MPI_LARGE_TAG, comm, &requests[r++]);
+        }
+    }
+    for (int k = 1; k < size; ++k) {
+        int peer = (rank + k) % size;
+        const char *base = (const char *)sendbuf + send_displs[peer] * (size_t)type_size;
+        for (size_t done = 0; done < send_counts[peer]; done += chunk_elems) {
+            size_t n = send_counts[peer] - done < chunk_elems ? send_counts[peer] - done : chunk_elems;
+            MPI_Isend(base + done * (size_t)type_size, (int)n, type, peer, MPI_LARGE_TAG, comm, &requests[r++]);
+        }
+    }
+
+    if (send_counts[rank] > 0) {
+        memcpy((char *)recvbuf + recv_displs[rank] * (size_t)type_size,
+               (const char *)sendbuf + send_displs[rank] * (size_t)type_size, send_counts[rank] * (size_t)type_size);
+    }
+
+    int rc = MPI_Waitall((int)r, requests, MPI_STATUSES_IGNORE);
+    free(requests);
+    return rc == MPI_SUCCESS ? 0 : -1;
+}
+
+#endif // MPI_LARGE_H
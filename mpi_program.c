@@ -5,244 +5,1106 @@
 #include <string.h>
 #include <limits.h>
 
-#define X_SIZE 1024
-#define Y_SIZE 1024
-#define Z_SIZE 314
-
-#define TOTAL_VOXELS ((size_t)X_SIZE * Y_SIZE * Z_SIZE)
-#define THRESHOLD 25
-#define BITS_PER_COORD 10
-
-// Function to compare uint32_t values for qsort
-int compare_uint32(const void *a, const void *b) {
-    uint32_t arg1 = *(const uint32_t *)a;
-    uint32_t arg2 = *(const uint32_t *)b;
-    if (arg1 < arg2) return -1;
-    if (arg1 > arg2) return 1;
+#include "arena.h"
+#include "code_file.h"
+#include "components.h"
+#include "loser_tree.h"
+#include "morton.h"
+#include "mpi_large.h"
+#include "radix_sort.h"
+#include "stage_timer.h"
+#include "thread_pool.h"
+#include "volume_config.h"
+
+#if MORTON_KEY_BITS == 64
+#define MPI_MORTON_KEY MPI_UINT64_T
+#else
+#define MPI_MORTON_KEY MPI_UINT32_T
+#endif
+
+// Samples each rank contributes to splitter selection
+#define SAMPLES_PER_RANK 64
+
+// Block size of the overlapped read; one block is counted while the next loads
+#define READ_BLOCK_BYTES ((size_t)8 << 20)
+
+// Encoded bytes a rank writes per collective write round
+#define WRITE_ROUND_BYTES ((size_t)64 << 20)
+
+// Voxels per extraction chunk, the unit of work of a rank's thread team.
+// READ_BLOCK_BYTES is a multiple of it, so every block holds whole chunks.
+#define CHUNK_VOXELS ((size_t)1 << 20)
+
+// What every rank reports to root after the sample sort
+typedef struct {
+    size_t count;
+    morton_key_t first;
+    morton_key_t last;
+    morton_key_t head[10];
+    int sorted;
+} rank_summary_t;
+
+// Picks world_size - 1 splitters from regular samples of every rank's
+// sorted codes. Returns the same splitters on every rank.
+morton_key_t *select_splitters(const morton_key_t *codes, size_t code_count, int key_bits, int world_rank,
+                               int world_size) {
+    int local_samples = code_count > 0 ? SAMPLES_PER_RANK : 0;
+    morton_key_t local[SAMPLES_PER_RANK];
+    for (int i = 0; i < local_samples; ++i) {
+        local[i] = codes[(size_t)(i + 1) * code_count / (SAMPLES_PER_RANK + 1)];
+    }
+
+    int *sample_counts = malloc(world_size * sizeof(int));
+    int *sample_displs = malloc(world_size * sizeof(int));
+    MPI_Allgather(&local_samples, 1, MPI_INT, sample_counts, 1, MPI_INT, MPI_COMM_WORLD);
+    int total_samples = 0;
+    for (int i = 0; i < world_size; ++i) {
+        sample_displs[i] = total_samples;
+        total_samples += sample_counts[i];
+    }
+
+    morton_key_t *samples = malloc((total_samples + 1) * sizeof(morton_key_t));
+    morton_key_t *sample_tmp = malloc((total_samples + 1) * sizeof(morton_key_t));
+    MPI_Allgatherv(local, local_samples, MPI_MORTON_KEY, samples, sample_counts, sample_displs, MPI_MORTON_KEY,
+                   MPI_COMM_WORLD);
+    radix_sort_keys(samples, sample_tmp, total_samples, key_bits);
+
+    // With no samples at all every key goes to the last rank
+    morton_key_t *splitters = malloc(world_size * sizeof(morton_key_t));
+    for (int i = 0; i < world_size - 1; ++i) {
+        splitters[i] = total_samples > 0 ? samples[(size_t)(i + 1) * total_samples / world_size] : MORTON_KEY_MAX;
+    }
+    if (world_rank == 0 && total_samples == 0 && world_size > 1) {
+        fprintf(stderr, "Warning: no active voxels to sample\n");
+    }
+
+    free(sample_tmp);
+    free(samples);
+    free(sample_counts);
+    free(sample_displs);
+    return splitters;
+}
+
+// A rank extracts its slab in two passes over fixed-size chunks, like the
+// pthread engine: count every chunk, prefix-sum the counts in chunk order,
+// then scan every chunk straight into its slice. In hybrid mode the chunks
+// are tasks for the rank's thread pool, otherwise the rank runs them in
+// order. Chunk ids of the count pass are relative to chunk_base, because
+// it runs block by block while the rest of the slab is still loading.
+typedef struct {
+    const uint8_t *data;
+    size_t n;
+    size_t base_idx; // global index of data[0]
+    uint8_t threshold;
+    size_t num_chunks;
+    size_t chunk_base;
+    size_t *chunk_counts;
+    size_t *chunk_offsets;
+    morton_key_t *morton_codes;
+    const morton_kernel_t *kernel;
+    const morton_grid_t *grid;
+} extract_ctx_t;
+
+void chunk_range(const extract_ctx_t *ctx, size_t chunk, size_t *start, size_t *end) {
+    *start = chunk * CHUNK_VOXELS;
+    *end = *start + CHUNK_VOXELS < ctx->n ? *start + CHUNK_VOXELS : ctx->n;
+}
+
+void count_task(void *arg, size_t chunk, int worker) {
+    extract_ctx_t *ctx = (extract_ctx_t *)arg;
+    size_t start, end;
+    (void)worker;
+
+    chunk += ctx->chunk_base;
+    chunk_range(ctx, chunk, &start, &end);
+    ctx->chunk_counts[chunk] = ctx->kernel->count(ctx->data + start, end - start, ctx->threshold);
+}
+
+void fill_task(void *arg, size_t chunk, int worker) {
+    extract_ctx_t *ctx = (extract_ctx_t *)arg;
+    size_t start, end;
+    (void)worker;
+
+    chunk_range(ctx, chunk, &start, &end);
+    ctx->kernel->scan(ctx->grid, ctx->data + start, end - start, ctx->base_idx + start, ctx->threshold,
+                      ctx->morton_codes + ctx->chunk_offsets[chunk]);
+}
+
+// Runs tasks on the pool, or one after another on this thread without one
+void run_tasks(thread_pool_t *pool, size_t num_tasks, pool_task_fn fn, void *ctx) {
+    if (pool) {
+        pool_run(pool, num_tasks, fn, ctx);
+        return;
+    }
+    for (size_t task = 0; task < num_tasks; ++task) {
+        fn(ctx, task, 0);
+    }
+}
+
+// Reads the rank's slab at offset into ctx->data with nonblocking MPI I/O,
+// double buffered: while block b + 1 is in flight, the chunks of block b
+// are counted. Only this thread calls MPI, as MPI_THREAD_FUNNELED requires.
+// Returns 0, or -1 on a read error. Time spent blocked on the read is
+// added to *wait_time.
+int read_and_count_overlapped(MPI_File fh, MPI_Offset offset, extract_ctx_t *ctx, thread_pool_t *pool,
+                              double *wait_time) {
+    uint8_t *data = (uint8_t *)ctx->data;
+    size_t n = ctx->n;
+    size_t num_blocks = (n + READ_BLOCK_BYTES - 1) / READ_BLOCK_BYTES;
+    MPI_Request request;
+    if (num_blocks == 0) {
+        return 0;
+    }
+
+    if (MPI_File_iread_at(fh, offset, data, (int)(n < READ_BLOCK_BYTES ? n : READ_BLOCK_BYTES), MPI_BYTE,
+                          &request) != MPI_SUCCESS) {
+        return -1;
+    }
+    for (size_t b = 0; b < num_blocks; ++b) {
+        size_t start = b * READ_BLOCK_BYTES;
+        size_t len = n - start < READ_BLOCK_BYTES ? n - start : READ_BLOCK_BYTES;
+        MPI_Status status;
+        int got = 0;
+        double wait_begin = MPI_Wtime();
+        MPI_Wait(&request, &status);
+        *wait_time += MPI_Wtime() - wait_begin;
+        MPI_Get_count(&status, MPI_BYTE, &got);
+        if ((size_t)got != len) {
+            return -1;
+        }
+
+        if (b + 1 < num_blocks) {
+            size_t next = start + len;
+            size_t next_len = n - next < READ_BLOCK_BYTES ? n - next : READ_BLOCK_BYTES;
+            if (MPI_File_iread_at(fh, offset + (MPI_Offset)next, data + next, (int)next_len, MPI_BYTE, &request) !=
+                MPI_SUCCESS) {
+                return -1;
+            }
+        }
+        ctx->chunk_base = start / CHUNK_VOXELS;
+        run_tasks(pool, (len + CHUNK_VOXELS - 1) / CHUNK_VOXELS, count_task, ctx);
+    }
     return 0;
 }
 
-// Function to interleave bits for Morton code
-uint32_t expand_bits(uint32_t x) {
-    x &= 0x3FF; // Ensure x is 10 bits
-    x = (x | (x << 16)) & 0x30000FF;
-    x = (x | (x << 8))  & 0x300F00F;
-    x = (x | (x << 4))  & 0x30C30C3;
-    x = (x | (x << 2))  & 0x9249249;
-    return x;
+// Index of the first code greater than key
+size_t upper_bound_key(const morton_key_t *codes, size_t n, morton_key_t key) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (codes[mid] <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-// Function to compute Morton code from x, y, z
-uint32_t morton_encode(uint32_t x, uint32_t y, uint32_t z) {
-    return expand_bits(x) | (expand_bits(y) << 1) | (expand_bits(z) << 2);
+// Rank i receives the sorted codes in (splitters[i - 1], splitters[i]]
+void partition_by_splitters(const morton_key_t *codes, size_t code_count, const morton_key_t *splitters,
+                            int world_size, size_t *send_counts, size_t *send_displs) {
+    size_t begin = 0;
+    for (int i = 0; i < world_size; ++i) {
+        size_t end = i < world_size - 1 ? upper_bound_key(codes, code_count, splitters[i]) : code_count;
+        if (end < begin) end = begin;
+        send_displs[i] = begin;
+        send_counts[i] = end - begin;
+        begin = end;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    MPI_Init(&argc, &argv);
+// Writes every rank's codes to one shared file with collective MPI-IO. Each
+// rank sizes its encoded output first, and an exclusive prefix sum of the
+// sizes gives every rank the file offset of its key range. The ranks then
+// encode and write their ranges in rounds of MPI_File_write_at_all, so all
+// of them write at once. For the binary format the block indexes follow
+// the data in the same way and rank 0 writes the header.
+int write_codes_collective(const char *path, code_format_t format, code_file_header_t *header,
+                           const morton_key_t *codes, size_t code_count, int world_rank) {
+    uint64_t data_start = format == CODE_FORMAT_BINARY ? CODE_FILE_HEADER_BYTES : 0;
+    uint64_t local_bytes = code_encoded_size(format, (int)header->key_bits, codes, code_count);
+    uint64_t bytes_before = 0;
+    uint64_t total_bytes = 0;
+    MPI_Exscan(&local_bytes, &bytes_before, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    if (world_rank == 0) bytes_before = 0; // MPI_Exscan leaves rank 0's result undefined
+    MPI_Allreduce(&local_bytes, &total_bytes, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
 
-    int world_rank, world_size;
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_File fh;
+    if (MPI_File_open(MPI_COMM_WORLD, path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        return 0;
+    }
+    int ok = MPI_File_set_size(fh, 0) == MPI_SUCCESS;
+
+    // Every rank joins every round; a rank that has run out of codes
+    // writes nothing
+    size_t round_codes = WRITE_ROUND_BYTES / CODE_MAX_ENCODED;
+    uint64_t rounds = (code_count + round_codes - 1) / round_codes;
+    uint64_t max_rounds = 0;
+    MPI_Allreduce(&rounds, &max_rounds, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
 
-    size_t voxels_per_proc = TOTAL_VOXELS / world_size;
-    size_t remainder = TOTAL_VOXELS % world_size;
+    code_writer_t writer;
+    size_t buf_codes = code_count < round_codes ? code_count : round_codes;
+    int have_writer = code_writer_open_mem(&writer, format, (int)header->key_bits, data_start + bytes_before,
+                                           buf_codes * CODE_MAX_ENCODED) == 0;
+    ok &= have_writer;
+    for (uint64_t r = 0; r < max_rounds; ++r) {
+        size_t begin = (size_t)r * round_codes;
+        size_t n = begin < code_count ? (code_count - begin < round_codes ? code_count - begin : round_codes) : 0;
+        const uint8_t *buf = NULL;
+        size_t len = 0;
+        uint64_t offset = data_start + bytes_before;
+        if (have_writer) {
+            code_writer_put(&writer, codes + begin, n);
+            if (begin + n == code_count) code_writer_end(&writer);
+            offset = writer.offset;
+            buf = code_writer_take(&writer, &len);
+        }
+        MPI_Status status;
+        if (MPI_File_write_at_all(fh, (MPI_Offset)offset, buf, (int)len, MPI_BYTE, &status) != MPI_SUCCESS) {
+            ok = 0;
+        }
+    }
+    // The sizing pass and the encoder must agree, or ranges would overlap
+    if (have_writer && (writer.failed || writer.offset != data_start + bytes_before + local_bytes)) {
+        ok = 0;
+    }
 
-    int *counts = malloc(world_size * sizeof(int));
-    int *displs = malloc(world_size * sizeof(int));
+    if (format == CODE_FORMAT_BINARY) {
+        uint64_t local_blocks = have_writer ? writer.num_blocks : 0;
+        uint64_t blocks_before = 0;
+        uint64_t totals[2] = {0, 0};
+        uint64_t local_totals[2] = {code_count, local_blocks};
+        MPI_Exscan(&local_blocks, &blocks_before, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        if (world_rank == 0) blocks_before = 0;
+        MPI_Allreduce(local_totals, totals, 2, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
 
-    // Assign counts and displacements
-    for (int i = 0; i < world_size; i++) {
-        size_t count = voxels_per_proc;
-        if (i == world_size - 1) {
-            count += remainder;
+        uint64_t index_offset = data_start + total_bytes;
+        size_t index_bytes = local_blocks * CODE_FILE_INDEX_ENTRY_BYTES;
+        uint8_t *entries = malloc(index_bytes > 0 ? index_bytes : 1);
+        if (!entries) {
+            ok = 0;
+            index_bytes = 0;
+        }
+        for (size_t b = 0; entries && b < local_blocks; ++b) {
+            code_put_index_entry(entries + b * CODE_FILE_INDEX_ENTRY_BYTES, &writer.index[b]);
+        }
+        if (mpi_write_at_all_large(fh, (MPI_Offset)(index_offset + blocks_before * CODE_FILE_INDEX_ENTRY_BYTES),
+                                   entries, index_bytes, MPI_COMM_WORLD) != 0) {
+            ok = 0;
+        }
+        free(entries);
+
+        if (world_rank == 0) {
+            uint8_t bytes[CODE_FILE_HEADER_BYTES];
+            MPI_Status status;
+            header->count = totals[0];
+            header->num_blocks = totals[1];
+            header->index_offset = index_offset;
+            code_put_header(bytes, header);
+            if (MPI_File_write_at(fh, 0, bytes, CODE_FILE_HEADER_BYTES, MPI_BYTE, &status) != MPI_SUCCESS) {
+                ok = 0;
+            }
+        }
+    }
+
+    if (have_writer) code_writer_close(&writer, NULL);
+    if (MPI_File_close(&fh) != MPI_SUCCESS) ok = 0;
+    return ok;
+}
+
+// Index of key in a list of (code, label) pairs sorted by code, or SIZE_MAX
+size_t find_pair(const morton_key_t *pairs, size_t n, morton_key_t key) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pairs[2 * mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && pairs[2 * lo] == key ? lo : SIZE_MAX;
+}
+
+int compare_pairs(const void *a, const void *b) {
+    const morton_key_t *pa = (const morton_key_t *)a;
+    const morton_key_t *pb = (const morton_key_t *)b;
+    if (pa[0] != pb[0]) return pa[0] < pb[0] ? -1 : 1;
+    return (pa[1] > pb[1]) - (pa[1] < pb[1]);
+}
+
+// Sorts n (key, value) pairs and drops repeated ones; returns how many are left
+size_t sort_unique_pairs(morton_key_t *pairs, size_t n) {
+    qsort(pairs, n, 2 * sizeof(morton_key_t), compare_pairs);
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (m == 0 || pairs[2 * i] != pairs[2 * (m - 1)] || pairs[2 * i + 1] != pairs[2 * (m - 1) + 1]) {
+            pairs[2 * m] = pairs[2 * i];
+            pairs[2 * m + 1] = pairs[2 * i + 1];
+            m++;
+        }
+    }
+    return m;
+}
+
+// Root side of the boundary merge: the edges join labels of components
+// that touch across a rank boundary. Returns the sorted (label, final
+// label) pairs of every label that is not its component's smallest, and
+// their count in *num_moves.
+morton_key_t *resolve_label_edges(const morton_key_t *edges, size_t num_edges, size_t *num_moves) {
+    size_t m = 2 * num_edges;
+    morton_key_t *labels = malloc((m > 0 ? m : 1) * sizeof(morton_key_t));
+    size_t *parent = malloc((m > 0 ? m : 1) * sizeof(size_t));
+    morton_key_t *moves = malloc((m > 0 ? m : 1) * 2 * sizeof(morton_key_t));
+    if (!labels || !parent || !moves) {
+        free(labels);
+        free(parent);
+        free(moves);
+        return NULL;
+    }
+    memcpy(labels, edges, m * sizeof(morton_key_t));
+    qsort(labels, m, sizeof(morton_key_t), lt_compare_keys);
+    size_t u = 0;
+    for (size_t i = 0; i < m; ++i) {
+        if (u == 0 || labels[i] != labels[u - 1]) labels[u++] = labels[i];
+    }
+    // Indices follow the label order, so a root is its component's smallest label
+    for (size_t i = 0; i < u; ++i) parent[i] = i;
+    for (size_t e = 0; e < num_edges; ++e) {
+        uf_unite(parent, lt_lower_bound(labels, u, edges[2 * e]), lt_lower_bound(labels, u, edges[2 * e + 1]));
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < u; ++i) {
+        size_t root = uf_find(parent, i);
+        if (root != i) {
+            moves[2 * n] = labels[i];
+            moves[2 * n + 1] = labels[root];
+            n++;
+        }
+    }
+    *num_moves = n;
+    free(labels);
+    free(parent);
+    return moves;
+}
+
+// Replaces every label that has a (label, final) pair in moves
+void apply_label_moves(morton_key_t *labels, size_t n, const morton_key_t *moves, size_t num_moves) {
+    for (size_t i = 0; i < n && num_moves > 0; ++i) {
+        size_t k = find_pair(moves, num_moves, labels[i]);
+        if (k != SIZE_MAX) labels[i] = moves[2 * k + 1];
+    }
+}
+
+// Labels the 6-connected components of the rank's codes, a contiguous range
+// of voxel indices, and joins them across rank boundaries. A neighbour of a
+// voxel lies at most one slab further on, so only the last slab of a range
+// can touch later ranks, and only their first slab. Every rank shares the
+// (code, label) pairs of its first slab, looks up the neighbours its own
+// voxels have past its range and sends the label pairs that touch to root.
+// Root joins them and sends back the final label of every label that
+// changed. labels[i] ends up as the smallest code of code i's component
+// over the whole volume, as in the other engines, and root's set gets every
+// component with its size. Returns 0, or -1 on every rank if any failed.
+int label_components_distributed(thread_pool_t *pool, const volume_config_t *cfg, const morton_key_t *codes,
+                                 size_t n, size_t voxel_start, size_t voxel_count, size_t voxels_per_proc,
+                                 int world_rank, int world_size, morton_key_t *labels, component_set_t *set) {
+    size_t slab = volume_slab_voxels(cfg);
+    size_t voxel_end = voxel_start + voxel_count;
+    uint32_t size[3] = {cfg->x_size, cfg->y_size, cfg->z_size};
+    size_t steps[3] = {1, cfg->x_size, slab};
+    *set = (component_set_t){0};
+    component_set_t local;
+    int ok = components_label(pool, codes, n, cfg->x_size, cfg->y_size, cfg->z_size, labels, &local) == 0;
+
+    // The (code, label) pairs of the first slab, in code order
+    morton_key_t *head = malloc((n > 0 ? n : 1) * 2 * sizeof(morton_key_t));
+    size_t num_head = 0;
+    ok &= head != NULL;
+    for (size_t i = 0; ok && i < n; ++i) {
+        uint32_t x, y, z;
+        morton_decode(codes[i], &x, &y, &z);
+        if (((size_t)z * cfg->y_size + y) * cfg->x_size + x < voxel_start + slab) {
+            head[2 * num_head] = codes[i];
+            head[2 * num_head + 1] = labels[i];
+            num_head++;
+        }
+    }
+
+    // Everything below moves with int counts; a failed rank sends -1
+    int local_keys = ok && 2 * num_head <= INT_MAX ? (int)(2 * num_head) : -1;
+    int *rank_keys = malloc(world_size * sizeof(int));
+    int *rank_displs = malloc(world_size * sizeof(int));
+    if (!rank_keys || !rank_displs) {
+        fprintf(stderr, "Process %d: Failed to allocate label exchange counts\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Allgather(&local_keys, 1, MPI_INT, rank_keys, 1, MPI_INT, MPI_COMM_WORLD);
+    long long total_keys = 0;
+    for (int r = 0; r < world_size && total_keys >= 0; ++r) {
+        rank_displs[r] = (int)total_keys;
+        total_keys = rank_keys[r] < 0 || total_keys + rank_keys[r] > INT_MAX ? -1 : total_keys + rank_keys[r];
+    }
+    morton_key_t *heads = NULL;
+    if (total_keys >= 0) {
+        heads = malloc((total_keys > 0 ? (size_t)total_keys : 1) * sizeof(morton_key_t));
+        if (!heads) {
+            fprintf(stderr, "Process %d: Failed to allocate boundary slabs\n", world_rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        MPI_Allgatherv(head, local_keys, MPI_MORTON_KEY, heads, rank_keys, rank_displs, MPI_MORTON_KEY,
+                       MPI_COMM_WORLD);
+    }
+    free(head);
+
+    // Label pairs across the boundary: a neighbour past the range belongs
+    // to the rank whose share holds its index, in that rank's first slab
+    morton_key_t *edges = NULL;
+    size_t num_edges = 0, edge_cap = 0;
+    for (size_t i = 0; heads && i < n; ++i) {
+        uint32_t coord[3];
+        morton_decode(codes[i], &coord[0], &coord[1], &coord[2]);
+        size_t flat = ((size_t)coord[2] * cfg->y_size + coord[1]) * cfg->x_size + coord[0];
+        if (flat + slab < voxel_end) continue;
+        for (int axis = 0; axis < 3; ++axis) {
+            size_t next_flat = flat + steps[axis];
+            if (coord[axis] + 1 >= size[axis] || next_flat < voxel_end) continue;
+            int owner = voxels_per_proc > 0 && next_flat / voxels_per_proc < (size_t)world_size
+                            ? (int)(next_flat / voxels_per_proc)
+                            : world_size - 1;
+            uint32_t next[3] = {coord[0], coord[1], coord[2]};
+            next[axis]++;
+            const morton_key_t *pairs = heads + rank_displs[owner];
+            size_t k = find_pair(pairs, (size_t)rank_keys[owner] / 2, morton_encode(next[0], next[1], next[2]));
+            if (k == SIZE_MAX) continue;
+            if (num_edges == edge_cap) {
+                edge_cap = edge_cap ? 2 * edge_cap : 1024;
+                morton_key_t *grown = realloc(edges, edge_cap * 2 * sizeof(morton_key_t));
+                if (!grown) {
+                    fprintf(stderr, "Process %d: Failed to allocate boundary edges\n", world_rank);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                edges = grown;
+            }
+            edges[2 * num_edges] = labels[i];
+            edges[2 * num_edges + 1] = pairs[2 * k + 1];
+            num_edges++;
+        }
+    }
+    free(heads);
+    num_edges = sort_unique_pairs(edges, num_edges);
+
+    // Root joins the labels and hands out the moves
+    local_keys = total_keys >= 0 && 2 * num_edges <= INT_MAX ? (int)(2 * num_edges) : -1;
+    MPI_Gather(&local_keys, 1, MPI_INT, rank_keys, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    long long moves_keys = 0;
+    morton_key_t *all_edges = NULL;
+    if (world_rank == 0) {
+        long long total = 0;
+        for (int r = 0; r < world_size && total >= 0; ++r) {
+            rank_displs[r] = (int)total;
+            total = rank_keys[r] < 0 || total + rank_keys[r] > INT_MAX ? -1 : total + rank_keys[r];
+        }
+        moves_keys = total < 0 ? -1 : 0;
+        all_edges = malloc((total > 0 ? (size_t)total : 1) * sizeof(morton_key_t));
+        if (!all_edges) {
+            fprintf(stderr, "Error: Failed to allocate boundary edges\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Bcast(&moves_keys, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    if (moves_keys < 0) {
+        if (world_rank == 0) fprintf(stderr, "Error: Failed to label components or to exchange their boundaries\n");
+        free(edges);
+        free(all_edges);
+        free(rank_keys);
+        free(rank_displs);
+        components_free(&local);
+        return -1;
+    }
+    MPI_Gatherv(edges, local_keys, MPI_MORTON_KEY, all_edges, rank_keys, rank_displs, MPI_MORTON_KEY, 0,
+                MPI_COMM_WORLD);
+    free(edges);
+    morton_key_t *moves = NULL;
+    size_t num_moves = 0;
+    if (world_rank == 0) {
+        size_t total_edges = (size_t)(rank_displs[world_size - 1] + rank_keys[world_size - 1]) / 2;
+        moves = resolve_label_edges(all_edges, total_edges, &num_moves);
+        if (!moves || 2 * num_moves > INT_MAX) {
+            fprintf(stderr, "Error: Failed to join components across ranks\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        moves_keys = (long long)(2 * num_moves);
+    }
+    free(all_edges);
+    MPI_Bcast(&moves_keys, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    num_moves = (size_t)moves_keys / 2;
+    if (world_rank != 0) {
+        moves = malloc((num_moves > 0 ? num_moves : 1) * 2 * sizeof(morton_key_t));
+        if (!moves) {
+            fprintf(stderr, "Process %d: Failed to allocate label moves\n", world_rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Bcast(moves, (int)moves_keys, MPI_MORTON_KEY, 0, MPI_COMM_WORLD);
+    apply_label_moves(labels, n, moves, num_moves);
+    apply_label_moves(local.labels, local.count, moves, num_moves);
+    free(moves);
+
+    // Root adds up the sizes of the pieces of every component; the sizes
+    // travel as keys, and no component outgrows the key space
+    morton_key_t *pieces = malloc((local.count > 0 ? local.count : 1) * 2 * sizeof(morton_key_t));
+    if (!pieces || 2 * local.count > INT_MAX) {
+        fprintf(stderr, "Process %d: Failed to collect component sizes\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (size_t k = 0; k < local.count; ++k) {
+        pieces[2 * k] = local.labels[k];
+        pieces[2 * k + 1] = (morton_key_t)local.sizes[k];
+    }
+    local_keys = (int)(2 * local.count);
+    components_free(&local);
+    MPI_Gather(&local_keys, 1, MPI_INT, rank_keys, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    morton_key_t *all_pieces = NULL;
+    size_t total_pieces = 0;
+    if (world_rank == 0) {
+        long long total = 0;
+        for (int r = 0; r < world_size; ++r) {
+            rank_displs[r] = (int)total;
+            total += rank_keys[r];
+        }
+        total_pieces = (size_t)total / 2;
+        all_pieces = malloc((total_pieces > 0 ? total_pieces : 1) * 2 * sizeof(morton_key_t));
+        if (total > INT_MAX || !all_pieces) {
+            fprintf(stderr, "Error: Failed to collect component sizes\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        if (count > INT_MAX) {
-            fprintf(stderr, "Process %d: Count exceeds INT_MAX\n", world_rank);
+    }
+    MPI_Gatherv(pieces, local_keys, MPI_MORTON_KEY, all_pieces, rank_keys, rank_displs, MPI_MORTON_KEY, 0,
+                MPI_COMM_WORLD);
+    free(pieces);
+    free(rank_keys);
+    free(rank_displs);
+
+    if (world_rank == 0) {
+        qsort(all_pieces, total_pieces, 2 * sizeof(morton_key_t), compare_pairs);
+        set->labels = malloc((total_pieces > 0 ? total_pieces : 1) * sizeof(morton_key_t));
+        set->sizes = malloc((total_pieces > 0 ? total_pieces : 1) * sizeof(size_t));
+        if (!set->labels || !set->sizes) {
+            fprintf(stderr, "Error: Failed to collect component sizes\n");
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        counts[i] = (int)count;
-        displs[i] = (int)(i * voxels_per_proc);
+        for (size_t k = 0; k < total_pieces; ++k) {
+            if (set->count == 0 || set->labels[set->count - 1] != all_pieces[2 * k]) {
+                set->labels[set->count] = all_pieces[2 * k];
+                set->sizes[set->count++] = 0;
+            }
+            set->sizes[set->count - 1] += (size_t)all_pieces[2 * k + 1];
+        }
+        free(all_pieces);
+    }
+    return 0;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: mpirun -np N %s [options]\n", prog);
+    printf("  --bench-encode     compare the encode kernels on rank 0's slab instead of running the pipeline\n");
+    printf("  --threads N        hybrid mode: N threads per rank scan, sort and merge the rank's codes\n");
+    printf("                     (start one rank per node, e.g. mpirun --map-by ppr:1:node --bind-to none)\n");
+    printf("  --format FMT       text (default), fixed (zero-padded text) or binary\n");
+    printf("  --json PATH        write per-stage and per-rank timings as JSON from rank 0 (- for stdout;\n");
+    printf("                     the report then goes to stderr)\n");
+    printf("  --perf             count cycles, instructions and cache, branch and TLB misses per stage and rank\n");
+    printf("  --components       label the 6-connected components (component_labels_mpi.txt, one label per\n");
+    printf("                     code; component_sizes_mpi.txt)\n");
+    volume_config_usage(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    // Threads of the hybrid mode never call MPI, so FUNNELED is enough
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+
+    int world_rank, world_size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    // Every rank parses the same arguments; only rank 0 reports problems
+    volume_config_t cfg;
+    volume_config_defaults(&cfg);
+    int bench_encode = 0;
+    int args_ok = 1;
+    code_format_t format = CODE_FORMAT_TEXT;
+    const char *json_path = NULL;
+    int perf = 0;
+    int num_threads = 1;
+    int label_components = 0;
+    for (int i = 1; i < argc && args_ok; ++i) {
+        int rc = volume_config_parse_arg(&cfg, argc, argv, &i);
+        if (rc < 0) {
+            args_ok = 0;
+        } else if (rc == 0 && strcmp(argv[i], "--bench-encode") == 0) {
+            bench_encode = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (rc == 0 && strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--components") == 0) {
+            label_components = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+            if (num_threads <= 0 || num_threads > POOL_MAX_THREADS) {
+                if (world_rank == 0) {
+                    fprintf(stderr, "Error: Invalid number of threads %s (expected 1-%d)\n", argv[i], POOL_MAX_THREADS);
+                }
+                args_ok = 0;
+            }
+        } else if (rc == 0 && strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            args_ok = code_format_parse(argv[++i], &format) == 0;
+        } else if (rc == 0) {
+            if (world_rank == 0) print_usage(argv[0]);
+            args_ok = 0;
+        }
     }
+    if (!args_ok || volume_config_check(&cfg) != 0) {
+        MPI_Finalize();
+        return 1;
+    }
+    // With --json -, stdout carries only the JSON report
+    if (json_path && strcmp(json_path, "-") == 0 && stage_json_claim_stdout() != 0) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    size_t total_voxels = volume_total_voxels(&cfg);
+
+    size_t voxels_per_proc = total_voxels / world_size;
+    size_t remainder = total_voxels % world_size;
 
-    size_t local_voxel_count = (size_t)counts[world_rank];
+    // Every rank takes an equal share of voxels; the last one also takes the remainder
+    size_t local_voxel_start = (size_t)world_rank * voxels_per_proc;
+    size_t local_voxel_count = voxels_per_proc + (world_rank == world_size - 1 ? remainder : 0);
 
-    // Allocate local data
-    uint8_t *local_data = malloc(local_voxel_count * sizeof(uint8_t));
-    if (!local_data) {
+    // Allocate local data; this and every code buffer below is sized
+    // exactly and lives in its own huge-page arena, released as soon as
+    // the pipeline is done with it
+    arena_t data_arena;
+    if (arena_init(&data_arena, local_voxel_count, ARENA_HUGETLB) != 0) {
         fprintf(stderr, "Process %d: Failed to allocate local_data array\n", world_rank);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    uint8_t *local_data = arena_alloc(&data_arena, local_voxel_count);
 
     // Read data in parallel using MPI I/O
     MPI_File fh;
-    MPI_File_open(MPI_COMM_WORLD, "c8.raw", MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+    if (MPI_File_open(MPI_COMM_WORLD, cfg.path, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        if (world_rank == 0) fprintf(stderr, "Error: Failed to open %s\n", cfg.path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    // A nonblocking read past the end of the file may never complete, so a
+    // file shorter than the volume fails here, before any read is posted
+    MPI_Offset file_size = 0;
+    if (MPI_File_get_size(fh, &file_size) != MPI_SUCCESS ||
+        (uint64_t)file_size < (uint64_t)(local_voxel_start + local_voxel_count)) {
+        fprintf(stderr, "Process %d: Failed to read %zu voxels from %s (the file holds %lld bytes, %zu needed)\n",
+                world_rank, local_voxel_count, cfg.path, (long long)file_size, total_voxels);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
-    MPI_Offset offset = (MPI_Offset)displs[world_rank];
-    MPI_Status status;
-    MPI_File_read_at(fh, offset, local_data, counts[world_rank], MPI_UNSIGNED_CHAR, &status);
-    MPI_File_close(&fh);
+    // Compare the encode kernels on rank 0's slab instead of running the pipeline
+    if (bench_encode) {
+        if (mpi_read_at_large(fh, (MPI_Offset)local_voxel_start, local_data, local_voxel_count) != 0) {
+            fprintf(stderr, "Process %d: Failed to read %zu voxels from %s\n", world_rank, local_voxel_count,
+                    cfg.path);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        MPI_File_close(&fh);
+        if (world_rank == 0) {
+            morton_grid_t bench_grid = morton_grid(cfg.x_size, cfg.y_size, cfg.z_size);
+            morton_benchmark(&bench_grid, local_data, local_voxel_count, local_voxel_start, cfg.threshold, 3);
+        }
+        arena_destroy(&data_arena);
+        MPI_Finalize();
+        return 0;
+    }
 
-    // Start timing
+    const morton_kernel_t *kernel = morton_select_kernel();
+    morton_grid_t grid = morton_grid(cfg.x_size, cfg.y_size, cfg.z_size);
+
+    if (num_threads > 1 && thread_support < MPI_THREAD_FUNNELED) {
+        if (world_rank == 0) fprintf(stderr, "Warning: MPI library lacks MPI_THREAD_FUNNELED, using one thread\n");
+        num_threads = 1;
+    }
+    thread_pool_t *pool = NULL;
+    if (num_threads > 1) {
+        pool = pool_create(num_threads);
+        if (!pool) {
+            fprintf(stderr, "Process %d: Failed to create thread pool\n", world_rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
+    size_t num_chunks = (local_voxel_count + CHUNK_VOXELS - 1) / CHUNK_VOXELS;
+    extract_ctx_t ctx = {
+        .data = local_data,
+        .n = local_voxel_count,
+        .base_idx = local_voxel_start,
+        .threshold = cfg.threshold,
+        .num_chunks = num_chunks,
+        .chunk_counts = malloc((num_chunks + 1) * sizeof(size_t)),
+        .chunk_offsets = malloc((num_chunks + 1) * sizeof(size_t)),
+        .kernel = kernel,
+        .grid = &grid};
+    if (!ctx.chunk_counts || !ctx.chunk_offsets) {
+        fprintf(stderr, "Process %d: Failed to allocate chunk counts\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Start timing; the read overlaps the count pass, so it is included
     MPI_Barrier(MPI_COMM_WORLD);
     double start_time = MPI_Wtime();
+    stage_timer_t timer;
+    stage_timer_init(&timer);
+    if (pool) stage_timer_attach_pool(&timer, pool);
+    if (perf && stage_timer_enable_perf(&timer) == 0 && world_rank == 0) {
+        fprintf(stderr, "Warning: No hardware counters available (no PMU or perf_event_paranoid > 2)\n");
+    }
 
-    // First pass: Count active voxels
-    size_t active_voxels = 0;
-    for (size_t i = 0; i < local_voxel_count; ++i) {
-        if (local_data[i] > THRESHOLD) {
-            ++active_voxels;
-        }
+    // First pass: Count active voxels while the rest of the slab loads
+    double t = stage_begin();
+    double read_wait = 0.0;
+    if (read_and_count_overlapped(fh, (MPI_Offset)local_voxel_start, &ctx, pool, &read_wait) != 0) {
+        fprintf(stderr, "Process %d: Failed to read %zu voxels from %s\n", world_rank, local_voxel_count, cfg.path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    MPI_File_close(&fh);
+    stage_add(&timer, STAGE_LOAD, read_wait);
+    stage_end(&timer, STAGE_SCAN, t + read_wait);
+    t = stage_begin();
 
-    // Allocate morton_codes based on active_voxels
-    uint32_t *morton_codes = malloc(active_voxels * sizeof(uint32_t));
-    if (!morton_codes) {
+    // Allocate morton_codes based on the per-chunk counts
+    size_t code_count = 0;
+    for (size_t c = 0; c < num_chunks; ++c) {
+        ctx.chunk_offsets[c] = code_count;
+        code_count += ctx.chunk_counts[c];
+    }
+    arena_t code_arena;
+    if (arena_init(&code_arena, code_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0) {
         fprintf(stderr, "Process %d: Failed to allocate morton_codes\n", world_rank);
-        free(local_data);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    morton_key_t *morton_codes = arena_alloc(&code_arena, code_count * sizeof(morton_key_t));
+    ctx.morton_codes = morton_codes;
 
     // Second pass: Compute Morton codes
-    size_t code_count = 0;
-    size_t start_idx = (size_t)displs[world_rank];
-    for (size_t i = 0; i < local_voxel_count; ++i) {
-        uint8_t value = local_data[i];
-        if (value > THRESHOLD) {
-            // Compute global index
-            size_t idx = start_idx + i;
-            // Compute x, y, z from idx
-            size_t temp_idx = idx;
-            uint32_t x = temp_idx % X_SIZE;
-            temp_idx /= X_SIZE;
-            uint32_t y = temp_idx % Y_SIZE;
-            uint32_t z = temp_idx / Y_SIZE;
+    run_tasks(pool, num_chunks, fill_task, &ctx);
+    free(ctx.chunk_counts);
+    free(ctx.chunk_offsets);
+    const char *buffer_pages = arena_backing_name(&code_arena);
+    arena_destroy(&data_arena);
+    stage_end(&timer, STAGE_SCAN, t);
 
-            uint32_t morton_code = morton_encode(x, y, z);
-            morton_codes[code_count++] = morton_code;
+    // Sort morton_codes locally
+    t = stage_begin();
+    arena_t sort_arena;
+    if (arena_init(&sort_arena, code_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0) {
+        fprintf(stderr, "Process %d: Failed to allocate sort buffer\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    morton_key_t *sort_buffer = arena_alloc(&sort_arena, code_count * sizeof(morton_key_t));
+    if (pool) {
+        radix_sort_keys_pool(pool, morton_codes, sort_buffer, code_count, grid.key_bits);
+    } else {
+        radix_sort_keys(morton_codes, sort_buffer, code_count, grid.key_bits);
+    }
+    arena_destroy(&sort_arena);
+    stage_end(&timer, STAGE_SORT, t);
+
+    // Components are labelled on the rank's own voxels, which are still
+    // one range of the volume; the labels then travel with their codes
+    arena_t label_arena = {0};
+    morton_key_t *labels = NULL;
+    component_set_t components = {0};
+    int components_rc = 0;
+    if (label_components) {
+        t = stage_begin();
+        if (arena_init(&label_arena, code_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0) {
+            fprintf(stderr, "Process %d: Failed to allocate component labels\n", world_rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        labels = arena_alloc(&label_arena, code_count * sizeof(morton_key_t));
+        components_rc = label_components_distributed(pool, &cfg, morton_codes, code_count, local_voxel_start,
+                                                     local_voxel_count, voxels_per_proc, world_rank, world_size,
+                                                     labels, &components);
+        stage_end(&timer, STAGE_LABEL, t);
     }
 
-    // Sort morton_codes locally
-    qsort(morton_codes, code_count, sizeof(uint32_t), compare_uint32);
+    // Distributed sample sort: every rank ends up owning one globally
+    // ordered key range, so no rank ever holds the whole dataset
+    size_t *send_counts = malloc(world_size * sizeof(size_t));
+    size_t *send_displs = malloc(world_size * sizeof(size_t));
+    size_t *recv_counts = malloc(world_size * sizeof(size_t));
+    size_t *recv_displs = malloc(world_size * sizeof(size_t));
 
-    // Gather code counts
-    int *recv_counts = NULL;
-    int *recv_displs = NULL;
-    if (world_rank == 0) {
-        recv_counts = malloc(world_size * sizeof(int));
-        recv_displs = malloc(world_size * sizeof(int));
-    }
+    t = stage_begin();
+    morton_key_t *splitters = select_splitters(morton_codes, code_count, grid.key_bits, world_rank, world_size);
+    partition_by_splitters(morton_codes, code_count, splitters, world_size, send_counts, send_displs);
+    free(splitters);
 
-    int code_count_int = (int)code_count;
-    MPI_Gather(&code_count_int, 1, MPI_INT, recv_counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Alltoall(send_counts, 1, MPI_SIZE_T, recv_counts, 1, MPI_SIZE_T, MPI_COMM_WORLD);
+    size_t owned_count = 0;
+    for (int i = 0; i < world_size; ++i) {
+        recv_displs[i] = owned_count;
+        owned_count += recv_counts[i];
+    }
 
-    uint32_t *all_morton_codes = NULL;
-    if (world_rank == 0) {
-        int total_codes = 0;
-        recv_displs[0] = 0;
-        for (int i = 0; i < world_size; ++i) {
-            total_codes += recv_counts[i];
-            if (i > 0) {
-                recv_displs[i] = recv_displs[i - 1] + recv_counts[i - 1];
-            }
+    arena_t received_arena, owned_arena;
+    if (arena_init(&received_arena, owned_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0 ||
+        arena_init(&owned_arena, owned_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0) {
+        fprintf(stderr, "Process %d: Failed to allocate exchange buffers\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    morton_key_t *received_codes = arena_alloc(&received_arena, owned_count * sizeof(morton_key_t));
+    morton_key_t *owned_codes = arena_alloc(&owned_arena, owned_count * sizeof(morton_key_t));
+    // Chunked exchange: a single rank may send or own more than INT_MAX codes
+    if (mpi_alltoallv_large(morton_codes, send_counts, send_displs, received_codes, recv_counts, recv_displs,
+                            MPI_MORTON_KEY, MPI_COMM_WORLD) != 0) {
+        fprintf(stderr, "Process %d: Failed to exchange codes\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    arena_destroy(&code_arena);
+    arena_t received_label_arena = {0}, owned_label_arena = {0};
+    morton_key_t *received_labels = NULL, *owned_labels = NULL;
+    if (labels) {
+        if (arena_init(&received_label_arena, owned_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0 ||
+            arena_init(&owned_label_arena, owned_count * sizeof(morton_key_t), ARENA_HUGETLB) != 0) {
+            fprintf(stderr, "Process %d: Failed to allocate label exchange buffers\n", world_rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        all_morton_codes = malloc(total_codes * sizeof(uint32_t));
+        received_labels = arena_alloc(&received_label_arena, owned_count * sizeof(morton_key_t));
+        owned_labels = arena_alloc(&owned_label_arena, owned_count * sizeof(morton_key_t));
+        if (mpi_alltoallv_large(labels, send_counts, send_displs, received_labels, recv_counts, recv_displs,
+                                MPI_MORTON_KEY, MPI_COMM_WORLD) != 0) {
+            fprintf(stderr, "Process %d: Failed to exchange component labels\n", world_rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        arena_destroy(&label_arena);
+    }
+    stage_end(&timer, STAGE_EXCHANGE, t);
+
+    // Every incoming run is already sorted, so a merge finishes the job
+    t = stage_begin();
+    const morton_key_t **runs = malloc(world_size * sizeof(morton_key_t *));
+    size_t *run_lens = malloc(world_size * sizeof(size_t));
+    for (int i = 0; i < world_size; ++i) {
+        runs[i] = received_codes + recv_displs[i];
+        run_lens[i] = recv_counts[i];
+    }
+    // Labels ride along with their codes
+    const morton_key_t **label_runs = malloc(world_size * sizeof(morton_key_t *));
+    for (int i = 0; received_labels && i < world_size; ++i) {
+        label_runs[i] = received_labels + recv_displs[i];
+    }
+    int merge_rc;
+    if (received_labels) {
+        merge_rc = pool ? lt_merge_arrays_payload_parallel(pool, runs, label_runs, run_lens, world_size, owned_codes,
+                                                           owned_labels)
+                        : lt_merge_arrays_payload(runs, label_runs, run_lens, world_size, owned_codes, owned_labels);
+    } else {
+        merge_rc = pool ? lt_merge_arrays_parallel(pool, runs, run_lens, world_size, owned_codes)
+                        : lt_merge_arrays(runs, run_lens, world_size, owned_codes);
+    }
+    if (merge_rc != 0) {
+        fprintf(stderr, "Process %d: Failed to merge received runs\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    free(runs);
+    free(label_runs);
+    free(run_lens);
+    arena_destroy(&received_arena);
+    if (received_labels) arena_destroy(&received_label_arena);
+    stage_end(&timer, STAGE_MERGE, t);
 
-    // Gather sorted morton_codes to root
-    MPI_Gatherv(morton_codes, code_count_int, MPI_UINT32_T, all_morton_codes, recv_counts, recv_displs, MPI_UINT32_T, 0, MPI_COMM_WORLD);
+    // End timing
+    MPI_Barrier(MPI_COMM_WORLD);
+    double end_time = MPI_Wtime();
 
-    // Root process merges the sorted arrays
-    if (world_rank == 0) {
-        int total_codes = 0;
-        for (int i = 0; i < world_size; ++i) {
-            total_codes += recv_counts[i];
+    // Root only collects per-rank counts, boundary keys and local checks
+    t = stage_begin();
+    rank_summary_t summary = {.count = owned_count, .sorted = 1};
+    for (size_t i = 1; i < owned_count; ++i) {
+        if (owned_codes[i - 1] > owned_codes[i]) {
+            summary.sorted = 0;
+            fprintf(stderr, "Process %d: Array is not sorted at index %zu\n", world_rank, i);
+            break;
         }
+    }
+    if (owned_count > 0) {
+        summary.first = owned_codes[0];
+        summary.last = owned_codes[owned_count - 1];
+    }
+    int head_count = owned_count < 10 ? (int)owned_count : 10;
+    for (int i = 0; i < head_count; ++i) {
+        summary.head[i] = owned_codes[i];
+    }
 
-        // Initialize positions and ends for k-way merge
-        int *positions = malloc(world_size * sizeof(int));
-        int *ends = malloc(world_size * sizeof(int));
+    rank_summary_t *summaries = NULL;
+    if (world_rank == 0) {
+        summaries = malloc(world_size * sizeof(rank_summary_t));
+    }
+    MPI_Gather(&summary, sizeof(rank_summary_t), MPI_BYTE, summaries, sizeof(rank_summary_t), MPI_BYTE, 0,
+               MPI_COMM_WORLD);
+
+    if (world_rank == 0) {
+        size_t total_codes = 0;
+        int is_sorted = 1;
+        int have_prev = 0;
+        morton_key_t prev_last = 0;
         for (int i = 0; i < world_size; ++i) {
-            positions[i] = recv_displs[i];
-            ends[i] = recv_displs[i] + recv_counts[i];
-        }
-
-        uint32_t *merged_codes = malloc(total_codes * sizeof(uint32_t));
-
-        // K-way merge
-        for (int k = 0; k < total_codes; ++k) {
-            uint32_t min_value = UINT32_MAX;
-            int min_index = -1;
-            for (int i = 0; i < world_size; ++i) {
-                if (positions[i] < ends[i]) {
-                    uint32_t value = all_morton_codes[positions[i]];
-                    if (value < min_value) {
-                        min_value = value;
-                        min_index = i;
-                    }
-                }
-            }
-            if (min_index == -1) {
-                fprintf(stderr, "Error during merging: no minimum found\n");
-                break;
+            total_codes += summaries[i].count;
+            is_sorted &= summaries[i].sorted;
+            if (summaries[i].count == 0) continue;
+            if (have_prev && prev_last > summaries[i].first) {
+                is_sorted = 0;
+                fprintf(stderr, "Ranges of processes overlap at process %d\n", i);
             }
-            merged_codes[k] = min_value;
-            positions[min_index]++;
+            prev_last = summaries[i].last;
+            have_prev = 1;
         }
 
-        // End timing
-        double end_time = MPI_Wtime();
-
-        printf("Number of active voxels: %d\n", total_codes);
+        printf("Number of active voxels: %zu\n", total_codes);
+        printf("Scan kernel: %s\n", kernel->name);
+        printf("Code buffers: %s\n", buffer_pages);
 
         // Output first 10 Morton codes
         printf("First 10 Morton codes:\n");
-        for (int i = 0; i < 10 && i < total_codes; ++i) {
-            printf("%u\n", merged_codes[i]);
-        }
-
-        // Verify if merged_codes[] is sorted
-        int is_sorted = 1;
-        for (int i = 1; i < total_codes; ++i) {
-            if (merged_codes[i - 1] > merged_codes[i]) {
-                is_sorted = 0;
-                fprintf(stderr, "Array is not sorted at index %d\n", i);
-                break;
+        int printed = 0;
+        for (int i = 0; i < world_size && printed < 10; ++i) {
+            for (size_t j = 0; j < summaries[i].count && j < 10 && printed < 10; ++j, ++printed) {
+                printf("%" PRImorton "\n", summaries[i].head[j]);
             }
         }
+
         if (is_sorted) {
             printf("Morton codes are correctly sorted.\n");
         } else {
             printf("Morton codes are NOT correctly sorted.\n");
         }
+        printf("Codes per process:");
+        for (int i = 0; i < world_size; ++i) {
+            printf(" %zu", summaries[i].count);
+        }
+        printf("\n");
+        free(summaries);
+    }
+    stage_end(&timer, STAGE_COMBINE, t);
 
-        // Save Morton codes to file
-        FILE *out_fp = fopen("morton_codes_mpi.txt", "w");
-        if (out_fp) {
-            for (int i = 0; i < total_codes; ++i) {
-                fprintf(out_fp, "%u\n", merged_codes[i]);
+    // Save Morton codes to file, every rank at its own offset
+    t = stage_begin();
+    char out_path[64];
+    snprintf(out_path, sizeof(out_path), "morton_codes_mpi.%s", code_format_extension(format));
+    code_file_header_t header = code_file_header(&cfg, grid.key_bits);
+    int write_ok = write_codes_collective(out_path, format, &header, owned_codes, owned_count, world_rank);
+    int all_write_ok = 0;
+    if (label_components) {
+        code_file_header_t label_header = header;
+        if (components_rc == 0) {
+            write_ok &= write_codes_collective("component_labels_mpi.txt", CODE_FORMAT_TEXT, &label_header,
+                                               owned_labels, owned_count, world_rank);
+        }
+        if (world_rank == 0 && components_rc == 0) {
+            size_t labelled = 0;
+            for (size_t k = 0; k < components.count; ++k) labelled += components.sizes[k];
+            components_print_summary(&components, labelled, stdout);
+            if (components_write_sizes("component_sizes_mpi.txt", &components) != 0) {
+                fprintf(stderr, "Error: Failed to write component_sizes_mpi.txt\n");
             }
-            fclose(out_fp);
-            printf("Morton codes saved to morton_codes_mpi.txt\n");
-        } else {
-            fprintf(stderr, "Error: Failed to open output file for writing.\n");
         }
+        arena_destroy(&owned_label_arena);
+        components_free(&components);
+    }
+    MPI_Reduce(&write_ok, &all_write_ok, 1, MPI_INT, MPI_LAND, 0, MPI_COMM_WORLD);
+    stage_end(&timer, STAGE_WRITE, t);
 
-        printf("Processing time with %d processes: %f seconds\n", world_size, end_time - start_time);
+    // Root reports every rank's stages; the top-level figure per stage is
+    // the slowest rank's, while counters add up over ranks
+    double *rank_seconds = NULL;
+    size_t *rank_counts = NULL;
+    uint64_t *rank_perf = NULL;
+    if (json_path && world_rank == 0) {
+        rank_seconds = malloc(world_size * STAGE_COUNT * sizeof(double));
+        rank_counts = malloc(world_size * sizeof(size_t));
+    }
+    if (perf && world_rank == 0) {
+        rank_perf = malloc((size_t)world_size * STAGE_COUNT * PERF_NUM_EVENTS * sizeof(uint64_t));
+    }
+    if (json_path) {
+        MPI_Gather(timer.seconds, STAGE_COUNT, MPI_DOUBLE, rank_seconds, STAGE_COUNT, MPI_DOUBLE, 0,
+                   MPI_COMM_WORLD);
+        MPI_Gather(&owned_count, 1, MPI_SIZE_T, rank_counts, 1, MPI_SIZE_T, 0, MPI_COMM_WORLD);
+    }
+    if (perf) {
+        uint64_t local_perf[STAGE_COUNT * PERF_NUM_EVENTS];
+        stage_perf_totals(&timer, local_perf);
+        MPI_Gather(local_perf, STAGE_COUNT * PERF_NUM_EVENTS, MPI_UINT64_T, rank_perf, STAGE_COUNT * PERF_NUM_EVENTS,
+                   MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    }
+    int rc = 0;
+    if (json_path && world_rank == 0) {
+        // In hybrid mode the per-thread section shows rank 0's team
+        stage_timer_t slowest;
+        stage_timer_init(&slowest);
+        slowest.pool = timer.pool;
+        slowest.worker_seconds = timer.worker_seconds;
+        slowest.perf_threads = timer.perf_threads;
+        slowest.perf_counts = timer.perf_counts;
+        size_t total_codes = 0;
+        for (int r = 0; r < world_size; ++r) {
+            total_codes += rank_counts[r];
+            for (int s = 0; s < STAGE_COUNT; ++s) {
+                double v = rank_seconds[r * STAGE_COUNT + s];
+                if (v > slowest.seconds[s]) slowest.seconds[s] = v;
+            }
+        }
+        if (stage_timer_write_json(json_path, &slowest, "mpi", world_size, &cfg, kernel->name, total_codes,
+                                   rank_seconds, rank_counts, world_size, rank_perf) != 0) {
+            rc = 1;
+        }
+        free(rank_seconds);
+        free(rank_counts);
+    }
+    stage_timer_free(&timer);
 
-        free(merged_codes);
-        free(positions);
-        free(ends);
-        free(all_morton_codes);
-        free(recv_counts);
-        free(recv_displs);
+    if (world_rank == 0) {
+        if (all_write_ok) {
+            printf("Morton codes saved to %s\n", out_path);
+        } else {
+            fprintf(stderr, "Error: Failed to write %s\n", out_path);
+        }
+        if (pool) {
+            printf("Processing time with %d processes x %d threads: %f seconds\n", world_size, num_threads,
+                   end_time - start_time);
+        } else {
+            printf("Processing time with %d processes: %f seconds\n", world_size, end_time - start_time);
+        }
+    }
+    if (perf && world_rank == 0) {
+        uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS] = {0};
+        for (int r = 0; r < world_size; ++r) {
+            for (int s = 0; s < STAGE_COUNT * PERF_NUM_EVENTS; s += PERF_NUM_EVENTS) {
+                perf_counts_add(totals + s, rank_perf + (size_t)r * STAGE_COUNT * PERF_NUM_EVENTS + s);
+            }
+        }
+        stage_print_perf(totals, stdout);
+        free(rank_perf);
     }
 
-    free(morton_codes);
-    free(local_data);
-    free(counts);
-    free(displs);
+    arena_destroy(&owned_arena);
+    free(send_counts);
+    free(send_displs);
+    free(recv_counts);
+    free(recv_displs);
+    if (pool) pool_destroy(pool);
 
     MPI_Finalize();
-    return 0;
+    return rc;
 }
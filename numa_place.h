@@ -0,0 +1,174 @@
+#ifndef NUMA_PLACE_H
+#define NUMA_PLACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "thread_pool.h"
+
+// NUMA placement without libnuma. The topology comes from
+// /sys/devices/system/node, workers are pinned with sched_setaffinity and
+// page placement is read back with move_pages, all through raw syscalls.
+// Memory is placed by first touch: whichever thread writes a page first
+// gets it on its own node, so pinned workers touching their own slabs keep
+// those slabs local. Without NUMA support everything is on node 0 and the
+// page statistics report themselves unavailable.
+
+#define NUMA_MAX_CPUS 1024
+#define NUMA_MAX_NODES 64
+#define NUMA_QUERY_BATCH 1024
+
+typedef struct {
+    int num_nodes;
+    int num_cpus;              // CPUs this process may run on
+    int cpus[NUMA_MAX_CPUS];   // those CPUs ordered by node, then by id
+    int nodes[NUMA_MAX_CPUS];  // node of each entry of cpus
+} numa_topology_t;
+
+typedef unsigned long numa_cpu_mask_t[NUMA_MAX_CPUS / (8 * sizeof(unsigned long))];
+
+#define NUMA_MASK_BITS (8 * sizeof(unsigned long))
+
+// Parses a sysfs cpulist such as "0-3,8-11" into node_of
+static inline void numa_parse_cpulist(const char *list, int node, int *node_of) {
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = first; c <= last && c < NUMA_MAX_CPUS; ++c) {
+            if (c >= 0) node_of[c] = node;
+        }
+        if (*p != ',') break;
+        ++p;
+    }
+}
+
+static inline void numa_topology_load(numa_topology_t *t) {
+    int node_of[NUMA_MAX_CPUS];
+    numa_cpu_mask_t allowed = {0};
+    t->num_nodes = 1;
+    t->num_cpus = 0;
+    for (int c = 0; c < NUMA_MAX_CPUS; ++c) node_of[c] = 0;
+
+    for (int n = 0; n < NUMA_MAX_NODES; ++n) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *fp = fopen(path, "r");
+        if (!fp) continue;
+        if (fgets(list, sizeof(list), fp)) {
+            numa_parse_cpulist(list, n, node_of);
+            if (n + 1 > t->num_nodes) t->num_nodes = n + 1;
+        }
+        fclose(fp);
+    }
+
+#ifdef __linux__
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0)
+#endif
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long c = 0; c < online && c < NUMA_MAX_CPUS; ++c) {
+            allowed[c / NUMA_MASK_BITS] |= 1ul << (c % NUMA_MASK_BITS);
+        }
+    }
+    for (int n = 0; n < t->num_nodes; ++n) {
+        for (int c = 0; c < NUMA_MAX_CPUS; ++c) {
+            if ((allowed[c / NUMA_MASK_BITS] >> (c % NUMA_MASK_BITS) & 1) && node_of[c] == n) {
+                t->cpus[t->num_cpus] = c;
+                t->nodes[t->num_cpus] = n;
+                t->num_cpus++;
+            }
+        }
+    }
+}
+
+// Pins worker i to the i-th allowed CPU in node order, so consecutive
+// workers, which own consecutive slabs, share a node. worker_cpu and
+// worker_node get one entry per worker, -1 where pinning failed. Returns
+// the number of workers pinned.
+static inline int numa_pin_pool(thread_pool_t *pool, const numa_topology_t *t, int *worker_cpu, int *worker_node) {
+    int pinned = 0;
+    for (int i = 0; i < pool->num_threads; ++i) {
+        worker_cpu[i] = worker_node[i] = -1;
+        if (t->num_cpus == 0) continue;
+        int slot = i % t->num_cpus;
+#ifdef __linux__
+        numa_cpu_mask_t mask = {0};
+        int cpu = t->cpus[slot];
+        mask[cpu / NUMA_MASK_BITS] |= 1ul << (cpu % NUMA_MASK_BITS);
+        if (syscall(SYS_sched_setaffinity, pool->workers[i].tid, sizeof(mask), mask) == 0) {
+            worker_cpu[i] = cpu;
+            worker_node[i] = t->nodes[slot];
+            pinned++;
+        }
+#endif
+    }
+    return pinned;
+}
+
+// Bytes of a buffer resident on each node, from one query per page
+typedef struct {
+    size_t bytes[NUMA_MAX_NODES];
+    size_t absent; // not faulted in yet
+    size_t total;
+} numa_page_stats_t;
+
+// Returns 0, or -1 when the kernel cannot report placement
+static inline int numa_page_stats(const void *addr, size_t len, numa_page_stats_t *st) {
+    *st = (numa_page_stats_t){0};
+#if defined(__linux__) && defined(SYS_move_pages)
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)addr & ~(uintptr_t)(page - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    void *pages[NUMA_QUERY_BATCH];
+    int status[NUMA_QUERY_BATCH];
+    for (uintptr_t p = begin; p < end;) {
+        unsigned long count = 0;
+        for (; count < NUMA_QUERY_BATCH && p < end; ++count, p += page) pages[count] = (void *)p;
+        // With nodes == NULL move_pages moves nothing and reports each
+        // page's node in status, or a negative errno if it is not mapped in
+        if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) < 0) {
+            return -1;
+        }
+        for (unsigned long k = 0; k < count; ++k) {
+            if (status[k] >= 0 && status[k] < NUMA_MAX_NODES) {
+                st->bytes[status[k]] += page;
+            } else {
+                st->absent += page;
+            }
+        }
+        st->total += count * page;
+    }
+    return 0;
+#else
+    (void)addr;
+    (void)len;
+    return -1;
+#endif
+}
+
+static inline void numa_print_stats(FILE *fp, const char *what, const numa_page_stats_t *st, int num_nodes) {
+    fprintf(fp, "%s pages by node:", what);
+    for (int n = 0; n < num_nodes; ++n) {
+        fprintf(fp, " node %d %.1f MiB (%.1f%%)%s", n, st->bytes[n] / 1048576.0,
+                st->total ? 100.0 * st->bytes[n] / st->total : 0.0, n + 1 < num_nodes ? "," : "");
+    }
+    if (st->absent) fprintf(fp, ", not present %.1f MiB", st->absent / 1048576.0);
+    fprintf(fp, "\n");
+}
+
+#endif // NUMA_PLACE_H
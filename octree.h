@@ -0,0 +1,359 @@
+#ifndef OCTREE_H
+#define OCTREE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "code_file.h"
+#include "morton.h"
+#include "thread_pool.h"
+#include "volume_config.h"
+
+// Complete linear octree of the active voxels, built bottom-up from the
+// sorted code stream. A node at level L stands for the 8^L voxels whose
+// codes share the prefix key = code >> 3L; level 0 nodes are single voxels.
+// Whenever all 8 children of a parent (key >> 3) are present they collapse
+// into the parent, so the tree keeps only maximal fully active blocks, and
+// the voxels are exactly the union of the nodes.
+//
+// The builder is streaming: codes are pushed in increasing order and every
+// level keeps only the sibling group it is filling, so the tree is built in
+// the same pass that writes the codes. A group is complete as soon as a key
+// with another parent arrives; a full group becomes one key pushed a level
+// up, any other group is kept as nodes of its level.
+//
+// Nodes are stored level by level, each level sorted, with level_offsets
+// marking where each level starts. File layout, little endian:
+//
+//   header   64 bytes: magic "MORTONOT", version, significant key bits,
+//            level count, the volume dimensions, threshold, voxel count and
+//            node count
+//   offsets  (levels + 1) 64-bit node indices, where each level starts
+//   nodes    one key per node, 4 bytes when keys fit 32 bits, else 8
+
+#define OCTREE_MAGIC "MORTONOT"
+#define OCTREE_VERSION 1
+#define OCTREE_HEADER_BYTES 64
+#define OCTREE_MAX_LEVELS (MORTON_COORD_BITS + 1)
+// The parallel build splits the codes only between nodes of this level, so
+// every sibling group below it lies in one part; the few full nodes that
+// reach it are finished serially
+#define OCTREE_SPLIT_LEVEL 4
+#define OCTREE_PARTS_PER_THREAD 4
+
+typedef struct {
+    int num_levels; // levels 0 .. num_levels - 1; the last one is the root
+    size_t level_offsets[OCTREE_MAX_LEVELS + 1];
+    size_t num_voxels;
+    size_t num_nodes;
+    morton_key_t *nodes;
+} octree_t;
+
+typedef struct {
+    morton_key_t parent;
+    int count;
+    morton_key_t keys[8];
+} octree_group_t;
+
+typedef struct {
+    int first_level; // level of the pushed keys
+    int stop_level;  // keys reaching this level are kept, not grouped
+    octree_group_t group[OCTREE_MAX_LEVELS];
+    morton_key_t *level_nodes[OCTREE_MAX_LEVELS];
+    size_t level_count[OCTREE_MAX_LEVELS];
+    size_t level_cap[OCTREE_MAX_LEVELS];
+    size_t pushed;
+    int failed;
+} octree_builder_t;
+
+// Levels of a volume with keys of key_bits bits; the top one has one node
+static inline int octree_num_levels(int key_bits) {
+    return key_bits / 3 + 1;
+}
+
+static inline void octree_builder_init(octree_builder_t *b, int first_level, int stop_level) {
+    memset(b, 0, sizeof(*b));
+    b->first_level = first_level;
+    b->stop_level = stop_level;
+}
+
+static inline void octree_keep(octree_builder_t *b, int level, const morton_key_t *keys, size_t n) {
+    if (b->level_count[level] + n > b->level_cap[level]) {
+        size_t cap = b->level_cap[level] ? 2 * b->level_cap[level] : 1024;
+        while (cap < b->level_count[level] + n) cap *= 2;
+        morton_key_t *grown = realloc(b->level_nodes[level], cap * sizeof(morton_key_t));
+        if (!grown) {
+            b->failed = 1;
+            return;
+        }
+        b->level_nodes[level] = grown;
+        b->level_cap[level] = cap;
+    }
+    memcpy(b->level_nodes[level] + b->level_count[level], keys, n * sizeof(morton_key_t));
+    b->level_count[level] += n;
+}
+
+static inline void octree_push_level(octree_builder_t *b, int level, morton_key_t key);
+
+// Completes the pending group of a level: a full one moves up as its parent
+static inline void octree_flush_level(octree_builder_t *b, int level) {
+    octree_group_t *g = &b->group[level];
+    if (g->count == 8) {
+        octree_push_level(b, level + 1, g->parent);
+    } else if (g->count > 0) {
+        octree_keep(b, level, g->keys, (size_t)g->count);
+    }
+    g->count = 0;
+}
+
+static inline void octree_push_level(octree_builder_t *b, int level, morton_key_t key) {
+    if (level == b->stop_level) {
+        octree_keep(b, level, &key, 1);
+        return;
+    }
+    octree_group_t *g = &b->group[level];
+    if (g->count > 0 && key >> 3 != g->parent) {
+        octree_flush_level(b, level);
+    }
+    if (g->count == 0) {
+        g->parent = key >> 3;
+    }
+    g->keys[g->count++] = key;
+}
+
+// Pushes keys of the builder's first level, strictly increasing across calls
+static inline void octree_push(octree_builder_t *b, const morton_key_t *keys, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        octree_push_level(b, b->first_level, keys[i]);
+    }
+    b->pushed += n;
+}
+
+// Flushes every pending group, lowest level first so full groups still
+// reach their parents. Returns 0, or -1 if an allocation failed.
+static inline int octree_builder_finish(octree_builder_t *b) {
+    for (int level = b->first_level; level < b->stop_level; ++level) {
+        octree_flush_level(b, level);
+    }
+    return b->failed ? -1 : 0;
+}
+
+static inline void octree_builder_free(octree_builder_t *b) {
+    for (int level = 0; level < OCTREE_MAX_LEVELS; ++level) {
+        free(b->level_nodes[level]);
+    }
+}
+
+static inline void octree_free(octree_t *tree) {
+    free(tree->nodes);
+    tree->nodes = NULL;
+}
+
+// Moves the nodes of a finished single-part builder into a tree
+static inline int octree_from_builder(octree_t *tree, const octree_builder_t *b, int num_levels) {
+    memset(tree, 0, sizeof(*tree));
+    tree->num_levels = num_levels;
+    tree->num_voxels = b->pushed;
+    for (int level = 0; level < num_levels; ++level) {
+        tree->level_offsets[level] = tree->num_nodes;
+        tree->num_nodes += b->level_count[level];
+    }
+    tree->level_offsets[num_levels] = tree->num_nodes;
+    tree->nodes = malloc((tree->num_nodes > 0 ? tree->num_nodes : 1) * sizeof(morton_key_t));
+    if (!tree->nodes) {
+        return -1;
+    }
+    for (int level = 0; level < num_levels; ++level) {
+        memcpy(tree->nodes + tree->level_offsets[level], b->level_nodes[level],
+               b->level_count[level] * sizeof(morton_key_t));
+    }
+    return 0;
+}
+
+// The parallel build: the codes are cut into parts at boundaries between
+// level OCTREE_SPLIT_LEVEL nodes, every part is built on its own up to that
+// level, and the full nodes the parts hand up are pushed, in part order,
+// into one builder for the levels above.
+typedef struct {
+    const morton_key_t *codes;
+    size_t *part_offsets; // num_parts + 1 entries
+    octree_builder_t *parts;
+    int split_level;
+    octree_t *tree;
+    size_t *part_node_offsets; // num_parts x split_level, where each part's level starts
+} octree_ctx_t;
+
+static inline void octree_build_task(void *arg, size_t part, int worker) {
+    octree_ctx_t *ctx = (octree_ctx_t *)arg;
+    octree_builder_t *b = &ctx->parts[part];
+    (void)worker;
+
+    octree_builder_init(b, 0, ctx->split_level);
+    octree_push(b, ctx->codes + ctx->part_offsets[part], ctx->part_offsets[part + 1] - ctx->part_offsets[part]);
+    octree_builder_finish(b);
+}
+
+static inline void octree_copy_task(void *arg, size_t part, int worker) {
+    octree_ctx_t *ctx = (octree_ctx_t *)arg;
+    const octree_builder_t *b = &ctx->parts[part];
+    (void)worker;
+
+    for (int level = 0; level < ctx->split_level; ++level) {
+        memcpy(ctx->tree->nodes + ctx->part_node_offsets[part * ctx->split_level + level], b->level_nodes[level],
+               b->level_count[level] * sizeof(morton_key_t));
+    }
+}
+
+// Builds the octree of codes[0..n), sorted and unique, over the pool's
+// threads, or on the calling thread without a pool. Returns 0, or -1 if an
+// allocation failed.
+static inline int octree_build(thread_pool_t *pool, const morton_key_t *codes, size_t n, int key_bits,
+                               octree_t *tree) {
+    int num_levels = octree_num_levels(key_bits);
+    int split_level = OCTREE_SPLIT_LEVEL;
+    size_t num_parts = pool ? (size_t)pool->num_threads * OCTREE_PARTS_PER_THREAD : 1;
+    if (split_level >= num_levels - 1 || n < num_parts * 8) {
+        num_parts = 1;
+    }
+    if (num_parts == 1) {
+        octree_builder_t b;
+        octree_builder_init(&b, 0, num_levels - 1);
+        octree_push(&b, codes, n);
+        int rc = octree_builder_finish(&b) == 0 ? octree_from_builder(tree, &b, num_levels) : -1;
+        octree_builder_free(&b);
+        return rc;
+    }
+
+    octree_ctx_t ctx = {.codes = codes, .split_level = split_level, .tree = tree};
+    ctx.part_offsets = malloc((num_parts + 1) * sizeof(size_t));
+    ctx.parts = malloc(num_parts * sizeof(octree_builder_t));
+    ctx.part_node_offsets = malloc(num_parts * split_level * sizeof(size_t));
+    octree_builder_t *top = malloc(sizeof(octree_builder_t));
+    if (!ctx.part_offsets || !ctx.parts || !ctx.part_node_offsets || !top) {
+        free(ctx.part_offsets);
+        free(ctx.parts);
+        free(ctx.part_node_offsets);
+        free(top);
+        return -1;
+    }
+
+    // Equal slices, each start moved forward to the next split-level node
+    int shift = 3 * split_level;
+    ctx.part_offsets[0] = 0;
+    for (size_t p = 1; p < num_parts; ++p) {
+        size_t i = n * p / num_parts;
+        if (i < ctx.part_offsets[p - 1]) i = ctx.part_offsets[p - 1];
+        while (i > 0 && i < n && codes[i] >> shift == codes[i - 1] >> shift) ++i;
+        ctx.part_offsets[p] = i;
+    }
+    ctx.part_offsets[num_parts] = n;
+    pool_run(pool, num_parts, octree_build_task, &ctx);
+
+    int rc = 0;
+    octree_builder_init(top, split_level, num_levels - 1);
+    for (size_t p = 0; p < num_parts; ++p) {
+        rc |= ctx.parts[p].failed;
+        octree_push(top, ctx.parts[p].level_nodes[split_level], ctx.parts[p].level_count[split_level]);
+    }
+    if (rc != 0 || octree_builder_finish(top) != 0) {
+        rc = -1;
+    } else {
+        memset(tree, 0, sizeof(*tree));
+        tree->num_levels = num_levels;
+        tree->num_voxels = n;
+        for (int level = 0; level < num_levels; ++level) {
+            tree->level_offsets[level] = tree->num_nodes;
+            if (level < split_level) {
+                for (size_t p = 0; p < num_parts; ++p) {
+                    ctx.part_node_offsets[p * split_level + level] = tree->num_nodes;
+                    tree->num_nodes += ctx.parts[p].level_count[level];
+                }
+            } else {
+                tree->num_nodes += top->level_count[level];
+            }
+        }
+        tree->level_offsets[num_levels] = tree->num_nodes;
+        tree->nodes = malloc((tree->num_nodes > 0 ? tree->num_nodes : 1) * sizeof(morton_key_t));
+        if (!tree->nodes) {
+            rc = -1;
+        } else {
+            pool_run(pool, num_parts, octree_copy_task, &ctx);
+            for (int level = split_level; level < num_levels; ++level) {
+                memcpy(tree->nodes + tree->level_offsets[level], top->level_nodes[level],
+                       top->level_count[level] * sizeof(morton_key_t));
+            }
+        }
+    }
+
+    for (size_t p = 0; p < num_parts; ++p) {
+        octree_builder_free(&ctx.parts[p]);
+    }
+    octree_builder_free(top);
+    free(top);
+    free(ctx.part_offsets);
+    free(ctx.parts);
+    free(ctx.part_node_offsets);
+    return rc;
+}
+
+static inline void octree_print_summary(const octree_t *tree, FILE *fp) {
+    fprintf(fp, "Octree: %zu nodes for %zu voxels (%.2fx smaller)\n", tree->num_nodes, tree->num_voxels,
+            tree->num_nodes ? (double)tree->num_voxels / tree->num_nodes : 0.0);
+    fprintf(fp, "  Nodes per level:");
+    for (int level = 0; level < tree->num_levels; ++level) {
+        size_t count = tree->level_offsets[level + 1] - tree->level_offsets[level];
+        if (count > 0) fprintf(fp, " L%d %zu", level, count);
+    }
+    fprintf(fp, "\n");
+}
+
+static inline int octree_write(const char *path, const octree_t *tree, const volume_config_t *cfg, int key_bits) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return -1;
+    }
+    uint8_t header[OCTREE_HEADER_BYTES] = {0};
+    memcpy(header, OCTREE_MAGIC, 8);
+    code_put_u32(header + 8, OCTREE_VERSION);
+    code_put_u32(header + 12, (uint32_t)key_bits);
+    code_put_u32(header + 16, (uint32_t)tree->num_levels);
+    code_put_u32(header + 20, cfg->x_size);
+    code_put_u32(header + 24, cfg->y_size);
+    code_put_u32(header + 28, cfg->z_size);
+    code_put_u32(header + 32, cfg->threshold);
+    code_put_u64(header + 40, tree->num_voxels);
+    code_put_u64(header + 48, tree->num_nodes);
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+    for (int level = 0; level <= tree->num_levels && ok; ++level) {
+        uint8_t offset[8];
+        code_put_u64(offset, tree->level_offsets[level]);
+        ok = fwrite(offset, 1, sizeof(offset), fp) == sizeof(offset);
+    }
+
+    size_t key_bytes = key_bits <= 32 ? 4 : 8;
+    uint8_t *buf = malloc(CODE_WRITE_BUFFER);
+    size_t used = 0;
+    if (!buf) ok = 0;
+    for (size_t i = 0; i < tree->num_nodes && ok; ++i) {
+        if (key_bytes == 4) {
+            code_put_u32(buf + used, (uint32_t)tree->nodes[i]);
+        } else {
+            code_put_u64(buf + used, (uint64_t)tree->nodes[i]);
+        }
+        used += key_bytes;
+        if (used + key_bytes > CODE_WRITE_BUFFER) {
+            ok = fwrite(buf, 1, used, fp) == used;
+            used = 0;
+        }
+    }
+    if (ok && used > 0) {
+        ok = fwrite(buf, 1, used, fp) == used;
+    }
+    free(buf);
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+#endif // OCTREE_H
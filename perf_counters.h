@@ -0,0 +1,158 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+// Hardware performance counters for one thread through perf_event_open.
+// Each event is opened on its own rather than as a group, so a CPU or VM
+// that lacks one of them still reports the rest; when the kernel has to
+// multiplex, counts are scaled by time enabled over time running. Only
+// user-space events are counted, which works at perf_event_paranoid <= 2.
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NUM_EVENTS
+};
+
+static const char *const perf_event_names[PERF_NUM_EVENTS] = {"cycles", "instructions", "llc_misses",
+                                                               "branch_misses", "dtlb_misses"};
+
+// Reported for an event that could not be opened
+#define PERF_COUNT_NONE UINT64_MAX
+
+typedef struct {
+    int fd[PERF_NUM_EVENTS];
+} perf_thread_t;
+
+static inline pid_t perf_gettid(void) {
+#ifdef __linux__
+    return (pid_t)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+// Opens the counters of thread tid (0 for the calling thread). Returns the
+// number of events that could be opened.
+static inline int perf_thread_open(perf_thread_t *pt, pid_t tid) {
+    int opened = 0;
+    for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+        pt->fd[e] = -1;
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (e) {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PERF_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        }
+        pt->fd[e] = (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+#endif
+        if (pt->fd[e] >= 0) opened++;
+    }
+    return opened;
+}
+
+// Cumulative counts since perf_thread_open, PERF_COUNT_NONE for events
+// that are not available
+static inline void perf_thread_read(const perf_thread_t *pt, uint64_t counts[PERF_NUM_EVENTS]) {
+    for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+        uint64_t v[3]; // value, time enabled, time running
+        if (pt->fd[e] < 0 || read(pt->fd[e], v, sizeof(v)) != (ssize_t)sizeof(v)) {
+            counts[e] = PERF_COUNT_NONE;
+        } else if (v[2] == 0) {
+            counts[e] = 0;
+        } else if (v[2] < v[1]) {
+            counts[e] = (uint64_t)((double)v[0] * v[1] / v[2]);
+        } else {
+            counts[e] = v[0];
+        }
+    }
+}
+
+static inline void perf_thread_close(perf_thread_t *pt) {
+    for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+        if (pt->fd[e] >= 0) close(pt->fd[e]);
+        pt->fd[e] = -1;
+    }
+}
+
+static inline void perf_json_counts(FILE *fp, const uint64_t counts[PERF_NUM_EVENTS]) {
+    fprintf(fp, "{");
+    for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+        fprintf(fp, "%s\"%s\": ", e ? ", " : "", perf_event_names[e]);
+        if (counts[e] == PERF_COUNT_NONE) {
+            fprintf(fp, "null");
+        } else {
+            fprintf(fp, "%llu", (unsigned long long)counts[e]);
+        }
+    }
+    fprintf(fp, "}");
+}
+
+// Adds b to a, keeping PERF_COUNT_NONE if either side lacks the event
+static inline void perf_counts_add(uint64_t a[PERF_NUM_EVENTS], const uint64_t b[PERF_NUM_EVENTS]) {
+    for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+        a[e] = (a[e] == PERF_COUNT_NONE || b[e] == PERF_COUNT_NONE) ? PERF_COUNT_NONE : a[e] + b[e];
+    }
+}
+
+// One line per stage with the ratios that separate branch-bound from
+// memory-bound code: IPC and misses per thousand instructions
+static inline void perf_print_stage(FILE *fp, const char *stage, const uint64_t c[PERF_NUM_EVENTS]) {
+    fprintf(fp, "  %-9s", stage);
+    if (c[PERF_CYCLES] != PERF_COUNT_NONE && c[PERF_INSTRUCTIONS] != PERF_COUNT_NONE && c[PERF_CYCLES] > 0) {
+        fprintf(fp, " IPC %5.2f", (double)c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+    } else {
+        fprintf(fp, " IPC    - ");
+    }
+    static const int per_kilo[] = {PERF_BRANCH_MISSES, PERF_LLC_MISSES, PERF_DTLB_MISSES};
+    static const char *const labels[] = {"branch-MPKI", "LLC-MPKI", "dTLB-MPKI"};
+    for (int k = 0; k < 3; ++k) {
+        uint64_t n = c[per_kilo[k]];
+        if (n != PERF_COUNT_NONE && c[PERF_INSTRUCTIONS] != PERF_COUNT_NONE && c[PERF_INSTRUCTIONS] > 0) {
+            fprintf(fp, "  %s %7.3f", labels[k], 1000.0 * n / c[PERF_INSTRUCTIONS]);
+        } else {
+            fprintf(fp, "  %s       -", labels[k]);
+        }
+    }
+    fprintf(fp, "\n");
+}
+
+#endif // PERF_COUNTERS_H
@@ -1,167 +1,813 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 #include <time.h>
 
-#define X_SIZE 1024
-#define Y_SIZE 1024
-#define Z_SIZE 314
-#define TOTAL_VOXELS ((size_t)X_SIZE * Y_SIZE * Z_SIZE)
-#define THRESHOLD 25
-#define BITS_PER_COORD 10
+#include "arena.h"
+#include "code_file.h"
+#include "components.h"
+#include "loser_tree.h"
+#include "morton.h"
+#include "numa_place.h"
+#include "octree.h"
+#include "radix_sort.h"
+#include "stage_timer.h"
+#include "volume_config.h"
+#include "volume_loader.h"
 
+// Extraction runs in two passes over the chunks: every chunk counts its
+// active voxels, the counts are prefix-summed in chunk order into output
+// offsets, and every chunk then writes its codes straight into one exactly
+// sized array. Offsets are tagged by chunk, not by thread, so the output is
+// the same whichever worker ran a chunk. A chunk is one z-slab. The count
+// pass runs block by block while the loader is still reading, so its task
+// ids are relative to chunk_base.
 typedef struct {
-    int thread_id;
-    size_t start_idx;
-    size_t end_idx;
-    uint8_t *data;
-    uint32_t *morton_codes;
-    size_t *code_count;
-} thread_data_t;
-
-int compare_uint32(const void *a, const void *b) {
-    uint32_t arg1 = *(const uint32_t *)a;
-    uint32_t arg2 = *(const uint32_t *)b;
-    return (arg1 > arg2) - (arg1 < arg2);
+    const uint8_t *data;
+    size_t total_voxels;
+    size_t chunk_voxels;
+    uint8_t threshold;
+    size_t num_chunks;
+    size_t chunk_base;
+    size_t *chunk_counts;
+    size_t *chunk_offsets;
+    morton_key_t *morton_codes;
+    const morton_kernel_t *kernel;
+    const morton_grid_t *grid;
+} extract_ctx_t;
+
+void chunk_range(const extract_ctx_t *ctx, size_t chunk, size_t *start, size_t *end) {
+    *start = chunk * ctx->chunk_voxels;
+    *end = *start + ctx->chunk_voxels < ctx->total_voxels ? *start + ctx->chunk_voxels : ctx->total_voxels;
+}
+
+void count_task(void *arg, size_t chunk, int worker) {
+    extract_ctx_t *ctx = (extract_ctx_t *)arg;
+    size_t start, end;
+    (void)worker;
+
+    chunk += ctx->chunk_base;
+    chunk_range(ctx, chunk, &start, &end);
+    ctx->chunk_counts[chunk] = ctx->kernel->count(ctx->data + start, end - start, ctx->threshold);
+}
+
+void fill_task(void *arg, size_t chunk, int worker) {
+    extract_ctx_t *ctx = (extract_ctx_t *)arg;
+    size_t start, end;
+    (void)worker;
+
+    chunk_range(ctx, chunk, &start, &end);
+    ctx->kernel->scan(ctx->grid, ctx->data + start, end - start, start, ctx->threshold,
+                      ctx->morton_codes + ctx->chunk_offsets[chunk]);
+}
+
+// With --numa every pinned worker reads its own block of slabs, the block
+// pool_run_owned later hands it for counting and extraction, so the volume
+// pages land on the node that scans them
+typedef struct {
+    int fd;
+    const extract_ctx_t *extract;
+    int num_threads;
+    int *failed; // one flag per worker
+} numa_load_ctx_t;
+
+void numa_load_task(void *arg, size_t task, int worker) {
+    numa_load_ctx_t *ctx = (numa_load_ctx_t *)arg;
+    size_t first, last, start, end, unused;
+
+    pool_block(ctx->extract->num_chunks, ctx->num_threads, (int)task, &first, &last);
+    if (first == last) {
+        return;
+    }
+    chunk_range(ctx->extract, first, &start, &unused);
+    chunk_range(ctx->extract, last - 1, &unused, &end);
+    uint8_t *dest = (uint8_t *)ctx->extract->data + start;
+    ctx->failed[worker] = loader_pread(ctx->fd, dest, end - start, (off_t)start) != 0;
+}
+
+// Share of [addr, addr + len) on node, or -1 if placement is unknown
+double numa_local_share(const void *addr, size_t len, int node) {
+    numa_page_stats_t st;
+    if (node < 0 || numa_page_stats(addr, len, &st) != 0 || st.total == 0) {
+        return -1.0;
+    }
+    return (double)st.bytes[node] / st.total;
 }
 
-uint32_t expand_bits(uint32_t x) {
-    x &= 0x3FF;
-    x = (x | (x << 16)) & 0x30000FF;
-    x = (x | (x << 8)) & 0x300F00F;
-    x = (x | (x << 4)) & 0x30C30C3;
-    x = (x | (x << 2)) & 0x9249249;
-    return x;
+// The extracted codes are cut into equal slices, each slice is sorted as its
+// own run, and the runs are merged with a loser tree
+typedef struct {
+    morton_key_t *codes;
+    morton_key_t *tmp;
+    size_t *run_offsets; // num_runs + 1 entries
+    int key_bits;
+} run_sort_ctx_t;
+
+void sort_run_task(void *arg, size_t run, int worker) {
+    run_sort_ctx_t *ctx = (run_sort_ctx_t *)arg;
+    size_t offset = ctx->run_offsets[run];
+    (void)worker;
+
+    radix_sort_keys(ctx->codes + offset, ctx->tmp + offset, ctx->run_offsets[run + 1] - offset, ctx->key_bits);
 }
 
-uint32_t morton_encode(uint32_t x, uint32_t y, uint32_t z) {
-    return expand_bits(x) | (expand_bits(y) << 1) | (expand_bits(z) << 2);
+// --sweep reads and scans the volume once for a whole list of thresholds.
+// Every voxel above the lowest threshold goes to the band of its value:
+// band b holds the values in (thresholds[b], thresholds[b + 1]] and the
+// last band everything above the highest threshold. The codes active at
+// thresholds[b] are then bands b and up merged, so every band is counted,
+// extracted and sorted once, however many thresholds share it. The bands
+// lie one after another, so going down from the top band, merging band b
+// into the already merged bands above it yields threshold b's codes in
+// place.
+#define MAX_SWEEP 256
+
+typedef struct {
+    const uint8_t *data;
+    size_t total_voxels;
+    size_t chunk_voxels;
+    size_t chunk_base;
+    const morton_grid_t *grid;
+    int num_bands;
+    int band_of[256];     // band of every voxel value, -1 below all thresholds
+    size_t *band_counts;  // num_chunks x num_bands
+    size_t *band_offsets; // num_chunks x num_bands, each chunk's slot in every band
+    morton_key_t **bands;
+} sweep_ctx_t;
+
+void band_count_task(void *arg, size_t chunk, int worker) {
+    sweep_ctx_t *ctx = (sweep_ctx_t *)arg;
+    size_t hist[256] = {0};
+    (void)worker;
+
+    chunk += ctx->chunk_base;
+    size_t start = chunk * ctx->chunk_voxels;
+    size_t end = start + ctx->chunk_voxels < ctx->total_voxels ? start + ctx->chunk_voxels : ctx->total_voxels;
+    for (size_t i = start; i < end; ++i) {
+        hist[ctx->data[i]]++;
+    }
+    size_t *counts = ctx->band_counts + chunk * ctx->num_bands;
+    memset(counts, 0, ctx->num_bands * sizeof(size_t));
+    for (int v = 0; v < 256; ++v) {
+        if (ctx->band_of[v] >= 0) counts[ctx->band_of[v]] += hist[v];
+    }
 }
 
-void *thread_function(void *arg) {
-    thread_data_t *thread_data = (thread_data_t *)arg;
-    uint8_t *data = thread_data->data;
-    size_t start = thread_data->start_idx;
-    size_t end = thread_data->end_idx;
+void band_fill_task(void *arg, size_t chunk, int worker) {
+    sweep_ctx_t *ctx = (sweep_ctx_t *)arg;
+    size_t pos[MAX_SWEEP];
+    (void)worker;
 
-    size_t code_count = 0;
+    size_t start = chunk * ctx->chunk_voxels;
+    size_t end = start + ctx->chunk_voxels < ctx->total_voxels ? start + ctx->chunk_voxels : ctx->total_voxels;
+    memcpy(pos, ctx->band_offsets + chunk * ctx->num_bands, ctx->num_bands * sizeof(size_t));
+    uint32_t nx = ctx->grid->x_size, ny = ctx->grid->y_size;
+    uint32_t x = (uint32_t)(start % nx), y = (uint32_t)(start / nx % ny), z = (uint32_t)(start / ((size_t)nx * ny));
     for (size_t i = start; i < end; ++i) {
-        if (data[i] > THRESHOLD) {
-            size_t idx = i;
-            uint32_t x = idx % X_SIZE;
-            idx /= X_SIZE;
-            uint32_t y = idx % Y_SIZE;
-            uint32_t z = idx / Y_SIZE;
-            thread_data->morton_codes[code_count++] = morton_encode(x, y, z);
+        int b = ctx->band_of[ctx->data[i]];
+        if (b >= 0) {
+            ctx->bands[b][pos[b]++] = morton_encode(x, y, z);
+        }
+        if (++x == nx) {
+            x = 0;
+            if (++y == ny) {
+                y = 0;
+                ++z;
+            }
+        }
+    }
+}
+
+// Merges a[0..na) with b[0..nb) into out. out may start na entries before
+// b: the write position then never passes the next unread entry of b.
+void merge_band(const morton_key_t *a, size_t na, const morton_key_t *b, size_t nb, morton_key_t *out) {
+    size_t i = 0, j = 0, k = 0;
+    while (i < na && j < nb) {
+        out[k++] = b[j] < a[i] ? b[j++] : a[i++];
+    }
+    while (i < na) out[k++] = a[i++];
+    if (out + k != b + j) {
+        memmove(out + k, b + j, (nb - j) * sizeof(morton_key_t));
+    }
+}
+
+// Parses a comma-separated threshold list into sorted, distinct values
+int parse_thresholds(const char *list, uint32_t *out, int *count) {
+    char buf[4 * MAX_SWEEP];
+    if (strlen(list) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, list);
+    int n = 0;
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        uint32_t t;
+        if (volume_parse_u32(tok, UINT8_MAX, &t) != 0) {
+            return -1;
+        }
+        int k = n;
+        while (k > 0 && out[k - 1] > t) k--;
+        if (k > 0 && out[k - 1] == t) continue;
+        memmove(out + k + 1, out + k, (n - k) * sizeof(uint32_t));
+        out[k] = t;
+        n++;
+    }
+    *count = n;
+    return n > 0 ? 0 : -1;
+}
+
+// Runs the sweep on a loaded pool and frees the volume once it is scanned.
+// Writes morton_codes_pthread_t<T> for every threshold and the counts to
+// threshold_counts_pthread.txt. Returns 0, or 1 on an error; the counts
+// are only reported once every band has been scanned and merged.
+int run_sweep(thread_pool_t *pool, const volume_config_t *cfg, arena_t *data_arena, const uint32_t *thresholds,
+              int num_thresholds, code_format_t format, stage_timer_t *timer, size_t *total_active) {
+    size_t total_voxels = volume_total_voxels(cfg);
+    morton_grid_t grid = morton_grid(cfg->x_size, cfg->y_size, cfg->z_size);
+    size_t chunk_voxels = volume_slab_voxels(cfg);
+    size_t num_chunks = (total_voxels + chunk_voxels - 1) / chunk_voxels;
+    int nb = num_thresholds;
+    sweep_ctx_t ctx = {.data = data_arena->base,
+                       .total_voxels = total_voxels,
+                       .chunk_voxels = chunk_voxels,
+                       .grid = &grid,
+                       .num_bands = nb,
+                       .band_counts = malloc(num_chunks * nb * sizeof(size_t)),
+                       .band_offsets = malloc(num_chunks * nb * sizeof(size_t)),
+                       .bands = malloc(nb * sizeof(morton_key_t *))};
+    size_t *band_lens = calloc(nb, sizeof(size_t));
+    size_t *counts = calloc(nb, sizeof(size_t));
+    arena_t code_arena = {0};
+    int rc = 0;
+    if (!ctx.band_counts || !ctx.band_offsets || !ctx.bands || !band_lens || !counts) {
+        fprintf(stderr, "Error: Failed to allocate sweep tables\n");
+        rc = 1;
+    }
+    for (int v = 0, b = -1; v < 256; ++v) {
+        while (b + 1 < nb && (uint32_t)v > thresholds[b + 1]) b++;
+        ctx.band_of[v] = b;
+    }
+
+    // Load and count every block's slabs per band as it lands
+    volume_loader_t loader;
+    if (rc == 0 && loader_open(&loader, cfg->path, 0, total_voxels, loader_slab_block_bytes(chunk_voxels), 1,
+                               data_arena->base) != 0) {
+        rc = 1;
+    } else if (rc == 0) {
+        const uint8_t *block;
+        size_t block_start, block_len;
+        int load_rc;
+        double t = stage_begin();
+        while ((load_rc = loader_next(&loader, &block, &block_start, &block_len)) == 1) {
+            ctx.chunk_base = block_start / chunk_voxels;
+            pool_run(pool, (block_len + chunk_voxels - 1) / chunk_voxels, band_count_task, &ctx);
+        }
+        stage_add(timer, STAGE_LOAD, loader.wait_time);
+        stage_end(timer, STAGE_SCAN, t + loader.wait_time);
+        if (loader_close(&loader) != 0 || load_rc < 0) {
+            fprintf(stderr, "Error: Failed to read data from %s\n", cfg->path);
+            rc = 1;
+        }
+    }
+
+    // Bands lie one after another in a single buffer; a second one of the
+    // same size is the sort scratch and then the merge output
+    double t = stage_begin();
+    size_t total = 0;
+    for (int b = 0; rc == 0 && b < nb; ++b) {
+        for (size_t c = 0; c < num_chunks; ++c) {
+            ctx.band_offsets[c * nb + b] = band_lens[b];
+            band_lens[b] += ctx.band_counts[c * nb + b];
         }
+        total += band_lens[b];
     }
-    *thread_data->code_count = code_count;
-    pthread_exit(NULL);
+    size_t code_bytes = total * sizeof(morton_key_t);
+    size_t code_sizes[2] = {code_bytes, code_bytes};
+    if (rc == 0 && arena_init(&code_arena, arena_size(code_sizes, 2), ARENA_HUGETLB) != 0) {
+        fprintf(stderr, "Error: Failed to allocate Morton codes array\n");
+        rc = 1;
+    }
+    if (rc == 0) {
+        morton_key_t *codes = arena_alloc(&code_arena, code_bytes);
+        morton_key_t *scratch = arena_alloc(&code_arena, code_bytes);
+        for (int b = 0; b < nb; ++b) {
+            ctx.bands[b] = b == 0 ? codes : ctx.bands[b - 1] + band_lens[b - 1];
+        }
+        stage_end(timer, STAGE_COMBINE, t);
+
+        t = stage_begin();
+        pool_run(pool, num_chunks, band_fill_task, &ctx);
+        stage_end(timer, STAGE_SCAN, t);
+        arena_destroy(data_arena);
+
+        t = stage_begin();
+        for (int b = 0; b < nb; ++b) {
+            radix_sort_keys_pool(pool, ctx.bands[b], scratch, band_lens[b], grid.key_bits);
+        }
+        stage_end(timer, STAGE_SORT, t);
+
+        // Threshold b is bands b..nb-1: merging band b, copied out to the
+        // scratch buffer, with the merged bands above it, in place. A failed
+        // write does not stop the merge, so every count stays right.
+        for (int b = nb - 1; b >= 0; --b) {
+            counts[b] = band_lens[b] + (b + 1 < nb ? counts[b + 1] : 0);
+            if (b + 1 < nb) {
+                t = stage_begin();
+                memcpy(scratch, ctx.bands[b], band_lens[b] * sizeof(morton_key_t));
+                merge_band(scratch, band_lens[b], ctx.bands[b + 1], counts[b + 1], ctx.bands[b]);
+                stage_end(timer, STAGE_MERGE, t);
+            }
+
+            char out_path[64];
+            snprintf(out_path, sizeof(out_path), "morton_codes_pthread_t%u.%s", thresholds[b],
+                     code_format_extension(format));
+            volume_config_t out_cfg = *cfg;
+            out_cfg.threshold = (uint8_t)thresholds[b];
+            code_file_header_t header = code_file_header(&out_cfg, grid.key_bits);
+            code_writer_t writer;
+            int write_rc;
+            t = stage_begin();
+            if (code_writer_open(&writer, out_path, format, grid.key_bits, 0) != 0) {
+                write_rc = 1;
+            } else {
+                code_writer_put(&writer, ctx.bands[b], counts[b]);
+                write_rc = code_writer_close(&writer, &header) != 0;
+            }
+            stage_end(timer, STAGE_WRITE, t);
+            if (write_rc != 0) {
+                fprintf(stderr, "Error: Failed to write %s\n", out_path);
+                rc = 1;
+            }
+        }
+
+        printf("Threshold sweep over %d thresholds:\n", nb);
+        printf("  threshold  active voxels\n");
+        FILE *fp = fopen("threshold_counts_pthread.txt", "w");
+        for (int b = 0; b < nb; ++b) {
+            printf("  %9u  %13zu\n", thresholds[b], counts[b]);
+            if (fp) fprintf(fp, "%u %zu\n", thresholds[b], counts[b]);
+        }
+        if (!fp || fclose(fp) != 0) {
+            fprintf(stderr, "Error: Failed to write threshold_counts_pthread.txt\n");
+            rc = 1;
+        }
+        *total_active = total;
+    }
+
+    arena_destroy(&code_arena);
+    free(counts);
+    free(band_lens);
+    free(ctx.band_counts);
+    free(ctx.band_offsets);
+    free(ctx.bands);
+    return rc;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s num_threads [options]\n", prog);
+    printf("  --bench-encode     compare the encode kernels instead of running the pipeline\n");
+    printf("  --format FMT       text (default), fixed (zero-padded text) or binary\n");
+    printf("  --json PATH        write per-stage and per-thread timings as JSON (- for stdout;\n");
+    printf("                     the report then goes to stderr)\n");
+    printf("  --perf             count cycles, instructions and cache, branch and TLB misses per stage and thread\n");
+    printf("  --octree           also build the linear octree of the active voxels (octree_pthread.bin)\n");
+    printf("  --components       label the 6-connected components (component_labels_pthread.txt, one label per\n");
+    printf("                     code; component_sizes_pthread.txt)\n");
+    printf("  --sweep T1,T2,...  one pass for several thresholds (morton_codes_pthread_t<T> each)\n");
+    printf("  --numa             pin threads to cores, read and touch each thread's slabs on its own node\n");
+    volume_config_usage(stdout);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s num_threads\n", argv[0]);
+    if (argc < 2) {
+        print_usage(argv[0]);
         return 1;
     }
     int num_threads = atoi(argv[1]);
-    if (num_threads <= 0) {
-        printf("Invalid number of threads\n");
+    if (num_threads <= 0 || num_threads > POOL_MAX_THREADS) {
+        printf("Invalid number of threads (expected 1-%d)\n", POOL_MAX_THREADS);
         return 1;
     }
 
-    uint8_t *data = malloc(TOTAL_VOXELS * sizeof(uint8_t));
-    if (!data) {
-        fprintf(stderr, "Error: Failed to allocate data array\n");
+    volume_config_t cfg;
+    volume_config_defaults(&cfg);
+    int bench_encode = 0;
+    code_format_t format = CODE_FORMAT_TEXT;
+    const char *json_path = NULL;
+    int perf = 0;
+    int numa = 0;
+    int build_octree = 0;
+    int label_components = 0;
+    uint32_t sweep[MAX_SWEEP];
+    int num_sweep = 0;
+    for (int i = 2; i < argc; ++i) {
+        int rc = volume_config_parse_arg(&cfg, argc, argv, &i);
+        if (rc < 0) {
+            return 1;
+        } else if (rc == 0 && strcmp(argv[i], "--bench-encode") == 0) {
+            bench_encode = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (rc == 0 && strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--numa") == 0) {
+            numa = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--octree") == 0) {
+            build_octree = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--components") == 0) {
+            label_components = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) {
+            if (parse_thresholds(argv[++i], sweep, &num_sweep) != 0) {
+                fprintf(stderr, "Error: Invalid threshold list %s (expected values 0-%d)\n", argv[i], UINT8_MAX);
+                return 1;
+            }
+        } else if (rc == 0 && strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (code_format_parse(argv[++i], &format) != 0) {
+                return 1;
+            }
+        } else if (rc == 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (volume_config_check(&cfg) != 0) {
         return 1;
     }
+    // With --json -, stdout carries only the JSON report
+    if (json_path && strcmp(json_path, "-") == 0 && stage_json_claim_stdout() != 0) {
+        return 1;
+    }
+    size_t total_voxels = volume_total_voxels(&cfg);
 
-    FILE *fp = fopen("c8.raw", "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Failed to open c8.raw\n");
-        free(data);
+    // The volume and the code buffers live in huge-page arenas sized
+    // exactly: the volume size is known, the codes are counted first
+    arena_t data_arena;
+    if (arena_init(&data_arena, total_voxels, ARENA_HUGETLB) != 0) {
+        fprintf(stderr, "Error: Failed to allocate data array\n");
         return 1;
     }
-    fread(data, sizeof(uint8_t), TOTAL_VOXELS, fp);
-    fclose(fp);
+    uint8_t *data = arena_alloc(&data_arena, total_voxels);
 
-    clock_t start_time = clock();
+    if (bench_encode) {
+        if (loader_read_all(cfg.path, 0, total_voxels, data) != 0) {
+            arena_destroy(&data_arena);
+            return 1;
+        }
+        morton_grid_t bench_grid = morton_grid(cfg.x_size, cfg.y_size, cfg.z_size);
+        int rc = morton_benchmark(&bench_grid, data, total_voxels, 0, cfg.threshold, 3);
+        arena_destroy(&data_arena);
+        return rc == 0 ? 0 : 1;
+    }
+
+    // Wall-clock stage timing; loading overlaps the count pass, so it is
+    // part of the timed region
+    stage_timer_t timer;
+    stage_timer_init(&timer);
 
-    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
-    thread_data_t *thread_data = malloc(num_threads * sizeof(thread_data_t));
-    uint32_t **all_morton_codes = malloc(num_threads * sizeof(uint32_t *));
-    size_t *all_code_counts = malloc(num_threads * sizeof(size_t));
+    // Everything from here on is released at cleanup, on success and on
+    // every error
+    int rc = 1;
+    int *worker_cpu = NULL, *worker_node = NULL;
+    double *slab_local = NULL, *codes_local = NULL;
+    arena_t code_arena = {0};
+    extract_ctx_t ctx = {0};
+    size_t *run_offsets = NULL, *run_lens = NULL;
+    const morton_key_t **runs = NULL;
+    thread_pool_t *pool = pool_create(num_threads);
+    if (!pool) {
+        fprintf(stderr, "Error: Failed to create thread pool\n");
+        goto cleanup;
+    }
+    stage_timer_attach_pool(&timer, pool);
+    if (perf && stage_timer_enable_perf(&timer) == 0) {
+        fprintf(stderr, "Warning: No hardware counters available (no PMU or perf_event_paranoid > 2)\n");
+    }
 
-    size_t voxels_per_thread = TOTAL_VOXELS / num_threads;
-    size_t remainder = TOTAL_VOXELS % num_threads;
+    if (num_sweep > 0) {
+        size_t swept = 0;
+        cfg.threshold = (uint8_t)sweep[0];
+        rc = run_sweep(pool, &cfg, &data_arena, sweep, num_sweep, format, &timer, &swept);
+        arena_destroy(&data_arena);
+        printf("Processing time with %d threads: %f seconds\n", num_threads, stage_total(&timer));
+        printf("Time spent waiting for input: %f seconds\n", timer.seconds[STAGE_LOAD]);
+        pool_print_stats(pool, stdout);
+        if (perf) {
+            uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS];
+            stage_perf_totals(&timer, totals);
+            stage_print_perf(totals, stdout);
+        }
+        if (json_path && stage_timer_write_json(json_path, &timer, "pthread", num_threads, &cfg, "sweep", swept, NULL,
+                                                NULL, 0, NULL) != 0) {
+            rc = 1;
+        }
+        goto cleanup;
+    }
 
-    for (int i = 0; i < num_threads; ++i) {
-        size_t start_idx = i * voxels_per_thread;
-        size_t end_idx = start_idx + voxels_per_thread;
-        if (i == num_threads - 1) {
-            end_idx += remainder;
+    // Worker i is pinned next to worker i - 1 and owns the i-th block of
+    // slabs in every owned run, from the read to the extraction
+    numa_topology_t topology = {.num_nodes = 1};
+    worker_cpu = calloc(num_threads, sizeof(int));
+    worker_node = calloc(num_threads, sizeof(int));
+    slab_local = calloc(num_threads, sizeof(double));
+    codes_local = calloc(num_threads, sizeof(double));
+    if (!worker_cpu || !worker_node || !slab_local || !codes_local) {
+        fprintf(stderr, "Error: Failed to allocate per-thread tables\n");
+        goto cleanup;
+    }
+    int pinned = 0;
+    if (numa) {
+        numa_topology_load(&topology);
+        pinned = numa_pin_pool(pool, &topology, worker_cpu, worker_node);
+        if (pinned < num_threads) {
+            fprintf(stderr, "Warning: Pinned %d of %d threads\n", pinned, num_threads);
         }
+    }
+    void (*run_placed)(thread_pool_t *, size_t, pool_task_fn, void *) = numa ? pool_run_owned : pool_run;
 
-        size_t max_codes = (end_idx - start_idx) / 4;
-        all_morton_codes[i] = malloc(max_codes * sizeof(uint32_t));
-        if (!all_morton_codes[i]) {
-            fprintf(stderr, "Error: Failed to allocate Morton codes array\n");
-            free(data);
-            return 1;
+    const morton_kernel_t *kernel = morton_select_kernel();
+    morton_grid_t grid = morton_grid(cfg.x_size, cfg.y_size, cfg.z_size);
+
+    size_t chunk_voxels = volume_slab_voxels(&cfg);
+    size_t num_chunks = (total_voxels + chunk_voxels - 1) / chunk_voxels;
+    ctx = (extract_ctx_t){
+        .data = data,
+        .total_voxels = total_voxels,
+        .chunk_voxels = chunk_voxels,
+        .threshold = cfg.threshold,
+        .num_chunks = num_chunks,
+        .chunk_counts = malloc(num_chunks * sizeof(size_t)),
+        .chunk_offsets = malloc(num_chunks * sizeof(size_t)),
+        .kernel = kernel,
+        .grid = &grid};
+    if (!ctx.chunk_counts || !ctx.chunk_offsets) {
+        fprintf(stderr, "Error: Failed to allocate chunk counts\n");
+        goto cleanup;
+    }
+
+    double t;
+    if (numa) {
+        // Parallel first-touch read, then every worker counts its own slabs
+        int fd = open(cfg.path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Failed to open %s\n", cfg.path);
+            goto cleanup;
+        }
+        int *failed = calloc(num_threads, sizeof(int));
+        if (!failed) {
+            fprintf(stderr, "Error: Failed to allocate per-thread tables\n");
+            close(fd);
+            goto cleanup;
+        }
+        numa_load_ctx_t load_ctx = {.fd = fd, .extract = &ctx, .num_threads = num_threads, .failed = failed};
+        t = stage_begin();
+        pool_run_owned(pool, num_threads, numa_load_task, &load_ctx);
+        stage_end(&timer, STAGE_LOAD, t);
+        close(fd);
+        int load_failed = 0;
+        for (int i = 0; i < num_threads; ++i) load_failed |= failed[i];
+        free(failed);
+        if (load_failed) {
+            fprintf(stderr, "Error: Failed to read data from %s\n", cfg.path);
+            goto cleanup;
         }
 
-        thread_data[i] = (thread_data_t){
-            .thread_id = i,
-            .start_idx = start_idx,
-            .end_idx = end_idx,
-            .data = data,
-            .morton_codes = all_morton_codes[i],
-            .code_count = &all_code_counts[i]};
-        pthread_create(&threads[i], NULL, thread_function, &thread_data[i]);
+        t = stage_begin();
+        ctx.chunk_base = 0;
+        pool_run_owned(pool, num_chunks, count_task, &ctx);
+        stage_end(&timer, STAGE_SCAN, t);
+    } else {
+        // The reader thread fills data block by block; the pool counts the
+        // slabs of every block as soon as it lands
+        volume_loader_t loader;
+        if (loader_open(&loader, cfg.path, 0, total_voxels, loader_slab_block_bytes(chunk_voxels), 1, data) != 0) {
+            goto cleanup;
+        }
+        const uint8_t *block;
+        size_t block_start, block_len;
+        int load_rc;
+        t = stage_begin();
+        while ((load_rc = loader_next(&loader, &block, &block_start, &block_len)) == 1) {
+            ctx.chunk_base = block_start / chunk_voxels;
+            pool_run(pool, (block_len + chunk_voxels - 1) / chunk_voxels, count_task, &ctx);
+        }
+        stage_add(&timer, STAGE_LOAD, loader.wait_time);
+        stage_end(&timer, STAGE_SCAN, t + loader.wait_time);
+        if (loader_close(&loader) != 0 || load_rc < 0) {
+            fprintf(stderr, "Error: Failed to read data from %s\n", cfg.path);
+            goto cleanup;
+        }
     }
 
+    t = stage_begin();
     size_t total_active_voxels = 0;
-    for (int i = 0; i < num_threads; ++i) {
-        pthread_join(threads[i], NULL);
-        total_active_voxels += all_code_counts[i];
+    for (size_t c = 0; c < num_chunks; ++c) {
+        ctx.chunk_offsets[c] = total_active_voxels;
+        total_active_voxels += ctx.chunk_counts[c];
     }
+    size_t code_bytes = total_active_voxels * sizeof(morton_key_t);
+    size_t code_sizes[2] = {code_bytes, code_bytes};
+    if (arena_init(&code_arena, arena_size(code_sizes, 2), ARENA_HUGETLB) != 0) {
+        fprintf(stderr, "Error: Failed to allocate Morton codes array\n");
+        goto cleanup;
+    }
+    ctx.morton_codes = arena_alloc(&code_arena, code_bytes);
+
+    stage_end(&timer, STAGE_COMBINE, t);
 
-    uint32_t *combined_morton_codes = malloc(total_active_voxels * sizeof(uint32_t));
-    size_t offset = 0;
-    for (int i = 0; i < num_threads; ++i) {
-        memcpy(combined_morton_codes + offset, all_morton_codes[i], all_code_counts[i] * sizeof(uint32_t));
-        offset += all_code_counts[i];
-        free(all_morton_codes[i]);
+    // Owned runs also make each worker the first to touch its codes
+    t = stage_begin();
+    run_placed(pool, num_chunks, fill_task, &ctx);
+    stage_end(&timer, STAGE_SCAN, t);
+
+    numa_page_stats_t volume_pages, code_pages;
+    int have_pages = 0;
+    if (numa) {
+        have_pages = numa_page_stats(data, total_voxels, &volume_pages) == 0 &&
+                     numa_page_stats(ctx.morton_codes, code_bytes, &code_pages) == 0;
+        for (int i = 0; i < num_threads; ++i) {
+            size_t first, last, start, end, unused;
+            slab_local[i] = codes_local[i] = -1.0;
+            pool_block(num_chunks, num_threads, i, &first, &last);
+            if (!have_pages || first == last) continue;
+            chunk_range(&ctx, first, &start, &unused);
+            chunk_range(&ctx, last - 1, &unused, &end);
+            slab_local[i] = numa_local_share(data + start, end - start, worker_node[i]);
+            size_t code_begin = ctx.chunk_offsets[first];
+            size_t code_end = ctx.chunk_offsets[last - 1] + ctx.chunk_counts[last - 1];
+            if (code_end > code_begin) {
+                codes_local[i] = numa_local_share(ctx.morton_codes + code_begin,
+                                                  (code_end - code_begin) * sizeof(morton_key_t), worker_node[i]);
+            }
+        }
     }
-    free(all_morton_codes);
 
-    qsort(combined_morton_codes, total_active_voxels, sizeof(uint32_t), compare_uint32);
+    free(ctx.chunk_counts);
+    free(ctx.chunk_offsets);
+    ctx.chunk_counts = ctx.chunk_offsets = NULL;
+    morton_key_t *combined_morton_codes = ctx.morton_codes;
+    const char *data_pages = arena_backing_name(&data_arena);
+    arena_destroy(&data_arena);
 
-    clock_t end_time = clock();
-    double total_time = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+    t = stage_begin();
+    morton_key_t *sort_buffer = arena_alloc(&code_arena, code_bytes);
+
+    // One run per thread: sort the runs in parallel, then merge them
+    int num_runs = num_threads;
+    run_offsets = malloc((num_runs + 1) * sizeof(size_t));
+    runs = malloc(num_runs * sizeof(morton_key_t *));
+    run_lens = malloc(num_runs * sizeof(size_t));
+    if (!run_offsets || !runs || !run_lens) {
+        fprintf(stderr, "Error: Failed to allocate sort runs\n");
+        goto cleanup;
+    }
+    for (int r = 0; r <= num_runs; ++r) {
+        run_offsets[r] = total_active_voxels * r / num_runs;
+    }
+    for (int r = 0; r < num_runs; ++r) {
+        runs[r] = combined_morton_codes + run_offsets[r];
+        run_lens[r] = run_offsets[r + 1] - run_offsets[r];
+    }
+    run_sort_ctx_t sort_ctx = {
+        .codes = combined_morton_codes, .tmp = sort_buffer, .run_offsets = run_offsets, .key_bits = grid.key_bits};
+    run_placed(pool, num_runs, sort_run_task, &sort_ctx);
+    stage_end(&timer, STAGE_SORT, t);
+
+    t = stage_begin();
+    if (num_runs > 1) {
+        if (lt_merge_arrays_parallel(pool, runs, run_lens, num_runs, sort_buffer) != 0) {
+            fprintf(stderr, "Error: Failed to merge sorted runs\n");
+            goto cleanup;
+        }
+        morton_key_t *swap = combined_morton_codes;
+        combined_morton_codes = sort_buffer;
+        sort_buffer = swap;
+    }
+    free(run_offsets);
+    free(runs);
+    free(run_lens);
+    run_offsets = run_lens = NULL;
+    runs = NULL;
+    stage_end(&timer, STAGE_MERGE, t);
+
+    // Parallel over key ranges that never split a sibling group
+    octree_t octree = {0};
+    int octree_rc = 0;
+    if (build_octree) {
+        t = stage_begin();
+        octree_rc = octree_build(pool, combined_morton_codes, total_active_voxels, grid.key_bits, &octree);
+        stage_end(&timer, STAGE_OCTREE, t);
+    }
+
+    // The sort buffer is free after the merge and holds one label per code
+    component_set_t components = {0};
+    int components_rc = 0;
+    if (label_components) {
+        t = stage_begin();
+        components_rc = components_label(pool, combined_morton_codes, total_active_voxels, cfg.x_size, cfg.y_size,
+                                         cfg.z_size, sort_buffer, &components);
+        stage_end(&timer, STAGE_LABEL, t);
+    }
+    double total_time = stage_total(&timer);
 
     printf("Number of active voxels: %zu\n", total_active_voxels);
+    printf("Scan kernel: %s\n", kernel->name);
+    printf("Buffer pages: volume %s, codes %s\n", data_pages, arena_backing_name(&code_arena));
     printf("First 10 Morton codes:\n");
     for (size_t i = 0; i < 10 && i < total_active_voxels; ++i) {
-        printf("%u\n", combined_morton_codes[i]);
+        printf("%" PRImorton "\n", combined_morton_codes[i]);
     }
     printf("Processing time with %d threads: %f seconds\n", num_threads, total_time);
+    printf("Time spent waiting for input: %f seconds\n", timer.seconds[STAGE_LOAD]);
+    pool_print_stats(pool, stdout);
+    if (numa) {
+        printf("NUMA placement: %d nodes, %d of %d threads pinned\n", topology.num_nodes, pinned, num_threads);
+        for (int i = 0; i < num_threads; ++i) {
+            printf("  Thread %d: cpu %d, node %d", i, worker_cpu[i], worker_node[i]);
+            if (slab_local[i] >= 0.0) printf(", slab %.1f%% local", 100.0 * slab_local[i]);
+            if (codes_local[i] >= 0.0) printf(", codes %.1f%% local", 100.0 * codes_local[i]);
+            printf("\n");
+        }
+        if (have_pages) {
+            numa_print_stats(stdout, "Volume", &volume_pages, topology.num_nodes);
+            numa_print_stats(stdout, "Code", &code_pages, topology.num_nodes);
+        } else {
+            printf("Page placement: unavailable (kernel without NUMA support)\n");
+        }
+    }
+
+    char out_path[64];
+    snprintf(out_path, sizeof(out_path), "morton_codes_pthread.%s", code_format_extension(format));
+    code_writer_t writer;
+    t = stage_begin();
+    if (code_writer_open(&writer, out_path, format, grid.key_bits, 0) == 0) {
+        code_file_header_t header = code_file_header(&cfg, grid.key_bits);
+        code_writer_put(&writer, combined_morton_codes, total_active_voxels);
+        if (code_writer_close(&writer, &header) != 0) {
+            fprintf(stderr, "Error: Failed to write %s\n", out_path);
+        }
+    }
+    stage_end(&timer, STAGE_WRITE, t);
 
-    FILE *out_fp = fopen("morton_codes_pthread.txt", "w");
-    if (out_fp) {
-        for (size_t i = 0; i < total_active_voxels; ++i) {
-            fprintf(out_fp, "%u\n", combined_morton_codes[i]);
+    if (build_octree) {
+        if (octree_rc == 0) {
+            octree_print_summary(&octree, stdout);
         }
-        fclose(out_fp);
+        if (octree_rc != 0 || octree_write("octree_pthread.bin", &octree, &cfg, grid.key_bits) != 0) {
+            fprintf(stderr, "Error: Failed to build or write octree_pthread.bin\n");
+        }
+        octree_free(&octree);
     }
 
-    free(combined_morton_codes);
-    free(all_code_counts);
-    free(thread_data);
-    free(threads);
-    free(data);
+    if (label_components) {
+        code_writer_t label_writer;
+        t = stage_begin();
+        if (components_rc == 0) {
+            components_print_summary(&components, total_active_voxels, stdout);
+        }
+        if (components_rc != 0 || code_writer_open(&label_writer, "component_labels_pthread.txt", CODE_FORMAT_TEXT,
+                                                   grid.key_bits, 0) != 0) {
+            fprintf(stderr, "Error: Failed to label components or write component_labels_pthread.txt\n");
+        } else {
+            code_writer_put(&label_writer, sort_buffer, total_active_voxels);
+            if (code_writer_close(&label_writer, NULL) != 0) {
+                fprintf(stderr, "Error: Failed to write component_labels_pthread.txt\n");
+            }
+        }
+        if (components_rc == 0 && components_write_sizes("component_sizes_pthread.txt", &components) != 0) {
+            fprintf(stderr, "Error: Failed to write component_sizes_pthread.txt\n");
+        }
+        stage_end(&timer, STAGE_WRITE, t);
+        components_free(&components);
+    }
+
+    if (perf) {
+        uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS];
+        stage_perf_totals(&timer, totals);
+        stage_print_perf(totals, stdout);
+    }
+
+    rc = 0;
+    if (json_path && stage_timer_write_json(json_path, &timer, "pthread", num_threads, &cfg, kernel->name,
+                                            total_active_voxels, NULL, NULL, 0, NULL) != 0) {
+        rc = 1;
+    }
 
-    return 0;
+cleanup:
+    stage_timer_free(&timer);
+    if (pool) pool_destroy(pool);
+    arena_destroy(&data_arena);
+    arena_destroy(&code_arena);
+    free(ctx.chunk_counts);
+    free(ctx.chunk_offsets);
+    free(run_offsets);
+    free(runs);
+    free(run_lens);
+    free(worker_cpu);
+    free(worker_node);
+    free(slab_local);
+    free(codes_local);
+    return rc;
 }
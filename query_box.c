@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "code_file.h"
+#include "morton.h"
+#include "morton_query.h"
+
+// Active voxels inside a box, from any engine's sorted output. Text files
+// are loaded and indexed in memory; binary files are queried in place
+// through their block index, reading only the blocks the box reaches.
+
+#define DEFAULT_REPEAT 1
+
+// Matches collected for the report and the optional output file
+typedef struct {
+    morton_key_t *codes;
+    size_t count;
+    size_t cap;
+} match_list_t;
+
+int collect_match(void *arg, morton_key_t code) {
+    match_list_t *list = (match_list_t *)arg;
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? 2 * list->cap : 1024;
+        morton_key_t *grown = realloc(list->codes, cap * sizeof(morton_key_t));
+        if (!grown) {
+            return 1;
+        }
+        list->codes = grown;
+        list->cap = cap;
+    }
+    list->codes[list->count++] = code;
+    return 0;
+}
+
+// Loads a text file of sorted codes. Returns 0, or -1 on a parse error,
+// codes that are out of order or too wide for this build.
+int load_text_codes(const char *path, morton_key_t **codes, size_t *count) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Failed to open %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    const char *text = len > 0 ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (text == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map %s\n", path);
+        return -1;
+    }
+
+    // Every code takes at least two bytes with its separator
+    size_t cap = len / 2 + 1, n = 0;
+    morton_key_t *out = malloc(cap * sizeof(morton_key_t));
+    int rc = out ? 0 : -1;
+    for (size_t i = 0; i < len && rc == 0;) {
+        char c = text[i];
+        if (c == '\n' || c == ' ' || c == '\r' || c == '\t') {
+            i++;
+            continue;
+        }
+        uint64_t v = 0;
+        size_t start = i;
+        while (i < len && text[i] >= '0' && text[i] <= '9' && i - start < 20) {
+            v = v * 10 + (uint64_t)(text[i++] - '0');
+        }
+        if (i == start || v > MORTON_KEY_MAX) {
+            fprintf(stderr, "Error: %s: %s at byte %zu\n", path,
+                    i == start ? "unexpected data" : "code too wide (rebuild with -DMORTON_KEY_BITS=64)", start);
+            rc = -1;
+        } else if (n > 0 && (morton_key_t)v <= out[n - 1]) {
+            fprintf(stderr, "Error: %s: codes are not sorted at code %zu\n", path, n);
+            rc = -1;
+        } else {
+            out[n++] = (morton_key_t)v;
+        }
+    }
+    if (text) munmap((void *)text, len);
+    if (rc != 0) {
+        free(out);
+        return -1;
+    }
+    *codes = out;
+    *count = n;
+    return 0;
+}
+
+// Significant bits of a key, rounded up to whole coordinate triples
+int key_bits_of(morton_key_t largest) {
+    int bits = 0;
+    while (bits < MORTON_KEY_BITS && (largest >> bits) != 0) bits++;
+    bits = (bits + 2) / 3 * 3;
+    return bits > 0 ? bits : 3;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s [options] CODES X0 Y0 Z0 X1 Y1 Z1\n", prog);
+    printf("  --count            only count the matching voxels\n");
+    printf("  --output PATH      write the matching codes to PATH\n");
+    printf("  --format FMT       output format: text (default), fixed or binary\n");
+    printf("  --repeat N         run the query N times and report the mean time (default %d)\n", DEFAULT_REPEAT);
+    printf("CODES is a sorted text or binary code file; the box corners are inclusive.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int count_only = 0;
+    const char *out_path = NULL;
+    code_format_t format = CODE_FORMAT_TEXT;
+    long repeat = DEFAULT_REPEAT;
+    const char *path = NULL;
+    uint32_t corner[6];
+    int num_corner = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--count") == 0) {
+            count_only = 1;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (code_format_parse(argv[++i], &format) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atol(argv[++i]);
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else if (path && num_corner < 6 && volume_parse_u32(argv[i], UINT32_MAX, &corner[num_corner]) == 0) {
+            num_corner++;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path || num_corner != 6 || repeat <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    for (int c = 0; c < 6; ++c) {
+        if (corner[c] > (1u << MORTON_COORD_BITS) - 1) {
+            fprintf(stderr, "Error: Coordinate %u exceeds %u, the largest a %d-bit key holds%s\n", corner[c],
+                    (1u << MORTON_COORD_BITS) - 1, MORTON_KEY_BITS,
+                    MORTON_KEY_BITS < 64 ? "; rebuild with -DMORTON_KEY_BITS=64" : "");
+            return 1;
+        }
+    }
+    morton_box_t box = {corner[0], corner[1], corner[2], corner[3], corner[4], corner[5]};
+    if (box.x0 > box.x1 || box.y0 > box.y1 || box.z0 > box.z1) {
+        fprintf(stderr, "Error: The first corner must not exceed the second\n");
+        return 1;
+    }
+
+    // Binary files carry their key width; text files get it from the
+    // largest code
+    code_reader_t reader;
+    morton_key_t *codes = NULL;
+    size_t count = 0;
+    morton_index_t index;
+    int key_bits;
+    double t = now_seconds();
+    int binary = code_file_is_binary(path);
+    if (binary) {
+        if (code_reader_open(&reader, path) != 0) {
+            return 1;
+        }
+        key_bits = (int)reader.hdr.key_bits;
+        if (morton_index_init_reader(&index, &reader) != 0) {
+            fprintf(stderr, "Error: Failed to index %s\n", path);
+            return 1;
+        }
+    } else {
+        if (load_text_codes(path, &codes, &count) != 0) {
+            return 1;
+        }
+        key_bits = key_bits_of(count > 0 ? codes[count - 1] : 0);
+        if (morton_index_init_codes(&index, codes, count) != 0) {
+            fprintf(stderr, "Error: Failed to index %s\n", path);
+            return 1;
+        }
+    }
+    double load_time = now_seconds() - t;
+
+    // Clamp the box to the key width so its corners encode
+    uint32_t coord_max = (uint32_t)((1ull << (key_bits / 3)) - 1);
+    int empty = box.x0 > coord_max || box.y0 > coord_max || box.z0 > coord_max;
+    if (box.x1 > coord_max) box.x1 = coord_max;
+    if (box.y1 > coord_max) box.y1 = coord_max;
+    if (box.z1 > coord_max) box.z1 = coord_max;
+
+    match_list_t matches = {0};
+    morton_query_stats_t stats = {0};
+    int rc = 0;
+    if (!empty) {
+        rc = morton_query_box(&index, &box, key_bits, count_only ? NULL : collect_match, &matches, &stats);
+    }
+    if (rc != 0 || (!count_only && matches.count != stats.matches)) {
+        fprintf(stderr, "Error: Query failed on %s\n", path);
+        return 1;
+    }
+
+    // Timed reruns; file blocks stay cached by the OS after the first run
+    double query_time = 0.0;
+    if (!empty) {
+        morton_query_stats_t rerun;
+        t = now_seconds();
+        for (long r = 0; r < repeat; ++r) {
+            morton_query_box(&index, &box, key_bits, NULL, NULL, &rerun);
+        }
+        query_time = (now_seconds() - t) / repeat;
+    }
+
+    printf("Codes: %zu in %zu blocks (%s, %d-bit keys)\n", binary ? (size_t)reader.hdr.count : count,
+           index.num_blocks, binary ? "binary, queried in place" : "text, loaded", key_bits);
+    printf("Box: (%u, %u, %u) - (%u, %u, %u)\n", corner[0], corner[1], corner[2], corner[3], corner[4], corner[5]);
+    printf("Matching voxels: %zu\n", stats.matches);
+    printf("Searches: %zu, blocks read: %zu, blocks skipped: %zu\n", stats.searches, stats.blocks_read,
+           stats.blocks_skipped);
+    printf("Load and index time: %f seconds\n", load_time);
+    printf("Query time: %.2f us (mean of %ld)\n", query_time * 1e6, repeat);
+    if (!count_only) {
+        printf("First 10 matching Morton codes:\n");
+        for (size_t i = 0; i < 10 && i < matches.count; ++i) {
+            uint32_t x, y, z;
+            morton_decode(matches.codes[i], &x, &y, &z);
+            printf("%" PRImorton " (%u, %u, %u)\n", matches.codes[i], x, y, z);
+        }
+    }
+
+    if (out_path && !count_only) {
+        code_writer_t writer;
+        volume_config_t cfg;
+        volume_config_defaults(&cfg);
+        if (binary) {
+            cfg.x_size = reader.hdr.x_size;
+            cfg.y_size = reader.hdr.y_size;
+            cfg.z_size = reader.hdr.z_size;
+            cfg.threshold = (uint8_t)reader.hdr.threshold;
+        }
+        code_file_header_t header = code_file_header(&cfg, key_bits);
+        if (code_writer_open(&writer, out_path, format, key_bits, 0) != 0) {
+            rc = 1;
+        } else {
+            code_writer_put(&writer, matches.codes, matches.count);
+            rc = code_writer_close(&writer, &header) != 0;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Error: Failed to write %s\n", out_path);
+        } else {
+            printf("Matches saved to %s\n", out_path);
+        }
+    }
+
+    free(matches.codes);
+    morton_index_free(&index);
+    if (binary) {
+        code_reader_close(&reader);
+    }
+    free(codes);
+    return rc;
+}
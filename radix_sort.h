@@ -0,0 +1,161 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "morton.h"
+#include "thread_pool.h"
+
+// LSD radix sort for Morton codes with 10-bit digits (1024 buckets). Only
+// the significant bits of the keys are sorted: a 1024^3 volume has 30-bit
+// keys, so three passes sort the whole key.
+#define RADIX_BITS 10
+#define RADIX_BUCKETS (1u << RADIX_BITS)
+#define RADIX_MASK (RADIX_BUCKETS - 1)
+
+static inline int radix_pass_count(int key_bits) {
+    return (key_bits + RADIX_BITS - 1) / RADIX_BITS;
+}
+
+// Sorts keys[0..n), whose values fit in key_bits bits, using tmp[0..n) as
+// scratch. The result ends up in keys.
+static inline void radix_sort_keys(morton_key_t *keys, morton_key_t *tmp, size_t n, int key_bits) {
+    int passes = radix_pass_count(key_bits);
+    morton_key_t *src = keys;
+    morton_key_t *dst = tmp;
+    size_t count[RADIX_BUCKETS];
+
+    for (int pass = 0; pass < passes; ++pass) {
+        int shift = pass * RADIX_BITS;
+
+        memset(count, 0, sizeof(count));
+        for (size_t i = 0; i < n; ++i) {
+            count[(src[i] >> shift) & RADIX_MASK]++;
+        }
+
+        // Exclusive prefix sum gives the first output slot of each bucket
+        size_t sum = 0;
+        for (uint32_t b = 0; b < RADIX_BUCKETS; ++b) {
+            size_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            morton_key_t key = src[i];
+            dst[count[(key >> shift) & RADIX_MASK]++] = key;
+        }
+
+        morton_key_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != keys) {
+        memcpy(keys, src, n * sizeof(morton_key_t));
+    }
+}
+
+// Keys per block in the pool-based sort. Blocks are the unit of work the
+// pool schedules, so there are many more of them than threads.
+#define RADIX_POOL_BLOCK ((size_t)1 << 18)
+
+typedef struct {
+    const morton_key_t *src;
+    morton_key_t *dst;
+    size_t n;
+    int shift;
+    size_t *counts; // num_blocks x RADIX_BUCKETS, row per block
+} radix_pool_ctx_t;
+
+static inline void radix_block_range(const radix_pool_ctx_t *ctx, size_t block, size_t *start, size_t *end) {
+    *start = block * RADIX_POOL_BLOCK;
+    *end = *start + RADIX_POOL_BLOCK < ctx->n ? *start + RADIX_POOL_BLOCK : ctx->n;
+}
+
+static inline void radix_histogram_task(void *arg, size_t block, int worker) {
+    radix_pool_ctx_t *ctx = (radix_pool_ctx_t *)arg;
+    size_t *count = ctx->counts + block * RADIX_BUCKETS;
+    size_t start, end;
+    (void)worker;
+
+    radix_block_range(ctx, block, &start, &end);
+    memset(count, 0, RADIX_BUCKETS * sizeof(size_t));
+    for (size_t i = start; i < end; ++i) {
+        count[(ctx->src[i] >> ctx->shift) & RADIX_MASK]++;
+    }
+}
+
+static inline void radix_scatter_task(void *arg, size_t block, int worker) {
+    radix_pool_ctx_t *ctx = (radix_pool_ctx_t *)arg;
+    size_t *offset = ctx->counts + block * RADIX_BUCKETS;
+    size_t start, end;
+    (void)worker;
+
+    radix_block_range(ctx, block, &start, &end);
+    for (size_t i = start; i < end; ++i) {
+        morton_key_t key = ctx->src[i];
+        ctx->dst[offset[(key >> ctx->shift) & RADIX_MASK]++] = key;
+    }
+}
+
+static inline void radix_copy_task(void *arg, size_t block, int worker) {
+    radix_pool_ctx_t *ctx = (radix_pool_ctx_t *)arg;
+    size_t start, end;
+    (void)worker;
+
+    radix_block_range(ctx, block, &start, &end);
+    memcpy(ctx->dst + start, ctx->src + start, (end - start) * sizeof(morton_key_t));
+}
+
+// Multi-threaded variant of radix_sort_keys on a thread pool. Every pass
+// histograms and scatters fixed-size blocks as pool tasks; offsets are laid
+// out bucket-major then block-major, so the result does not depend on
+// which worker ran which block.
+static inline int radix_sort_keys_pool(thread_pool_t *pool, morton_key_t *keys, morton_key_t *tmp, size_t n,
+                                       int key_bits) {
+    if (pool->num_threads <= 1 || n < 2 * RADIX_POOL_BLOCK) {
+        radix_sort_keys(keys, tmp, n, key_bits);
+        return 0;
+    }
+
+    size_t num_blocks = (n + RADIX_POOL_BLOCK - 1) / RADIX_POOL_BLOCK;
+    size_t *counts = malloc(num_blocks * RADIX_BUCKETS * sizeof(size_t));
+    if (!counts) {
+        return -1;
+    }
+
+    int passes = radix_pass_count(key_bits);
+    radix_pool_ctx_t ctx = {.src = keys, .dst = tmp, .n = n, .counts = counts};
+    for (int pass = 0; pass < passes; ++pass) {
+        ctx.shift = pass * RADIX_BITS;
+        pool_run(pool, num_blocks, radix_histogram_task, &ctx);
+
+        size_t sum = 0;
+        for (uint32_t b = 0; b < RADIX_BUCKETS; ++b) {
+            for (size_t j = 0; j < num_blocks; ++j) {
+                size_t *c = &counts[j * RADIX_BUCKETS + b];
+                size_t v = *c;
+                *c = sum;
+                sum += v;
+            }
+        }
+
+        pool_run(pool, num_blocks, radix_scatter_task, &ctx);
+
+        morton_key_t *swap = (morton_key_t *)ctx.src;
+        ctx.src = ctx.dst;
+        ctx.dst = swap;
+    }
+
+    if (ctx.src != keys) {
+        ctx.dst = keys;
+        pool_run(pool, num_blocks, radix_copy_task, &ctx);
+    }
+    free(counts);
+    return 0;
+}
+
+#endif // RADIX_SORT_H
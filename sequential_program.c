@@ -4,172 +4,599 @@
 #include <string.h>
 #include <time.h>
 
-#define X_SIZE 1024
-#define Y_SIZE 1024
-#define Z_SIZE 314
-
-#define TOTAL_VOXELS ((size_t)X_SIZE * Y_SIZE * Z_SIZE)
-#define THRESHOLD 25
-#define BITS_PER_COORD 10
-
-// Function to compare uint32_t values for qsort
-int compare_uint32(const void *a, const void *b) {
-    uint32_t arg1 = *(const uint32_t *)a;
-    uint32_t arg2 = *(const uint32_t *)b;
-    if (arg1 < arg2) return -1;
-    if (arg1 > arg2) return 1;
+#include "arena.h"
+#include "code_file.h"
+#include "external_sort.h"
+#include "frame_state.h"
+#include "morton.h"
+#include "octree.h"
+#include "radix_sort.h"
+#include "stage_timer.h"
+#include "volume_config.h"
+#include "volume_loader.h"
+
+// Collects the report and writes the output file while the sorted codes
+// stream past, so the out-of-core mode never needs them all in memory. The
+// octree builder, if any, takes the codes in the same pass.
+typedef struct {
+    code_writer_t *writer;
+    octree_builder_t *octree;
+    double octree_seconds;
+    size_t count;
+    morton_key_t head[10];
+    morton_key_t prev;
+    int is_sorted;
+    uint32_t min_x, min_y, min_z;
+    uint32_t max_x, max_y, max_z;
+} code_sink_t;
+
+void sink_init(code_sink_t *sink, const volume_config_t *cfg, code_writer_t *writer) {
+    *sink = (code_sink_t){.writer = writer,
+                          .is_sorted = 1,
+                          .min_x = cfg->x_size,
+                          .min_y = cfg->y_size,
+                          .min_z = cfg->z_size};
+}
+
+int sink_emit(void *arg, const morton_key_t *codes, size_t n) {
+    code_sink_t *sink = (code_sink_t *)arg;
+    for (size_t i = 0; i < n; ++i) {
+        morton_key_t code = codes[i];
+        size_t index = sink->count++;
+        if (index < 10) {
+            sink->head[index] = code;
+        }
+        if (index > 0 && sink->prev > code && sink->is_sorted) {
+            sink->is_sorted = 0;
+            fprintf(stderr, "Array is not sorted at index %zu\n", index);
+        }
+        sink->prev = code;
+
+        // Track coordinate ranges by decoding the extracted codes
+        uint32_t x, y, z;
+        morton_decode(code, &x, &y, &z);
+        if (x < sink->min_x) sink->min_x = x;
+        if (x > sink->max_x) sink->max_x = x;
+        if (y < sink->min_y) sink->min_y = y;
+        if (y > sink->max_y) sink->max_y = y;
+        if (z < sink->min_z) sink->min_z = z;
+        if (z > sink->max_z) sink->max_z = z;
+    }
+    if (sink->writer) {
+        code_writer_put(sink->writer, codes, n);
+    }
+    if (sink->octree) {
+        double t = pool_now();
+        octree_push(sink->octree, codes, n);
+        sink->octree_seconds += pool_now() - t;
+    }
     return 0;
 }
 
-// Function to interleave bits for Morton code
-uint32_t expand_bits(uint32_t x) {
-    x &= 0x3FF; // Ensure x is 10 bits
-    x = (x | (x << 16)) & 0x30000FF;
-    x = (x | (x << 8))  & 0x300F00F;
-    x = (x | (x << 4))  & 0x30C30C3;
-    x = (x | (x << 2))  & 0x9249249;
-    return x;
+// Parses a byte count with an optional K, M or G suffix
+int parse_size(const char *text, size_t *value) {
+    char *end;
+    unsigned long long v = strtoull(text, &end, 10);
+    if (end == text) return -1;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || v == 0) return -1;
+    *value = (size_t)v;
+    return 0;
 }
 
-// Function to compute Morton code from x, y, z
-uint32_t morton_encode(uint32_t x, uint32_t y, uint32_t z) {
-    return expand_bits(x) | (expand_bits(y) << 1) | (expand_bits(z) << 2);
+// Out-of-core extraction and sort. The volume streams through the loader
+// ring, codes collect in a run buffer that is sorted and spilled whenever it
+// fills, and the spilled runs are merged straight into the sink. Peak
+// memory is the ring plus the run buffer and its sort buffer, all sized
+// from memory_limit. Sorting and spilling runs is charged to the sort
+// stage; the final merge streams into the output and is the merge stage.
+int sort_out_of_core(const volume_config_t *cfg, const morton_kernel_t *kernel, const morton_grid_t *grid,
+                     size_t memory_limit, const char *tmp_dir, code_sink_t *sink, stage_timer_t *timer) {
+    size_t total_voxels = volume_total_voxels(cfg);
+    size_t slab = volume_slab_voxels(cfg);
+
+    // A sixteenth of the budget goes to the input ring, the rest to codes
+    size_t block_bytes = memory_limit / (16 * LOADER_NUM_BUFFERS);
+    if (block_bytes > LOADER_BLOCK_BYTES) block_bytes = LOADER_BLOCK_BYTES;
+    block_bytes = block_bytes >= slab ? block_bytes / slab * slab : block_bytes;
+    if (block_bytes == 0) block_bytes = 1;
+    size_t ring_bytes = block_bytes * LOADER_NUM_BUFFERS;
+    size_t capacity = ring_bytes < memory_limit ? (memory_limit - ring_bytes) / (2 * sizeof(morton_key_t)) : 0;
+    if (capacity < 4 * SPILL_MIN_BUFFER_KEYS) {
+        fprintf(stderr, "Error: Memory limit of %zu bytes is too small\n", memory_limit);
+        return -1;
+    }
+
+    morton_key_t *codes = malloc(capacity * sizeof(morton_key_t));
+    morton_key_t *tmp = malloc(capacity * sizeof(morton_key_t));
+    if (!codes || !tmp) {
+        fprintf(stderr, "Error: Failed to allocate run buffers\n");
+        free(codes);
+        free(tmp);
+        return -1;
+    }
+
+    spill_file_t spill = {.fd = -1};
+    volume_loader_t loader;
+    if (loader_open(&loader, cfg->path, 0, total_voxels, block_bytes, LOADER_NUM_BUFFERS, NULL) != 0) {
+        free(codes);
+        free(tmp);
+        return -1;
+    }
+
+    int rc = 0;
+    size_t count = 0;
+    const uint8_t *data;
+    size_t data_start, data_len;
+    int load_rc;
+    double scan_begin = stage_begin();
+    double spill_seconds = 0.0;
+    while (rc == 0 && (load_rc = loader_next(&loader, &data, &data_start, &data_len)) == 1) {
+        size_t piece = slab < capacity ? slab : capacity;
+        for (size_t offset = 0; offset < data_len && rc == 0; offset += piece) {
+            size_t len = data_len - offset < piece ? data_len - offset : piece;
+
+            // Spill only when the exact count of this piece does not fit
+            if (count + len > capacity && count + kernel->count(data + offset, len, cfg->threshold) > capacity) {
+                double spill_begin = stage_begin();
+                radix_sort_keys(codes, tmp, count, grid->key_bits);
+                if ((spill.fd < 0 && spill_open(&spill, tmp_dir) != 0) || spill_write_run(&spill, codes, count) != 0) {
+                    rc = -1;
+                    break;
+                }
+                count = 0;
+                spill_seconds += stage_begin() - spill_begin;
+            }
+            count += kernel->scan(grid, data + offset, len, data_start + offset, cfg->threshold, codes + count);
+        }
+        loader_release(&loader);
+    }
+    // Input waits and spills happened inside the scan loop
+    stage_add(timer, STAGE_LOAD, loader.wait_time);
+    stage_add(timer, STAGE_SORT, spill_seconds);
+    stage_end(timer, STAGE_SCAN, scan_begin + loader.wait_time + spill_seconds);
+    if (loader_close(&loader) != 0 || load_rc < 0) {
+        fprintf(stderr, "Error: Failed to read data from %s\n", cfg->path);
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        double t = stage_begin();
+        radix_sort_keys(codes, tmp, count, grid->key_bits);
+        if (spill.fd < 0) {
+            // Everything fitted in one run: no need to touch the disk
+            stage_end(timer, STAGE_SORT, t);
+            t = stage_begin();
+            rc = sink_emit(sink, codes, count);
+            stage_end(timer, STAGE_WRITE, t + sink->octree_seconds);
+            printf("Spilled runs: 0\n");
+        } else if (spill_write_run(&spill, codes, count) != 0) {
+            rc = -1;
+        } else {
+            stage_end(timer, STAGE_SORT, t);
+
+            // The merge only needs the code buffer
+            size_t num_runs = spill.num_runs;
+            free(tmp);
+            tmp = NULL;
+            t = stage_begin();
+            rc = spill_merge(&spill, codes, capacity, sink_emit, sink);
+            stage_end(timer, STAGE_MERGE, t + sink->octree_seconds);
+            printf("Spilled runs: %zu (%zu merge rounds)\n", num_runs, spill.merge_rounds);
+        }
+    }
+    spill_close(&spill);
+    free(codes);
+    free(tmp);
+    return rc;
+}
+
+// Writes one sorted code set to path
+int write_code_set(const char *path, code_format_t format, const volume_config_t *cfg, int key_bits,
+                   const morton_key_t *codes, size_t n) {
+    code_writer_t writer;
+    if (code_writer_open(&writer, path, format, key_bits, 0) != 0) {
+        return -1;
+    }
+    code_writer_put(&writer, codes, n);
+    code_file_header_t header = code_file_header(cfg, key_bits);
+    return code_writer_close(&writer, &header) != 0 ? -1 : 0;
+}
+
+// One frame of a time series. Every slab is read and checksummed, but only
+// slabs whose checksum differs from the previous frame's are scanned; their
+// codes are sorted and patched into the previous frame's sorted codes, and
+// the codes that appeared and disappeared are written as a delta. Without a
+// usable previous state every slab counts as changed. The new codes go to
+// the sink and, with the checksums, to state_path for the next frame.
+int run_frame(const volume_config_t *cfg, const morton_kernel_t *kernel, const morton_grid_t *grid,
+              const char *state_path, code_format_t format, code_sink_t *sink, stage_timer_t *timer,
+              double *total_time) {
+    size_t total_voxels = volume_total_voxels(cfg);
+    size_t slab = volume_slab_voxels(cfg);
+    frame_state_t prev;
+    double t = stage_begin();
+    int have_prev = frame_state_load(state_path, cfg, grid->key_bits, &prev);
+    stage_end(timer, STAGE_LOAD, t);
+    if (have_prev < 0) {
+        return -1;
+    }
+
+    // The fresh codes are bounded by the volume, the new set by the volume
+    // too, and the removed codes by the previous frame; pages are only
+    // backed as they are written
+    size_t bound = total_voxels * sizeof(morton_key_t);
+    size_t sizes[5] = {bound, bound, bound, bound, prev.count * sizeof(morton_key_t)};
+    arena_t arena;
+    uint64_t *checksums = malloc(cfg->z_size * sizeof(uint64_t));
+    uint8_t *dirty = calloc(cfg->z_size, 1);
+    if (!checksums || !dirty || arena_init(&arena, arena_size(sizes, 5), ARENA_NORESERVE) != 0) {
+        fprintf(stderr, "Error: Failed to allocate frame buffers\n");
+        free(checksums);
+        free(dirty);
+        frame_state_free(&prev);
+        return -1;
+    }
+    morton_key_t *fresh = arena_alloc(&arena, sizes[0]);
+    morton_key_t *sort_buffer = arena_alloc(&arena, sizes[1]);
+    morton_key_t *codes = arena_alloc(&arena, sizes[2]);
+    morton_key_t *added = arena_alloc(&arena, sizes[3]);
+    morton_key_t *removed = arena_alloc(&arena, sizes[4]);
+
+    volume_loader_t loader;
+    if (loader_open(&loader, cfg->path, 0, total_voxels, loader_slab_block_bytes(slab), LOADER_NUM_BUFFERS, NULL) !=
+        0) {
+        arena_destroy(&arena);
+        free(checksums);
+        free(dirty);
+        frame_state_free(&prev);
+        return -1;
+    }
+    const uint8_t *data;
+    size_t data_start, data_len;
+    int load_rc;
+    size_t num_fresh = 0;
+    uint32_t num_dirty = 0;
+    t = stage_begin();
+    while ((load_rc = loader_next(&loader, &data, &data_start, &data_len)) == 1) {
+        for (size_t offset = 0; offset < data_len; offset += slab) {
+            size_t len = data_len - offset < slab ? data_len - offset : slab;
+            size_t z = (data_start + offset) / slab;
+            checksums[z] = frame_checksum(data + offset, len);
+            if (have_prev == 1 && checksums[z] == prev.checksums[z]) {
+                continue;
+            }
+            dirty[z] = 1;
+            num_dirty++;
+            num_fresh += kernel->scan(grid, data + offset, len, data_start + offset, cfg->threshold, fresh + num_fresh);
+        }
+        loader_release(&loader);
+    }
+    stage_add(timer, STAGE_LOAD, loader.wait_time);
+    stage_end(timer, STAGE_SCAN, t + loader.wait_time);
+    int rc = 0;
+    if (loader_close(&loader) != 0 || load_rc < 0) {
+        fprintf(stderr, "Error: Failed to read data from %s\n", cfg->path);
+        rc = -1;
+    }
+
+    size_t count = 0, num_added = 0, num_removed = 0;
+    if (rc == 0) {
+        t = stage_begin();
+        radix_sort_keys(fresh, sort_buffer, num_fresh, grid->key_bits);
+        stage_end(timer, STAGE_SORT, t);
+        t = stage_begin();
+        frame_patch(prev.codes, prev.count, fresh, num_fresh, dirty, codes, &count, added, &num_added, removed,
+                    &num_removed);
+        stage_end(timer, STAGE_MERGE, t);
+        *total_time = stage_total(timer);
+
+        t = stage_begin();
+        rc = sink_emit(sink, codes, count);
+        stage_end(timer, STAGE_WRITE, t + sink->octree_seconds);
+        t = stage_begin();
+        char path[64];
+        const char *ext = code_format_extension(format);
+        snprintf(path, sizeof(path), "morton_added_seq.%s", ext);
+        if (write_code_set(path, format, cfg, grid->key_bits, added, num_added) != 0) {
+            fprintf(stderr, "Error: Failed to write %s\n", path);
+            rc = -1;
+        }
+        snprintf(path, sizeof(path), "morton_removed_seq.%s", ext);
+        if (write_code_set(path, format, cfg, grid->key_bits, removed, num_removed) != 0) {
+            fprintf(stderr, "Error: Failed to write %s\n", path);
+            rc = -1;
+        }
+        if (rc == 0 && frame_state_save(state_path, cfg, grid->key_bits, checksums, codes, count) != 0) {
+            fprintf(stderr, "Error: Failed to write %s\n", state_path);
+            rc = -1;
+        }
+        stage_end(timer, STAGE_WRITE, t);
+    }
+
+    if (rc == 0) {
+        printf("Frame: %u of %u slabs changed (%s), %zu codes added, %zu removed\n", num_dirty, cfg->z_size,
+               have_prev == 1 ? "patched previous frame" : "no previous frame, full rebuild", num_added,
+               num_removed);
+        printf("Delta saved to morton_added_seq.%s and morton_removed_seq.%s\n", code_format_extension(format),
+               code_format_extension(format));
+    }
+    arena_destroy(&arena);
+    free(checksums);
+    free(dirty);
+    frame_state_free(&prev);
+    return rc;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --bench-encode     compare the encode kernels instead of running the pipeline\n");
+    printf("  --memory-limit N   sort out of core within about N bytes (K, M, G suffixes)\n");
+    printf("  --tmp-dir DIR      directory for spilled runs (default $TMPDIR or /tmp)\n");
+    printf("  --format FMT       text (default), fixed (zero-padded text) or binary\n");
+    printf("  --json PATH        write per-stage timings as JSON (- for stdout;\n");
+    printf("                     the report then goes to stderr)\n");
+    printf("  --perf             count cycles, instructions and cache, branch and TLB misses per stage\n");
+    printf("  --octree           also build the linear octree of the active voxels (octree_seq.bin)\n");
+    printf("  --frame-state PATH time-series frame: rescan only slabs changed since the frame saved in PATH,\n");
+    printf("                     write the added and removed codes and save this frame to PATH\n");
+    volume_config_usage(stdout);
 }
 
 int main(int argc, char *argv[]) {
-    // Allocate data[]
-    uint8_t *data = malloc(TOTAL_VOXELS * sizeof(uint8_t));
-    if (!data) {
-        fprintf(stderr, "Error: Failed to allocate data array\n");
+    volume_config_t cfg;
+    volume_config_defaults(&cfg);
+    int bench_encode = 0;
+    size_t memory_limit = 0;
+    const char *tmp_dir = NULL;
+    code_format_t format = CODE_FORMAT_TEXT;
+    const char *json_path = NULL;
+    int perf = 0;
+    int build_octree = 0;
+    const char *frame_state = NULL;
+    for (int i = 1; i < argc; ++i) {
+        int rc = volume_config_parse_arg(&cfg, argc, argv, &i);
+        if (rc < 0) {
+            return 1;
+        } else if (rc == 0 && strcmp(argv[i], "--bench-encode") == 0) {
+            bench_encode = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &memory_limit) != 0) {
+                fprintf(stderr, "Error: Invalid memory limit %s\n", argv[i]);
+                return 1;
+            }
+        } else if (rc == 0 && strcmp(argv[i], "--tmp-dir") == 0 && i + 1 < argc) {
+            tmp_dir = argv[++i];
+        } else if (rc == 0 && strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (rc == 0 && strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--octree") == 0) {
+            build_octree = 1;
+        } else if (rc == 0 && strcmp(argv[i], "--frame-state") == 0 && i + 1 < argc) {
+            frame_state = argv[++i];
+        } else if (rc == 0 && strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (code_format_parse(argv[++i], &format) != 0) {
+                return 1;
+            }
+        } else if (rc == 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (volume_config_check(&cfg) != 0) {
         return 1;
     }
-
-    // Read c8.raw
-    FILE *fp = fopen("c8.raw", "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Failed to open c8.raw\n");
-        free(data);
+    if (frame_state && memory_limit > 0) {
+        fprintf(stderr, "Error: --frame-state keeps the codes in memory and cannot be used with --memory-limit\n");
         return 1;
     }
-    size_t items_read = fread(data, sizeof(uint8_t), TOTAL_VOXELS, fp);
-    fclose(fp);
-    if (items_read != TOTAL_VOXELS) {
-        fprintf(stderr, "Error: Failed to read data from c8.raw\n");
-        free(data);
+    // With --json -, stdout carries only the JSON report
+    if (json_path && strcmp(json_path, "-") == 0 && stage_json_claim_stdout() != 0) {
         return 1;
     }
+    size_t total_voxels = volume_total_voxels(&cfg);
+    // Voxels handed to the scan kernel at once (one z-slab)
+    size_t scan_block = volume_slab_voxels(&cfg);
 
-    // Timing starts here
-    clock_t start_time = clock();
-
-    // Initialize morton_codes[]
-    size_t max_codes = 1000000; // Initial size, will expand as needed
-    uint32_t *morton_codes = malloc(max_codes * sizeof(uint32_t));
-    if (!morton_codes) {
-        fprintf(stderr, "Error: Failed to allocate morton_codes array\n");
+    // Compare the encode kernels instead of running the pipeline
+    if (bench_encode) {
+        uint8_t *data = malloc(total_voxels * sizeof(uint8_t));
+        if (!data) {
+            fprintf(stderr, "Error: Failed to allocate data array\n");
+            return 1;
+        }
+        if (loader_read_all(cfg.path, 0, total_voxels, data) != 0) {
+            free(data);
+            return 1;
+        }
+        morton_grid_t bench_grid = morton_grid(cfg.x_size, cfg.y_size, cfg.z_size);
+        int rc = morton_benchmark(&bench_grid, data, total_voxels, 0, cfg.threshold, 3);
         free(data);
-        return 1;
+        return rc == 0 ? 0 : 1;
     }
-    size_t code_count = 0;
-
-    // Variables to track coordinate ranges
-    uint32_t min_x = X_SIZE, min_y = Y_SIZE, min_z = Z_SIZE;
-    uint32_t max_x = 0, max_y = 0, max_z = 0;
-
-    // Process data
-    for (size_t i = 0; i < TOTAL_VOXELS; ++i) {
-        uint8_t value = data[i];
-        if (value > THRESHOLD) {
-            // Compute x, y, z from index i
-            size_t idx = i;
-            uint32_t x = idx % X_SIZE;
-            idx /= X_SIZE;
-            uint32_t y = idx % Y_SIZE;
-            uint32_t z = idx / Y_SIZE;
-
-            // Update min and max coordinates
-            if (x < min_x) min_x = x;
-            if (x > max_x) max_x = x;
-            if (y < min_y) min_y = y;
-            if (y > max_y) max_y = y;
-            if (z < min_z) min_z = z;
-            if (z > max_z) max_z = z;
-
-            uint32_t morton_code = morton_encode(x, y, z);
-
-            // Check if morton_codes[] needs to be reallocated
-            if (code_count >= max_codes) {
-                size_t new_size = max_codes * 2;
-                uint32_t *new_array = realloc(morton_codes, new_size * sizeof(uint32_t));
-                if (!new_array) {
-                    fprintf(stderr, "Error: Failed to reallocate morton_codes array\n");
-                    free(morton_codes);
-                    free(data);
-                    return 1;
-                }
-                morton_codes = new_array;
-                max_codes = new_size;
+
+    // Timing starts here; loading overlaps the scan, so it is included
+    stage_timer_t timer;
+    stage_timer_init(&timer);
+    if (perf && stage_timer_enable_perf(&timer) == 0) {
+        fprintf(stderr, "Warning: No hardware counters available (no PMU or perf_event_paranoid > 2)\n");
+    }
+    const morton_kernel_t *kernel = morton_select_kernel();
+    morton_grid_t grid = morton_grid(cfg.x_size, cfg.y_size, cfg.z_size);
+
+    // The sink writes the output file as the sorted codes pass through it
+    char out_path[64];
+    snprintf(out_path, sizeof(out_path), "morton_codes_seq.%s", code_format_extension(format));
+    code_writer_t writer;
+    int have_writer = code_writer_open(&writer, out_path, format, grid.key_bits, 0) == 0;
+    code_sink_t sink;
+    sink_init(&sink, &cfg, have_writer ? &writer : NULL);
+    int num_levels = octree_num_levels(grid.key_bits);
+    octree_builder_t octree_builder;
+    if (build_octree) {
+        octree_builder_init(&octree_builder, 0, num_levels - 1);
+        sink.octree = &octree_builder;
+    }
+    double total_time;
+    const char *buffer_pages = NULL;
+
+    if (frame_state) {
+        if (run_frame(&cfg, kernel, &grid, frame_state, format, &sink, &timer, &total_time) != 0) {
+            if (have_writer) code_writer_close(&writer, NULL);
+            return 1;
+        }
+    } else if (memory_limit > 0) {
+        // Out of core: the merge feeds the sink, so output is part of the timing
+        if (sort_out_of_core(&cfg, kernel, &grid, memory_limit, tmp_dir, &sink, &timer) != 0) {
+            if (have_writer) code_writer_close(&writer, NULL);
+            return 1;
+        }
+        total_time = stage_total(&timer);
+    } else {
+        // Every voxel could be active, so the codes and the sort buffer get
+        // that much address space up front; only pages the scan and sort
+        // touch are backed, and nothing is ever reallocated or copied
+        size_t bound = total_voxels * sizeof(morton_key_t);
+        size_t sizes[2] = {bound, bound};
+        arena_t arena;
+        if (arena_init(&arena, arena_size(sizes, 2), ARENA_NORESERVE) != 0) {
+            fprintf(stderr, "Error: Failed to reserve %zu bytes for Morton codes (try --memory-limit)\n",
+                    arena_size(sizes, 2));
+            return 1;
+        }
+        morton_key_t *morton_codes = arena_alloc(&arena, bound);
+        size_t code_count = 0;
+
+        // Stream the volume through a ring of slab-aligned buffers; a reader
+        // thread loads the next blocks while this one scans
+        volume_loader_t loader;
+        if (loader_open(&loader, cfg.path, 0, total_voxels, loader_slab_block_bytes(scan_block), LOADER_NUM_BUFFERS,
+                        NULL) != 0) {
+            arena_destroy(&arena);
+            return 1;
+        }
+
+        // Process data one slab at a time with the best kernel for this CPU
+        const uint8_t *data;
+        size_t data_start, data_len;
+        int load_rc;
+        double t = stage_begin();
+        while ((load_rc = loader_next(&loader, &data, &data_start, &data_len)) == 1) {
+            for (size_t offset = 0; offset < data_len; offset += scan_block) {
+                size_t block_len = data_len - offset < scan_block ? data_len - offset : scan_block;
+                code_count += kernel->scan(&grid, data + offset, block_len, data_start + offset, cfg.threshold,
+                                           morton_codes + code_count);
             }
-            morton_codes[code_count++] = morton_code;
+            loader_release(&loader);
+        }
+        // Time spent waiting for input is load, the rest of the loop is scan
+        stage_add(&timer, STAGE_LOAD, loader.wait_time);
+        stage_end(&timer, STAGE_SCAN, t + loader.wait_time);
+        if (loader_close(&loader) != 0 || load_rc < 0) {
+            fprintf(stderr, "Error: Failed to read data from %s\n", cfg.path);
+            arena_destroy(&arena);
+            return 1;
         }
+
+        // Sort morton_codes[]
+        t = stage_begin();
+        morton_key_t *sort_buffer = arena_alloc(&arena, code_count * sizeof(morton_key_t));
+        radix_sort_keys(morton_codes, sort_buffer, code_count, grid.key_bits);
+        stage_end(&timer, STAGE_SORT, t);
+
+        // Timing ends here
+        total_time = stage_total(&timer);
+
+        t = stage_begin();
+        sink_emit(&sink, morton_codes, code_count);
+        stage_end(&timer, STAGE_WRITE, t + sink.octree_seconds);
+        buffer_pages = arena_backing_name(&arena);
+        arena_destroy(&arena);
     }
 
-    // Sort morton_codes[]
-    qsort(morton_codes, code_count, sizeof(uint32_t), compare_uint32);
+    double t = stage_begin();
+    code_file_header_t header = code_file_header(&cfg, grid.key_bits);
+    int write_ok = have_writer && code_writer_close(&writer, &header) == 0;
+    stage_end(&timer, STAGE_WRITE, t);
 
-    // Timing ends here
-    clock_t end_time = clock();
-    double total_time = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+    // The octree was built while the codes streamed into the sink, and the
+    // stage that emitted them left that time out
+    octree_t octree = {0};
+    int octree_rc = 0;
+    if (build_octree) {
+        t = stage_begin();
+        octree_rc = octree_builder_finish(&octree_builder);
+        if (octree_rc == 0) {
+            octree_rc = octree_from_builder(&octree, &octree_builder, num_levels);
+        }
+        octree_builder_free(&octree_builder);
+        stage_end(&timer, STAGE_OCTREE, t);
+        stage_add(&timer, STAGE_OCTREE, sink.octree_seconds);
+    }
 
     // Output number of active voxels
-    printf("Number of active voxels: %zu\n", code_count);
+    printf("Number of active voxels: %zu\n", sink.count);
+    printf("Scan kernel: %s\n", kernel->name);
+    if (buffer_pages) printf("Code buffers: %s\n", buffer_pages);
 
     // Output coordinate ranges
     printf("Coordinate ranges:\n");
-    printf("X: min = %u, max = %u\n", min_x, max_x);
-    printf("Y: min = %u, max = %u\n", min_y, max_y);
-    printf("Z: min = %u, max = %u\n", min_z, max_z);
+    printf("X: min = %u, max = %u\n", sink.min_x, sink.max_x);
+    printf("Y: min = %u, max = %u\n", sink.min_y, sink.max_y);
+    printf("Z: min = %u, max = %u\n", sink.min_z, sink.max_z);
 
     // Output first 10 Morton codes
     printf("First 10 Morton codes:\n");
-    for (size_t i = 0; i < 10 && i < code_count; ++i) {
-        uint32_t morton_code = morton_codes[i];
-        printf("%u\n", morton_code);
+    for (size_t i = 0; i < 10 && i < sink.count; ++i) {
+        morton_key_t morton_code = sink.head[i];
+        printf("%" PRImorton "\n", morton_code);
     }
 
-    // Verify if morton_codes[] is sorted
-    int is_sorted = 1;
-    for (size_t i = 1; i < code_count; ++i) {
-        if (morton_codes[i - 1] > morton_codes[i]) {
-            is_sorted = 0;
-            fprintf(stderr, "Array is not sorted at index %zu\n", i);
-            break;
-        }
-    }
-    if (is_sorted) {
+    if (sink.is_sorted) {
         printf("Morton codes are correctly sorted.\n");
     } else {
         printf("Morton codes are NOT correctly sorted.\n");
     }
 
-    // Save Morton codes to file
-    FILE *out_fp = fopen("morton_codes_seq.txt", "w");
-    if (out_fp) {
-        for (size_t i = 0; i < code_count; ++i) {
-            fprintf(out_fp, "%u\n", morton_codes[i]);
-        }
-        fclose(out_fp);
-        printf("Morton codes saved to morton_codes_seq.txt\n");
+    if (write_ok) {
+        printf("Morton codes saved to %s\n", out_path);
     } else {
-        fprintf(stderr, "Error: Failed to open output file for writing.\n");
+        fprintf(stderr, "Error: Failed to write %s\n", out_path);
+    }
+
+    if (build_octree) {
+        if (octree_rc == 0) {
+            octree_print_summary(&octree, stdout);
+        }
+        if (octree_rc != 0 || octree_write("octree_seq.bin", &octree, &cfg, grid.key_bits) != 0) {
+            fprintf(stderr, "Error: Failed to build or write octree_seq.bin\n");
+        } else {
+            printf("Octree saved to octree_seq.bin\n");
+        }
+        octree_free(&octree);
     }
 
     // Output processing time
     printf("Processing time (sequential): %f seconds\n", total_time);
+    printf("Time spent waiting for input: %f seconds\n", timer.seconds[STAGE_LOAD]);
 
-    // Free resources
-    free(morton_codes);
-    free(data);
+    if (perf) {
+        uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS];
+        stage_perf_totals(&timer, totals);
+        stage_print_perf(totals, stdout);
+    }
 
-    return 0;
+    int rc = 0;
+    if (json_path && stage_timer_write_json(json_path, &timer, "sequential", 1, &cfg, kernel->name, sink.count, NULL,
+                                            NULL, 0, NULL) != 0) {
+        rc = 1;
+    }
+    stage_timer_free(&timer);
+    return rc;
 }
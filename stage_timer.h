@@ -0,0 +1,305 @@
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf_counters.h"
+#include "thread_pool.h"
+#include "volume_config.h"
+
+// Wall-clock time per pipeline stage, on the monotonic clock. Stages run
+// one after another on the calling thread; stage_begin returns a start
+// stamp and stage_end adds the time since then to the stage. With a pool
+// attached, stage_end also charges each worker's busy time since the
+// previous stage_end to the stage, which gives the per-thread breakdown.
+// With counters enabled, stage_end charges hardware counter deltas the
+// same way, for the calling thread and every pool worker.
+
+typedef enum {
+    STAGE_LOAD,     // waiting for input that the scan could not overlap
+    STAGE_SCAN,     // thresholding and Morton encoding
+    STAGE_COMBINE,  // prefix sums, allocation, result summaries
+    STAGE_SORT,     // sorting runs
+    STAGE_EXCHANGE, // moving codes between ranks
+    STAGE_MERGE,    // merging sorted runs
+    STAGE_OCTREE,   // building the linear octree
+    STAGE_LABEL,    // labeling connected components
+    STAGE_WRITE,    // writing the output file
+    STAGE_COUNT
+} stage_id_t;
+
+static const char *const stage_names[STAGE_COUNT] = {"load",  "scan",   "combine", "sort", "exchange",
+                                                     "merge", "octree", "label",   "write"};
+
+typedef struct {
+    double start;
+    double seconds[STAGE_COUNT];
+    thread_pool_t *pool;
+    double *worker_seconds; // num_threads x STAGE_COUNT
+    double *worker_mark;    // busy time of each worker at the last stage_end
+    int perf_threads;       // 0 when counters are off; else calling thread + workers
+    perf_thread_t *perf;
+    uint64_t *perf_counts; // perf_threads x STAGE_COUNT x PERF_NUM_EVENTS
+    uint64_t *perf_mark;   // perf_threads x PERF_NUM_EVENTS at the last stage_end
+} stage_timer_t;
+
+static inline void stage_timer_init(stage_timer_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->start = pool_now();
+}
+
+static inline void stage_timer_attach_pool(stage_timer_t *st, thread_pool_t *pool) {
+    st->pool = pool;
+    st->worker_seconds = calloc((size_t)pool->num_threads * STAGE_COUNT, sizeof(double));
+    st->worker_mark = calloc(pool->num_threads, sizeof(double));
+    if (!st->worker_seconds || !st->worker_mark) {
+        free(st->worker_seconds);
+        free(st->worker_mark);
+        st->worker_seconds = st->worker_mark = NULL;
+        st->pool = NULL;
+        return;
+    }
+    for (int i = 0; i < pool->num_threads; ++i) {
+        st->worker_mark[i] = pool->workers[i].busy_time;
+    }
+}
+
+// Opens counters for the calling thread and, if a pool is attached, for
+// each of its workers. Returns the number of events available on the
+// calling thread; the stages still get timed when that is zero.
+static inline int stage_timer_enable_perf(stage_timer_t *st) {
+    int n = 1 + (st->pool ? st->pool->num_threads : 0);
+    st->perf = malloc(n * sizeof(perf_thread_t));
+    st->perf_counts = calloc((size_t)n * STAGE_COUNT * PERF_NUM_EVENTS, sizeof(uint64_t));
+    st->perf_mark = malloc((size_t)n * PERF_NUM_EVENTS * sizeof(uint64_t));
+    if (!st->perf || !st->perf_counts || !st->perf_mark) {
+        free(st->perf);
+        free(st->perf_counts);
+        free(st->perf_mark);
+        st->perf = NULL;
+        st->perf_counts = st->perf_mark = NULL;
+        return 0;
+    }
+    int available = perf_thread_open(&st->perf[0], 0);
+    for (int i = 1; i < n; ++i) {
+        perf_thread_open(&st->perf[i], st->pool->workers[i - 1].tid);
+    }
+    for (int i = 0; i < n; ++i) {
+        perf_thread_read(&st->perf[i], st->perf_mark + i * PERF_NUM_EVENTS);
+    }
+    st->perf_threads = n;
+    return available;
+}
+
+static inline double stage_begin(void) {
+    return pool_now();
+}
+
+static inline void stage_add(stage_timer_t *st, stage_id_t stage, double seconds) {
+    st->seconds[stage] += seconds;
+}
+
+static inline void stage_end(stage_timer_t *st, stage_id_t stage, double begin) {
+    st->seconds[stage] += pool_now() - begin;
+    if (st->pool) {
+        for (int i = 0; i < st->pool->num_threads; ++i) {
+            double busy = st->pool->workers[i].busy_time;
+            st->worker_seconds[i * STAGE_COUNT + stage] += busy - st->worker_mark[i];
+            st->worker_mark[i] = busy;
+        }
+    }
+    for (int i = 0; i < st->perf_threads; ++i) {
+        uint64_t now[PERF_NUM_EVENTS];
+        uint64_t *mark = st->perf_mark + i * PERF_NUM_EVENTS;
+        uint64_t *acc = st->perf_counts + ((size_t)i * STAGE_COUNT + stage) * PERF_NUM_EVENTS;
+        perf_thread_read(&st->perf[i], now);
+        for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+            if (now[e] == PERF_COUNT_NONE || mark[e] == PERF_COUNT_NONE) {
+                acc[e] = PERF_COUNT_NONE;
+            } else if (acc[e] != PERF_COUNT_NONE) {
+                acc[e] += now[e] - mark[e];
+            }
+            mark[e] = now[e];
+        }
+    }
+}
+
+// Per-stage counts summed over every measured thread
+static inline void stage_perf_totals(const stage_timer_t *st, uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS]) {
+    memset(totals, 0, STAGE_COUNT * PERF_NUM_EVENTS * sizeof(uint64_t));
+    for (int i = 0; i < st->perf_threads; ++i) {
+        for (int s = 0; s < STAGE_COUNT; ++s) {
+            perf_counts_add(totals + s * PERF_NUM_EVENTS,
+                            st->perf_counts + ((size_t)i * STAGE_COUNT + s) * PERF_NUM_EVENTS);
+        }
+    }
+}
+
+static inline void stage_print_perf(const uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS], FILE *fp) {
+    fprintf(fp, "Hardware counters per stage:\n");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        perf_print_stage(fp, stage_names[s], totals + s * PERF_NUM_EVENTS);
+    }
+}
+
+static inline double stage_total(const stage_timer_t *st) {
+    double total = 0.0;
+    for (int s = 0; s < STAGE_COUNT; ++s) total += st->seconds[s];
+    return total;
+}
+
+static inline void stage_timer_free(stage_timer_t *st) {
+    free(st->worker_seconds);
+    free(st->worker_mark);
+    st->worker_seconds = st->worker_mark = NULL;
+    for (int i = 0; i < st->perf_threads; ++i) {
+        perf_thread_close(&st->perf[i]);
+    }
+    free(st->perf);
+    free(st->perf_counts);
+    free(st->perf_mark);
+    st->perf = NULL;
+    st->perf_counts = st->perf_mark = NULL;
+    st->perf_threads = 0;
+}
+
+static inline void stage_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(fp, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static inline void stage_json_stages(FILE *fp, const double *seconds) {
+    fprintf(fp, "{");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        fprintf(fp, "%s\"%s\": %.6f", s ? ", " : "", stage_names[s], seconds[s]);
+    }
+    fprintf(fp, "}");
+}
+
+static inline void stage_json_counters(FILE *fp, const uint64_t *counts) {
+    fprintf(fp, "{");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        fprintf(fp, "%s\"%s\": ", s ? ", " : "", stage_names[s]);
+        perf_json_counts(fp, counts + s * PERF_NUM_EVENTS);
+    }
+    fprintf(fp, "}");
+}
+
+// The stream "--json -" writes to, once stage_json_claim_stdout has moved
+// everything else off stdout
+static FILE *stage_json_stdout = NULL;
+
+// Keeps stdout for the JSON report alone: the program's own stdout output
+// goes to stderr from here on, so the JSON can be piped into a parser.
+// Call it before printing anything. Returns 0, or -1 if stdout could not
+// be duplicated.
+static inline int stage_json_claim_stdout(void) {
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!fp || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        if (fp) {
+            fclose(fp);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        fprintf(stderr, "Error: Failed to set stdout aside for the JSON report\n");
+        return -1;
+    }
+    stage_json_stdout = fp;
+    return 0;
+}
+
+// Writes one JSON report to path ("-" for stdout, see
+// stage_json_claim_stdout). rank_seconds and
+// rank_counts hold num_ranks rows for the MPI engine and are NULL
+// otherwise; the per-thread section comes from the attached pool.
+// rank_perf, when the ranks collected counters, holds num_ranks x
+// STAGE_COUNT x PERF_NUM_EVENTS counts and replaces the timer's own.
+static inline int stage_timer_write_json(const char *path, const stage_timer_t *st, const char *engine,
+                                         int workers, const volume_config_t *cfg, const char *kernel,
+                                         size_t active_voxels, const double *rank_seconds,
+                                         const size_t *rank_counts, int num_ranks, const uint64_t *rank_perf) {
+    int to_stdout = strcmp(path, "-") == 0;
+    FILE *fp = to_stdout ? (stage_json_stdout ? stage_json_stdout : stdout) : fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to open %s for writing\n", path);
+        return -1;
+    }
+
+    fprintf(fp, "{\n  \"engine\": ");
+    stage_json_string(fp, engine);
+    fprintf(fp, ",\n  \"workers\": %d,\n  \"volume\": {\"path\": ", workers);
+    stage_json_string(fp, cfg->path);
+    fprintf(fp, ", \"dims\": [%u, %u, %u], \"threshold\": %u},\n", cfg->x_size, cfg->y_size, cfg->z_size,
+            cfg->threshold);
+    fprintf(fp, "  \"key_bits\": %d,\n  \"kernel\": ", MORTON_KEY_BITS);
+    stage_json_string(fp, kernel);
+    fprintf(fp, ",\n  \"active_voxels\": %zu,\n  \"total_seconds\": %.6f,\n  \"stages\": ", active_voxels,
+            stage_total(st));
+    stage_json_stages(fp, st->seconds);
+    if (rank_perf || st->perf_threads > 0) {
+        uint64_t totals[STAGE_COUNT * PERF_NUM_EVENTS];
+        if (rank_perf) {
+            memset(totals, 0, sizeof(totals));
+            for (int r = 0; r < num_ranks; ++r) {
+                for (int s = 0; s < STAGE_COUNT * PERF_NUM_EVENTS; s += PERF_NUM_EVENTS) {
+                    perf_counts_add(totals + s, rank_perf + (size_t)r * STAGE_COUNT * PERF_NUM_EVENTS + s);
+                }
+            }
+        } else {
+            stage_perf_totals(st, totals);
+        }
+        fprintf(fp, ",\n  \"counters\": ");
+        stage_json_counters(fp, totals);
+    }
+
+    if (st->pool) {
+        fprintf(fp, ",\n  \"threads\": [");
+        for (int i = 0; i < st->pool->num_threads; ++i) {
+            const pool_worker_t *w = &st->pool->workers[i];
+            fprintf(fp, "%s\n    {\"id\": %d, \"busy\": %.6f, \"idle\": %.6f, \"tasks\": %zu, \"steals\": %zu, ",
+                    i ? "," : "", i, w->busy_time, w->idle_time, w->tasks_run, w->steals);
+            fprintf(fp, "\"stages\": ");
+            stage_json_stages(fp, st->worker_seconds + i * STAGE_COUNT);
+            if (st->perf_threads > 0) {
+                fprintf(fp, ", \"counters\": ");
+                stage_json_counters(fp, st->perf_counts + (size_t)(i + 1) * STAGE_COUNT * PERF_NUM_EVENTS);
+            }
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "\n  ]");
+    }
+    if (rank_seconds) {
+        fprintf(fp, ",\n  \"ranks\": [");
+        for (int r = 0; r < num_ranks; ++r) {
+            fprintf(fp, "%s\n    {\"rank\": %d, \"codes\": %zu, \"stages\": ", r ? "," : "", r, rank_counts[r]);
+            stage_json_stages(fp, rank_seconds + r * STAGE_COUNT);
+            if (rank_perf) {
+                fprintf(fp, ", \"counters\": ");
+                stage_json_counters(fp, rank_perf + (size_t)r * STAGE_COUNT * PERF_NUM_EVENTS);
+            }
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "\n  ]");
+    }
+    fprintf(fp, "\n}\n");
+
+    int rc = fflush(fp) != 0 || ferror(fp) ? -1 : 0;
+    if (!to_stdout && fclose(fp) != 0) rc = -1;
+    return rc;
+}
+
+#endif // STAGE_TIMER_H
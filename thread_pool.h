@@ -0,0 +1,292 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Persistent worker pool with work stealing. pool_run executes tasks
+// 0..num_tasks-1: each worker starts with a contiguous block of task ids,
+// takes from the front of its own block and, once that is empty, steals the
+// back half of another worker's block. Which worker runs a task is not
+// deterministic, so tasks write their results to slots indexed by task id.
+// pool_run_owned turns stealing off, so every task runs on the worker whose
+// block holds it; callers use it when a task's placement matters, e.g. to
+// keep memory a worker first-touched on that worker.
+
+// Upper bound on workers; far more than any machine has cores, so a larger
+// request is a typo rather than a configuration
+#define POOL_MAX_THREADS 1024
+
+typedef void (*pool_task_fn)(void *ctx, size_t task, int worker);
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head; // next task to run
+    size_t tail; // one past the last task owned
+    double busy_time;
+    double idle_time;
+    double run_busy_time;
+    size_t tasks_run;
+    size_t steals;
+    pid_t tid; // kernel thread id, for per-thread counters
+    char pad[64];
+} pool_worker_t;
+
+typedef struct thread_pool {
+    int num_threads;
+    pthread_t *threads;
+    pool_worker_t *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cv;
+    pthread_cond_t done_cv;
+    uint64_t generation;
+    int running;
+    int shutdown;
+    int steal; // whether the current run may steal
+
+    pool_task_fn fn;
+    void *ctx;
+} thread_pool_t;
+
+typedef struct {
+    thread_pool_t *pool;
+    int worker;
+} pool_thread_arg_t;
+
+static inline double pool_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Takes the next task from the worker's own block, or steals half of a
+// victim's remaining block. Returns 0 once no worker has tasks left.
+static inline int pool_next_task(thread_pool_t *pool, int id, size_t *task) {
+    pool_worker_t *self = &pool->workers[id];
+
+    pthread_mutex_lock(&self->lock);
+    if (self->head < self->tail) {
+        *task = self->head++;
+        pthread_mutex_unlock(&self->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    for (int k = 1; pool->steal && k < pool->num_threads; ++k) {
+        pool_worker_t *victim = &pool->workers[(id + k) % pool->num_threads];
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->tail - victim->head;
+        if (remaining == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        size_t mid = victim->tail - (remaining + 1) / 2;
+        size_t stolen_tail = victim->tail;
+        victim->tail = mid;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&self->lock);
+        self->head = mid + 1;
+        self->tail = stolen_tail;
+        self->steals++;
+        pthread_mutex_unlock(&self->lock);
+        *task = mid;
+        return 1;
+    }
+    return 0;
+}
+
+static inline void *pool_thread_main(void *arg) {
+    pool_thread_arg_t *thread_arg = (pool_thread_arg_t *)arg;
+    thread_pool_t *pool = thread_arg->pool;
+    int id = thread_arg->worker;
+    pool_worker_t *self = &pool->workers[id];
+    uint64_t seen = 0;
+    free(thread_arg);
+
+#ifdef __linux__
+    self->tid = (pid_t)syscall(SYS_gettid);
+#endif
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+        pthread_cond_signal(&pool->done_cv);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start_cv, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t task;
+        double busy = 0.0;
+        while (pool_next_task(pool, id, &task)) {
+            double t0 = pool_now();
+            pool->fn(pool->ctx, task, id);
+            busy += pool_now() - t0;
+            self->tasks_run++;
+        }
+        self->run_busy_time = busy;
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done_cv);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static inline void pool_destroy(thread_pool_t *pool);
+
+// Starts num_threads workers. Returns NULL when the count is out of range
+// or a worker cannot be allocated or started; workers already started are
+// then shut down again.
+static inline thread_pool_t *pool_create(int num_threads) {
+    if (num_threads <= 0 || num_threads > POOL_MAX_THREADS) {
+        return NULL;
+    }
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->num_threads = num_threads;
+    pool->threads = malloc(num_threads * sizeof(pthread_t));
+    pool->workers = calloc(num_threads, sizeof(pool_worker_t));
+    if (!pool->threads || !pool->workers) {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+
+    // Every worker checks in once it has started, so its tid is known
+    pool->running = num_threads;
+    int started = 0;
+    for (; started < num_threads; ++started) {
+        pthread_mutex_init(&pool->workers[started].lock, NULL);
+        pool_thread_arg_t *arg = malloc(sizeof(pool_thread_arg_t));
+        if (!arg) {
+            pthread_mutex_destroy(&pool->workers[started].lock);
+            break;
+        }
+        arg->pool = pool;
+        arg->worker = started;
+        if (pthread_create(&pool->threads[started], NULL, pool_thread_main, arg) != 0) {
+            free(arg);
+            pthread_mutex_destroy(&pool->workers[started].lock);
+            break;
+        }
+    }
+    if (started < num_threads) {
+        // The started workers never see running reach 0; they wait for a
+        // run until shutdown tells them to leave
+        pool->num_threads = started;
+        pool_destroy(pool);
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pool;
+}
+
+// The block of task ids worker i starts a run with
+static inline void pool_block(size_t num_tasks, int num_threads, int i, size_t *begin, size_t *end) {
+    size_t per_worker = num_tasks / num_threads;
+    size_t remainder = num_tasks % num_threads;
+    *begin = i * per_worker + ((size_t)i < remainder ? (size_t)i : remainder);
+    *end = *begin + per_worker + ((size_t)i < remainder ? 1 : 0);
+}
+
+static inline void pool_run_mode(thread_pool_t *pool, size_t num_tasks, pool_task_fn fn, void *ctx, int steal) {
+    int n = pool->num_threads;
+
+    for (int i = 0; i < n; ++i) {
+        pool_worker_t *w = &pool->workers[i];
+        pthread_mutex_lock(&w->lock);
+        pool_block(num_tasks, n, i, &w->head, &w->tail);
+        w->run_busy_time = 0.0;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    double t0 = pool_now();
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->steal = steal;
+    pool->running = n;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cv);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    double wall = pool_now() - t0;
+
+    for (int i = 0; i < n; ++i) {
+        pool_worker_t *w = &pool->workers[i];
+        w->busy_time += w->run_busy_time;
+        w->idle_time += wall - w->run_busy_time;
+    }
+}
+
+// Runs fn(ctx, task, worker) for every task in [0, num_tasks) and returns
+// when all of them have finished.
+static inline void pool_run(thread_pool_t *pool, size_t num_tasks, pool_task_fn fn, void *ctx) {
+    pool_run_mode(pool, num_tasks, fn, ctx, 1);
+}
+
+// Like pool_run, but worker i runs exactly the tasks of pool_block(i)
+static inline void pool_run_owned(thread_pool_t *pool, size_t num_tasks, pool_task_fn fn, void *ctx) {
+    pool_run_mode(pool, num_tasks, fn, ctx, 0);
+}
+
+static inline void pool_print_stats(const thread_pool_t *pool, FILE *fp) {
+    fprintf(fp, "Thread pool statistics:\n");
+    for (int i = 0; i < pool->num_threads; ++i) {
+        const pool_worker_t *w = &pool->workers[i];
+        fprintf(fp, "  Thread %d: busy %.3f s, idle %.3f s, tasks %zu, steals %zu\n", i, w->busy_time,
+                w->idle_time, w->tasks_run, w->steals);
+    }
+}
+
+static inline void pool_destroy(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start_cv);
+    pthread_cond_destroy(&pool->done_cv);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+#endif // THREAD_POOL_H
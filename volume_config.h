@@ -0,0 +1,175 @@
+#ifndef VOLUME_CONFIG_H
+#define VOLUME_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "morton.h"
+
+// Defaults match the original c8.raw dataset
+#define VOLUME_DEFAULT_PATH "c8.raw"
+#define VOLUME_DEFAULT_X 1024
+#define VOLUME_DEFAULT_Y 1024
+#define VOLUME_DEFAULT_Z 314
+#define VOLUME_DEFAULT_THRESHOLD 25
+
+#define VOLUME_PATH_MAX 4096
+
+// Layout of the raw 8-bit input volume and the activity threshold. Filled
+// from the defaults, then from a header file and/or command-line options.
+typedef struct {
+    char path[VOLUME_PATH_MAX];
+    uint32_t x_size;
+    uint32_t y_size;
+    uint32_t z_size;
+    uint8_t threshold;
+} volume_config_t;
+
+static inline void volume_config_defaults(volume_config_t *cfg) {
+    snprintf(cfg->path, sizeof(cfg->path), "%s", VOLUME_DEFAULT_PATH);
+    cfg->x_size = VOLUME_DEFAULT_X;
+    cfg->y_size = VOLUME_DEFAULT_Y;
+    cfg->z_size = VOLUME_DEFAULT_Z;
+    cfg->threshold = VOLUME_DEFAULT_THRESHOLD;
+}
+
+static inline size_t volume_total_voxels(const volume_config_t *cfg) {
+    return (size_t)cfg->x_size * cfg->y_size * cfg->z_size;
+}
+
+static inline size_t volume_slab_voxels(const volume_config_t *cfg) {
+    return (size_t)cfg->x_size * cfg->y_size;
+}
+
+static inline int volume_parse_u32(const char *text, uint32_t max, uint32_t *value) {
+    char *end;
+    unsigned long long v = strtoull(text, &end, 10);
+    if (end == text || *end != '\0' || v > max) {
+        return -1;
+    }
+    *value = (uint32_t)v;
+    return 0;
+}
+
+// Reads a MetaImage (.mhd) or NRRD style header. Recognised keys are
+// DimSize / sizes, ElementDataFile / data file and Threshold; the data file
+// is resolved relative to the header's directory.
+static inline int volume_config_load_header(volume_config_t *cfg, const char *header_path) {
+    FILE *fp = fopen(header_path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Failed to open header %s\n", header_path);
+        return -1;
+    }
+
+    char line[VOLUME_PATH_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        char *sep = strpbrk(line, "=:");
+        if (!sep) continue;
+        char *key = line;
+        char *value = sep + 1;
+        *sep = '\0';
+        while (isspace((unsigned char)*key)) key++;
+        for (char *e = sep - 1; e >= key && isspace((unsigned char)*e); --e) *e = '\0';
+        while (isspace((unsigned char)*value)) value++;
+        value[strcspn(value, "\r\n")] = '\0';
+
+        if (strcasecmp(key, "DimSize") == 0 || strcasecmp(key, "sizes") == 0) {
+            unsigned long x, y, z;
+            if (sscanf(value, "%lu %lu %lu", &x, &y, &z) != 3 || !x || !y || !z || x > UINT32_MAX ||
+                y > UINT32_MAX || z > UINT32_MAX) {
+                fprintf(stderr, "Error: Invalid dimensions '%s' in %s\n", value, header_path);
+                fclose(fp);
+                return -1;
+            }
+            cfg->x_size = (uint32_t)x;
+            cfg->y_size = (uint32_t)y;
+            cfg->z_size = (uint32_t)z;
+        } else if (strcasecmp(key, "ElementDataFile") == 0 || strcasecmp(key, "data file") == 0) {
+            const char *slash = strrchr(header_path, '/');
+            if (value[0] != '/' && slash) {
+                snprintf(cfg->path, sizeof(cfg->path), "%.*s/%s", (int)(slash - header_path), header_path, value);
+            } else {
+                snprintf(cfg->path, sizeof(cfg->path), "%s", value);
+            }
+        } else if (strcasecmp(key, "Threshold") == 0) {
+            uint32_t t;
+            if (volume_parse_u32(value, UINT8_MAX, &t) != 0) {
+                fprintf(stderr, "Error: Invalid threshold '%s' in %s\n", value, header_path);
+                fclose(fp);
+                return -1;
+            }
+            cfg->threshold = (uint8_t)t;
+        } else if ((strcasecmp(key, "ElementType") == 0 && strcasecmp(value, "MET_UCHAR") != 0) ||
+                   (strcasecmp(key, "type") == 0 && strcasecmp(value, "uchar") != 0 &&
+                    strcasecmp(value, "uint8") != 0 && strcasecmp(value, "unsigned char") != 0)) {
+            fprintf(stderr, "Error: Only 8-bit unsigned volumes are supported (%s)\n", value);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Consumes one volume option at argv[*i], advancing *i past its values.
+// Returns 1 if the option was handled, 0 if it is not a volume option and
+// -1 on a malformed option.
+static inline int volume_config_parse_arg(volume_config_t *cfg, int argc, char *argv[], int *i) {
+    const char *opt = argv[*i];
+
+    if (strcmp(opt, "--input") == 0 && *i + 1 < argc) {
+        snprintf(cfg->path, sizeof(cfg->path), "%s", argv[++*i]);
+        return 1;
+    }
+    if (strcmp(opt, "--header") == 0 && *i + 1 < argc) {
+        return volume_config_load_header(cfg, argv[++*i]) == 0 ? 1 : -1;
+    }
+    if (strcmp(opt, "--dims") == 0 && *i + 3 < argc) {
+        if (volume_parse_u32(argv[*i + 1], UINT32_MAX, &cfg->x_size) != 0 ||
+            volume_parse_u32(argv[*i + 2], UINT32_MAX, &cfg->y_size) != 0 ||
+            volume_parse_u32(argv[*i + 3], UINT32_MAX, &cfg->z_size) != 0 || !cfg->x_size || !cfg->y_size ||
+            !cfg->z_size) {
+            fprintf(stderr, "Error: Invalid dimensions\n");
+            return -1;
+        }
+        *i += 3;
+        return 1;
+    }
+    if (strcmp(opt, "--threshold") == 0 && *i + 1 < argc) {
+        uint32_t t;
+        if (volume_parse_u32(argv[++*i], UINT8_MAX, &t) != 0) {
+            fprintf(stderr, "Error: Invalid threshold %s\n", argv[*i]);
+            return -1;
+        }
+        cfg->threshold = (uint8_t)t;
+        return 1;
+    }
+    return 0;
+}
+
+// Rejects volumes whose coordinates do not fit this build's Morton keys
+static inline int volume_config_check(const volume_config_t *cfg) {
+    morton_grid_t grid = morton_grid(cfg->x_size, cfg->y_size, cfg->z_size);
+    if (!morton_grid_fits(&grid)) {
+        fprintf(stderr,
+                "Error: Volume %ux%ux%u needs more than %d bits per axis; rebuild with -DMORTON_KEY_BITS=64\n",
+                cfg->x_size, cfg->y_size, cfg->z_size, MORTON_COORD_BITS);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void volume_config_usage(FILE *fp) {
+    fprintf(fp, "Volume options:\n");
+    fprintf(fp, "  --input PATH       raw 8-bit volume (default %s)\n", VOLUME_DEFAULT_PATH);
+    fprintf(fp, "  --dims X Y Z       volume dimensions (default %d %d %d)\n", VOLUME_DEFAULT_X, VOLUME_DEFAULT_Y,
+            VOLUME_DEFAULT_Z);
+    fprintf(fp, "  --threshold T      voxels above T are active (default %d)\n", VOLUME_DEFAULT_THRESHOLD);
+    fprintf(fp, "  --header FILE      read dimensions, data file and threshold from a .mhd/.nhdr header\n");
+}
+
+#endif // VOLUME_CONFIG_H
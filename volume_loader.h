@@ -0,0 +1,230 @@
+#ifndef VOLUME_LOADER_H
+#define VOLUME_LOADER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Pipelined volume reader. A background thread reads the file in blocks
+// into a ring of buffers while the caller scans the blocks already loaded,
+// so load time and scan time overlap instead of adding up.
+//
+// With dest == NULL the loader owns num_buffers block-sized buffers and the
+// caller hands each block back with loader_release once it is done with it.
+// With a dest buffer every block lands at its final place in dest and
+// nothing is reused, which suits callers that need the whole volume later.
+
+// Default block size; callers round it to whole slabs
+#define LOADER_BLOCK_BYTES ((size_t)8 << 20)
+#define LOADER_NUM_BUFFERS 4
+
+typedef struct {
+    int fd;
+    off_t file_offset;
+    size_t total_bytes;
+    size_t block_bytes;
+    size_t num_blocks;
+    int num_buffers;
+    uint8_t *ring;
+    uint8_t *dest;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    size_t blocks_loaded;   // written by the reader
+    size_t blocks_released; // written by the caller
+    size_t blocks_taken;
+    int error;
+    int stop;
+    double wait_time; // time the caller spent waiting for data
+} volume_loader_t;
+
+static inline double loader_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint8_t *loader_block_ptr(volume_loader_t *l, size_t block) {
+    if (l->dest) {
+        return l->dest + block * l->block_bytes;
+    }
+    return l->ring + (block % l->num_buffers) * l->block_bytes;
+}
+
+static inline size_t loader_block_len(const volume_loader_t *l, size_t block) {
+    size_t start = block * l->block_bytes;
+    return l->total_bytes - start < l->block_bytes ? l->total_bytes - start : l->block_bytes;
+}
+
+// Reads len bytes at pos, retrying short reads. Returns 0, or -1 on an
+// error or a file shorter than expected.
+static inline int loader_pread(int fd, uint8_t *buf, size_t len, off_t pos) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fd, buf + done, len - done, pos + (off_t)done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+static inline void *loader_thread_main(void *arg) {
+    volume_loader_t *l = (volume_loader_t *)arg;
+
+    for (size_t b = 0; b < l->num_blocks; ++b) {
+        // In ring mode wait for the caller to free the slot this block reuses
+        pthread_mutex_lock(&l->lock);
+        while (!l->dest && !l->stop && b - l->blocks_released >= (size_t)l->num_buffers) {
+            pthread_cond_wait(&l->cv, &l->lock);
+        }
+        int stop = l->stop;
+        pthread_mutex_unlock(&l->lock);
+        if (stop) {
+            break;
+        }
+
+        uint8_t *buf = loader_block_ptr(l, b);
+        size_t len = loader_block_len(l, b);
+        off_t pos = l->file_offset + (off_t)(b * l->block_bytes);
+        int failed = loader_pread(l->fd, buf, len, pos) != 0;
+
+        pthread_mutex_lock(&l->lock);
+        if (failed) {
+            l->error = 1;
+        } else {
+            l->blocks_loaded = b + 1;
+        }
+        pthread_cond_broadcast(&l->cv);
+        pthread_mutex_unlock(&l->lock);
+        if (failed) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Starts loading total_bytes bytes of path from file_offset. block_bytes
+// should be a multiple of whatever unit the caller scans in.
+static inline int loader_open(volume_loader_t *l, const char *path, size_t file_offset, size_t total_bytes,
+                              size_t block_bytes, int num_buffers, uint8_t *dest) {
+    *l = (volume_loader_t){.fd = -1};
+    l->fd = open(path, O_RDONLY);
+    if (l->fd < 0) {
+        fprintf(stderr, "Error: Failed to open %s\n", path);
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(l->fd, (off_t)file_offset, (off_t)total_bytes, POSIX_FADV_SEQUENTIAL);
+#endif
+    l->file_offset = (off_t)file_offset;
+    l->total_bytes = total_bytes;
+    l->block_bytes = block_bytes > 0 ? block_bytes : 1;
+    l->num_blocks = (total_bytes + l->block_bytes - 1) / l->block_bytes;
+    l->num_buffers = num_buffers > 0 ? num_buffers : 1;
+    l->dest = dest;
+    if (!dest && l->num_blocks > 0) {
+        size_t ring_blocks = l->num_blocks < (size_t)l->num_buffers ? l->num_blocks : (size_t)l->num_buffers;
+        l->ring = malloc(ring_blocks * l->block_bytes);
+        if (!l->ring) {
+            fprintf(stderr, "Error: Failed to allocate loader buffers\n");
+            close(l->fd);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cv, NULL);
+    if (pthread_create(&l->thread, NULL, loader_thread_main, l) != 0) {
+        fprintf(stderr, "Error: Failed to start loader thread\n");
+        pthread_mutex_destroy(&l->lock);
+        pthread_cond_destroy(&l->cv);
+        free(l->ring);
+        close(l->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Waits for the next block. Returns 1 with the block's data, its byte
+// offset from the start of the loaded range and its length; 0 once every
+// block has been handed out; -1 on a read error.
+static inline int loader_next(volume_loader_t *l, const uint8_t **data, size_t *start, size_t *len) {
+    if (l->blocks_taken == l->num_blocks) {
+        return 0;
+    }
+    double t0 = loader_now();
+    pthread_mutex_lock(&l->lock);
+    while (l->blocks_loaded <= l->blocks_taken && !l->error) {
+        pthread_cond_wait(&l->cv, &l->lock);
+    }
+    int ready = l->blocks_loaded > l->blocks_taken;
+    pthread_mutex_unlock(&l->lock);
+    l->wait_time += loader_now() - t0;
+    if (!ready) {
+        return -1;
+    }
+
+    size_t b = l->blocks_taken++;
+    *data = loader_block_ptr(l, b);
+    *start = b * l->block_bytes;
+    *len = loader_block_len(l, b);
+    return 1;
+}
+
+// Hands the oldest block taken with loader_next back to the reader
+static inline void loader_release(volume_loader_t *l) {
+    pthread_mutex_lock(&l->lock);
+    l->blocks_released++;
+    pthread_cond_broadcast(&l->cv);
+    pthread_mutex_unlock(&l->lock);
+}
+
+// Stops the reader and frees the ring. Returns -1 if a read failed.
+static inline int loader_close(volume_loader_t *l) {
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_broadcast(&l->cv);
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->thread, NULL);
+
+    int rc = l->error ? -1 : 0;
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->cv);
+    free(l->ring);
+    close(l->fd);
+    return rc;
+}
+
+// Loads the whole range into dest through the same reader
+static inline int loader_read_all(const char *path, size_t file_offset, size_t total_bytes, uint8_t *dest) {
+    volume_loader_t l;
+    if (loader_open(&l, path, file_offset, total_bytes, LOADER_BLOCK_BYTES, 1, dest) != 0) {
+        return -1;
+    }
+    const uint8_t *block;
+    size_t start, len;
+    int rc;
+    while ((rc = loader_next(&l, &block, &start, &len)) == 1) {
+    }
+    if (loader_close(&l) != 0 || rc < 0) {
+        fprintf(stderr, "Error: Failed to read data from %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Block size for slab-by-slab consumers: the default rounded to whole slabs
+static inline size_t loader_slab_block_bytes(size_t slab_bytes) {
+    size_t slabs = LOADER_BLOCK_BYTES / slab_bytes;
+    return (slabs > 0 ? slabs : 1) * slab_bytes;
+}
+
+#endif // VOLUME_LOADER_H